@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+'''
+Compare the thread engine against the loop engine on the same number of streams
+
+A built-in HTTP server feeds every stream from one sample MPEG-TS file at its real-time rate, then
+nvr runs against it with each engine for a while, and its rusage is collected through wait4()
+
+Create a sample with e.g.:
+  ffmpeg -f lavfi -i testsrc2=size=1280x720:rate=25 -t 60 -c:v libx264 -g 50 -f mpegts sample.ts
+'''
+
+import argparse
+import http.server
+import os
+import resource
+import shutil
+import signal
+import socketserver
+import subprocess
+import tempfile
+import threading
+import time
+
+class StreamHandler(http.server.BaseHTTPRequestHandler):
+    sample = b''
+    rate = 0
+
+    def do_GET(self):
+        self.send_response(200)
+        self.send_header('Content-Type', 'video/mp2t')
+        self.end_headers()
+        chunk = 188 * 64
+        interval = chunk / self.rate
+        deadline = time.monotonic()
+        try:
+            while True:
+                for offset in range(0, len(self.sample) - chunk + 1, chunk):
+                    self.wfile.write(self.sample[offset:offset + chunk])
+                    deadline += interval
+                    delay = deadline - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def log_message(self, format, *args):
+        pass
+
+class StreamServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+def proc_status(pid, key):
+    with open(f'/proc/{pid}/status') as f:
+        for line in f:
+            if line.startswith(f'{key}:'):
+                return int(line.split()[1])
+    return 0
+
+def run(binary, engine, streams, port, duration):
+    storage = tempfile.mkdtemp(prefix=f'nvr-bench-{engine}-')
+    args = [binary, '--record-mode', 'persistent', '--engine', engine, '--storage', f'{storage}:1%:2%']
+    for i in range(streams):
+        args += ['--camera', f'bench{i}:bench{i}_%Y%m%d_%H%M%S:http://127.0.0.1:{port}/{i}']
+    process = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    rss = []
+    threads = 0
+    end = time.monotonic() + duration
+    while time.monotonic() < end and process.poll() is None:
+        time.sleep(1)
+        rss.append(proc_status(process.pid, 'VmRSS'))
+        threads = max(threads, proc_status(process.pid, 'Threads'))
+    process.send_signal(signal.SIGKILL)
+    _, _, usage = os.wait4(process.pid, 0)
+    shutil.rmtree(storage, ignore_errors=True)
+    cpu = usage.ru_utime + usage.ru_stime
+    switches = usage.ru_nvcsw + usage.ru_nivcsw
+    steady = rss[len(rss) // 2:] or [0]
+    return {
+        'engine': engine,
+        'rss_mib': sum(steady) / len(steady) / 1024,
+        'rss_kib_per_stream': sum(steady) / len(steady) / streams,
+        'maxrss_mib': usage.ru_maxrss / 1024,
+        'threads': threads,
+        'switches_per_stream_per_s': switches / streams / duration,
+        'cpu_percent_per_stream': cpu / streams / duration * 100,
+    }
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--nvr', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'nvr'))
+    parser.add_argument('--sample', required=True, help='MPEG-TS file served to every stream')
+    parser.add_argument('--sample-duration', type=float, required=True, help='duration of the sample in seconds, to pace it')
+    parser.add_argument('--streams', type=int, default=100)
+    parser.add_argument('--duration', type=int, default=60, help='seconds to run each engine')
+    parser.add_argument('--port', type=int, default=18554)
+    args = parser.parse_args()
+    with open(args.sample, 'rb') as f:
+        StreamHandler.sample = f.read()
+    StreamHandler.rate = len(StreamHandler.sample) / args.sample_duration
+    server = StreamServer(('127.0.0.1', args.port), StreamHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    results = [run(args.nvr, engine, args.streams, args.port, args.duration) for engine in ('thread', 'loop')]
+    server.shutdown()
+    print(f'{args.streams} streams, {args.duration}s each, {StreamHandler.rate * 8 / 1000:.0f} kbit/s per stream')
+    print(f'{"engine":<8}{"RSS MiB":>10}{"KiB/stream":>12}{"max RSS MiB":>13}{"threads":>9}{"ctxsw/stream/s":>16}{"CPU%/stream":>13}')
+    for r in results:
+        print(f'{r["engine"]:<8}{r["rss_mib"]:>10.1f}{r["rss_kib_per_stream"]:>12.0f}{r["maxrss_mib"]:>13.1f}{r["threads"]:>9}{r["switches_per_stream_per_s"]:>16.1f}{r["cpu_percent_per_stream"]:>13.3f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+'''
+Compare fragmentation of segments written by many cameras at once, with and without preallocation
+
+Files are appended to round-robin in small writes like recorders do, once plainly and once after
+fallocate(FALLOC_FL_KEEP_SIZE) of their final size plus the headroom nvr adds, with the tail trimmed
+at close, then their extents are counted through FIEMAP; run it on the device to measure, e.g. an HDD
+'''
+
+import argparse
+import ctypes
+import ctypes.util
+import fcntl
+import os
+import shutil
+import struct
+import tempfile
+import time
+
+FALLOC_FL_KEEP_SIZE = 0x01
+FS_IOC_FIEMAP = 0xC020660B
+FIEMAP_MAX_OFFSET = 0xFFFFFFFFFFFFFFFF
+HEADROOM = 8
+
+libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+libc.fallocate.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int64, ctypes.c_int64]
+
+def fallocate(fd, mode, offset, length):
+    if libc.fallocate(fd, mode, offset, length):
+        errno = ctypes.get_errno()
+        raise OSError(errno, os.strerror(errno))
+
+def count_extents(fd):
+    request = bytearray(struct.pack('=QQIIII', 0, FIEMAP_MAX_OFFSET, 0, 0, 0, 0))
+    fcntl.ioctl(fd, FS_IOC_FIEMAP, request)
+    return struct.unpack_from('=QQIIII', request)[3]
+
+def run(folder, cameras, size, write_size, preallocate):
+    os.makedirs(folder)
+    fds = []
+    for i in range(cameras):
+        fd = os.open(os.path.join(folder, f'camera{i:03}.mkv'), os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+        if preallocate:
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size + size // HEADROOM)
+        fds.append(fd)
+    chunk = os.urandom(write_size)
+    time_start = time.monotonic()
+    for _ in range(size // write_size):
+        for fd in fds:
+            os.write(fd, chunk)
+    extents = []
+    for fd in fds:
+        if preallocate:
+            os.ftruncate(fd, size)
+        os.fsync(fd)
+        extents.append(count_extents(fd))
+        os.close(fd)
+    elapsed = time.monotonic() - time_start
+    shutil.rmtree(folder)
+    return {
+        'mode': 'fallocate' if preallocate else 'plain',
+        'extents_avg': sum(extents) / len(extents),
+        'extents_max': max(extents),
+        'seconds': elapsed,
+    }
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--root', default=os.path.join(tempfile.gettempdir(), 'nvr-bench-fragment'))
+    parser.add_argument('--cameras', type=int, default=32)
+    parser.add_argument('--size', type=int, default=64 * 0x100000, help='bytes per segment')
+    parser.add_argument('--write-size', type=int, default=0x40000, help='bytes per write, the segment I/O buffer by default')
+    args = parser.parse_args()
+    results = [run(os.path.join(args.root, mode), args.cameras, args.size, args.write_size, mode == 'fallocate') for mode in ('plain', 'fallocate')]
+    print(f'{args.cameras} segments of {args.size // 0x100000} MiB written {args.write_size // 0x400} KiB at a time, {args.root}')
+    print(f'{"mode":<11}{"extents avg":>12}{"extents max":>12}{"seconds":>10}')
+    for r in results:
+        print(f'{r["mode"]:<11}{r["extents_avg"]:>12.1f}{r["extents_max"]:>12}{r["seconds"]:>10.2f}')
+
+if __name__ == '__main__':
+    main()
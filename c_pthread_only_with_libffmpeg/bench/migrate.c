@@ -0,0 +1,102 @@
+/* Driver for bench/migrate.py, moves every file in one folder to another either one by one with
+   sendfile() like move_between_fs() does, page cache policy included, or all at once through the
+   io_uring migrate engine */
+#include "migrate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/limits.h>
+
+static int move_sendfile(char const *path_old, char const *path_new) {
+    struct stat st;
+    int fin = open(path_old, O_RDONLY);
+    if (fin < 0 || fstat(fin, &st) < 0) {
+        return 1;
+    }
+    int fout = open(path_new, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fout < 0) {
+        return 2;
+    }
+    struct writeback writeback;
+    writeback_init(&writeback, NULL);
+    size_t remain = st.st_size;
+    while (remain) {
+        ssize_t r = sendfile(fout, fin, NULL, remain > WRITEBACK_WINDOW ? WRITEBACK_WINDOW : remain);
+        if (r < 0) {
+            return 3;
+        }
+        remain -= r;
+        writeback_drop(fin, st.st_size - remain - r, r);
+        writeback_written(&writeback, fout, st.st_size - remain);
+    }
+    writeback_finish(&writeback, fout);
+    writeback_drop(fin, 0, 0);
+    struct timespec const times[2] = {st.st_atim, st.st_mtim};
+    futimens(fout, times);
+    close(fin);
+    close(fout);
+    return unlink(path_old) < 0;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "%s [from] [to] [sendfile|uring]\n", argv[0]);
+        return 1;
+    }
+    DIR *dir = opendir(argv[1]);
+    if (!dir) {
+        perror("opendir");
+        return 2;
+    }
+    size_t count = 0, alloc = 0x100;
+    struct migrate_item *items = malloc(sizeof *items * alloc);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_type != DT_REG) {
+            continue;
+        }
+        if (count == alloc) {
+            items = realloc(items, sizeof *items * (alloc *= 2));
+        }
+        char *path_old = malloc(PATH_MAX), *path_new = malloc(PATH_MAX);
+        snprintf(path_old, PATH_MAX, "%s/%s", argv[1], entry->d_name);
+        snprintf(path_new, PATH_MAX, "%s/%s", argv[2], entry->d_name);
+        items[count].path_old = path_old;
+        items[count++].path_new = path_new;
+    }
+    closedir(dir);
+    unsigned long long bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct stat st;
+        if (!stat(items[i].path_old, &st)) {
+            bytes += st.st_size;
+        }
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t failed = 0;
+    if (!strcmp(argv[3], "sendfile")) {
+        for (size_t i = 0; i < count; ++i) {
+            failed += move_sendfile(items[i].path_old, items[i].path_new) != 0;
+        }
+    } else {
+        struct migrate migrate;
+        if (migrate_init(&migrate, true, NULL, NULL) || !migrate.available || migrate_batch(&migrate, items, count)) {
+            fprintf(stderr, "io_uring not usable\n");
+            return 3;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            failed += items[i].result != 0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%zu %zu %llu %.3f\n", count, failed, bytes, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
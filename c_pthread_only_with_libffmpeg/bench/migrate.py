@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+'''
+Compare moving segments between storages with the sendfile() loop against the io_uring migrate engine
+
+Segment-sized files of random data are written into --from, then the driver in bench/migrate.c moves
+them all to --to with each method and back, so both see the same files; put --from and --to on the
+two filesystems to measure, e.g. a hot SSD and a warm RAID, as root page cache is dropped before every run
+'''
+
+import argparse
+import os
+import subprocess
+import tempfile
+
+def populate(folder, files, size):
+    os.makedirs(folder, exist_ok=True)
+    chunk = os.urandom(min(size, 0x100000))
+    for i in range(files):
+        path = os.path.join(folder, f'segment{i:05}.mkv')
+        if os.path.exists(path) and os.path.getsize(path) == size:
+            continue
+        with open(path, 'wb') as f:
+            written = 0
+            while written < size:
+                written += f.write(chunk[:size - written])
+
+def drop_caches():
+    if os.geteuid():
+        return False
+    os.sync()
+    with open('/proc/sys/vm/drop_caches', 'w') as f:
+        f.write('3')
+    return True
+
+def run(driver, source, target, method):
+    cold = drop_caches()
+    result = subprocess.run([driver, source, target, method], check=True, capture_output=True, text=True)
+    files, failed, size, seconds = result.stdout.splitlines()[-1].split()
+    os.sync()
+    return int(files), int(failed), int(size), float(seconds), cold
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--from', dest='source', default=os.path.join(tempfile.gettempdir(), 'nvr-bench-migrate-from'))
+    parser.add_argument('--to', dest='target', default=os.path.join(tempfile.gettempdir(), 'nvr-bench-migrate-to'))
+    parser.add_argument('--files', type=int, default=32)
+    parser.add_argument('--size', type=int, default=64 * 0x100000, help='bytes per file')
+    parser.add_argument('--rounds', type=int, default=2)
+    parser.add_argument('--cc', default=os.environ.get('CC', 'cc'))
+    args = parser.parse_args()
+    driver = os.path.join(tempfile.gettempdir(), 'nvr-bench-migrate-driver')
+    subprocess.run([args.cc, '-O2', '-I', os.path.join(here, '..', 'include'), '-o', driver,
+                    os.path.join(here, 'migrate.c'), os.path.join(here, '..', 'src', 'migrate.c'),
+                    os.path.join(here, '..', 'src', 'throttle.c'), os.path.join(here, '..', 'src', 'writeback.c')], check=True)
+    populate(args.source, args.files, args.size)
+    os.makedirs(args.target, exist_ok=True)
+    results = []
+    for _ in range(args.rounds):
+        for method in ('sendfile', 'uring'):
+            results.append((method,) + run(driver, args.source, args.target, method))
+            run(driver, args.target, args.source, 'sendfile')
+    print(f'{args.files} files of {args.size / 0x100000:.0f} MiB, {args.source} -> {args.target}')
+    print(f'{"method":<10}{"files":>7}{"failed":>8}{"seconds":>10}{"MiB/s":>10}{"cache":>7}')
+    for method, files, failed, size, seconds, cold in results:
+        print(f'{method:<10}{files:>7}{failed:>8}{seconds:>10.3f}{size / 0x100000 / seconds:>10.1f}{"cold" if cold else "warm":>7}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,72 @@
+/* Driver for bench/ring.py, fills the global budget with the rings of cameras whose disk stalled,
+   then checks a camera with a healthy disk still gets its keyframes and the rest of its GOPs through */
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RING_BYTES 0x1000000 /* 16 MiB, the default --ring-size */
+#define BUDGET_BYTES 0x2000000 /* 32 MiB */
+#define STALLED_RINGS 4
+#define PACKET_BYTES 0x10000
+#define KEYFRAME_BYTES 0x100000
+#define WRITER_LAG 4 /* Packets the healthy camera's writer lets pile up before draining its ring */
+#define GOP_PACKETS 50
+#define GOPS 100
+
+static int push(struct ring *const ring, size_t const size, bool const key) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt || av_new_packet(pkt, size)) {
+        fputs("Failed to allocate packet\n", stderr);
+        exit(2);
+    }
+    int const r = ring_push(ring, pkt, key);
+    av_packet_free(&pkt);
+    return r;
+}
+
+int main() {
+    static struct ring stalled[STALLED_RINGS];
+    static struct ring healthy;
+    ring_set_bytes_all_max(BUDGET_BYTES);
+    for (unsigned i = 0; i < STALLED_RINGS; ++i) {
+        if (ring_init(stalled + i, RING_BYTES)) {
+            return 2;
+        }
+    }
+    if (ring_init(&healthy, RING_BYTES)) {
+        return 2;
+    }
+    /* Nothing is ever popped from these, so they take all the global budget they're let to */
+    unsigned long stalled_pushed = 0;
+    for (unsigned i = 0; i < STALLED_RINGS; ++i) {
+        while (!push(stalled + i, PACKET_BYTES, false)) {
+            ++stalled_pushed;
+        }
+    }
+    /* The healthy camera's writer keeps up, only a few packets behind */
+    AVPacket *pkt = av_packet_alloc();
+    unsigned long refused_keys = 0, refused = 0;
+    for (unsigned gop = 0; gop < GOPS; ++gop) {
+        for (unsigned i = 0; i < GOP_PACKETS; ++i) {
+            if (push(&healthy, i ? PACKET_BYTES : KEYFRAME_BYTES, !i)) {
+                ++refused;
+                refused_keys += !i;
+            }
+            if (ring_count(&healthy) < WRITER_LAG) {
+                continue;
+            }
+            while (!ring_pop(&healthy, pkt)) {
+                av_packet_unref(pkt);
+            }
+        }
+    }
+    printf("%lu packets taken by %u stalled rings, healthy ring pressure %u%%\n", stalled_pushed, STALLED_RINGS, ring_pressure(&healthy));
+    printf("%lu of %u packets (%lu of %u keyframes) refused to the healthy ring\n", refused, GOPS * GOP_PACKETS, refused_keys, GOPS);
+    av_packet_free(&pkt);
+    ring_free(&healthy);
+    for (unsigned i = 0; i < STALLED_RINGS; ++i) {
+        ring_free(stalled + i);
+    }
+    return refused ? 1 : 0;
+}
@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+'''
+Check that packet rings stalled on one slow disk can't starve the other cameras under --memory-budget
+
+The driver in bench/ring.c fills the global budget with rings that are never drained, then pushes GOPs
+with large keyframes through a ring that's drained right away, like a camera on a healthy disk; it fails
+if any of those packets is refused
+'''
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--cc', default=os.environ.get('CC', 'cc'))
+    args = parser.parse_args()
+    driver = os.path.join(tempfile.gettempdir(), 'nvr-bench-ring-driver')
+    subprocess.run([args.cc, '-O2', '-I', os.path.join(here, '..', 'include'), '-o', driver,
+                    os.path.join(here, 'ring.c'), os.path.join(here, '..', 'src', 'ring.c'), '-lavcodec', '-lavutil', '-lpthread'], check=True)
+    result = subprocess.run([driver])
+    print('starved' if result.returncode else 'not starved')
+    sys.exit(result.returncode)
+
+if __name__ == '__main__':
+    main()
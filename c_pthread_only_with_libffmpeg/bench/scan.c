@@ -0,0 +1,86 @@
+/* Driver for bench/scan.py, walks a tree either like the single-threaded readdir() scan did,
+   or with the scanner, and stats every file in both cases like storages ordered by mtime do */
+#include "scanner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static atomic_ulong stats_done;
+
+static int scan_entry(void *arg, int dir_fd, char const *name, char const *subpath) {
+    (void)arg;
+    (void)subpath;
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) < 0) {
+        return 1;
+    }
+    atomic_fetch_add(&stats_done, 1);
+    return 0;
+}
+
+static int walk(DIR *dir, unsigned long *files, unsigned long *dirs) {
+    int const dir_fd = dirfd(dir);
+    struct dirent *entry;
+    ++*dirs;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (entry->d_type == DT_DIR) {
+            int const fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+            DIR *sub;
+            if (fd < 0 || !(sub = fdopendir(fd))) {
+                return 1;
+            }
+            int const r = walk(sub, files, dirs);
+            closedir(sub);
+            if (r) {
+                return r;
+            }
+        } else if (entry->d_type == DT_REG) {
+            struct stat st;
+            if (fstatat(dir_fd, entry->d_name, &st, 0) < 0) {
+                return 2;
+            }
+            ++*files;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "%s [root] [readdir|scanner] ([threads])\n", argv[0]);
+        return 1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long files = 0, dirs = 0;
+    if (!strcmp(argv[2], "readdir")) {
+        DIR *dir = opendir(argv[1]);
+        if (!dir || walk(dir, &files, &dirs)) {
+            perror("walk");
+            return 2;
+        }
+        closedir(dir);
+    } else {
+        if (argc > 3) {
+            scanner_parse_threads(argv[3]);
+        }
+        struct scanner_stats stats;
+        if (scanner_scan(argv[1], scan_entry, NULL, &stats)) {
+            return 3;
+        }
+        files = atomic_load(&stats_done);
+        dirs = stats.dirs;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%lu %lu %.3f\n", files, dirs, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
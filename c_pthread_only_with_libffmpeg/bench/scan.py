@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+'''
+Compare the single-threaded readdir() scan against the parallel getdents64 scanner on a synthetic storage
+
+A tree laid out like %Y%m%d/%H00/[camera]_%Y%m%d_%H%M%S.mkv is created with empty files (kept between
+runs), then the driver in bench/scan.c walks it with each method, stat-ing every file like a storage
+ordered by mtime does; as root, page cache is dropped before every run so the scan is bound by the disk
+'''
+
+import argparse
+import os
+import subprocess
+import tempfile
+
+def populate(root, files, cameras):
+    marker = os.path.join(root, '.populated')
+    if os.path.exists(marker):
+        with open(marker) as f:
+            if int(f.read()) == files:
+                return
+    created = 0
+    day = 0
+    while created < files:
+        for hour in range(24):
+            folder = os.path.join(root, f'2024{day // 28 % 12 + 1:02}{day % 28 + 1:02}', f'{hour:02}00')
+            os.makedirs(folder, exist_ok=True)
+            for second in range(0, 3600, 600):
+                for camera in range(cameras):
+                    if created == files:
+                        break
+                    open(os.path.join(folder, f'cam{camera}_{second:04}.mkv'), 'wb').close()
+                    created += 1
+        day += 1
+    with open(marker, 'w') as f:
+        f.write(str(files))
+
+def drop_caches():
+    if os.geteuid():
+        return False
+    os.sync()
+    with open('/proc/sys/vm/drop_caches', 'w') as f:
+        f.write('3')
+    return True
+
+def run(driver, root, method, threads):
+    cold = drop_caches()
+    args = [driver, root, method] + ([str(threads)] if threads else [])
+    files, dirs, seconds = subprocess.run(args, check=True, capture_output=True, text=True).stdout.splitlines()[-1].split()
+    return int(files), int(dirs), float(seconds), cold
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--root', default=os.path.join(tempfile.gettempdir(), 'nvr-bench-scan'), help='where the synthetic tree is, should be on the device to measure')
+    parser.add_argument('--files', type=int, default=1000000)
+    parser.add_argument('--cameras', type=int, default=64, help='files per 10 minutes, more means fewer folders')
+    parser.add_argument('--threads', type=int, nargs='*', default=[1, 4, 16, 0], help='scanner threads to try, 0 for the default')
+    parser.add_argument('--cc', default=os.environ.get('CC', 'cc'))
+    args = parser.parse_args()
+    driver = os.path.join(tempfile.gettempdir(), 'nvr-bench-scan-driver')
+    subprocess.run([args.cc, '-O2', '-I', os.path.join(here, '..', 'include'), '-o', driver,
+                    os.path.join(here, 'scan.c'), os.path.join(here, '..', 'src', 'scanner.c'), '-lpthread'], check=True)
+    os.makedirs(args.root, exist_ok=True)
+    populate(args.root, args.files, args.cameras)
+    results = [('readdir', 1) + run(driver, args.root, 'readdir', 0)]
+    results += [('scanner', threads or 'auto') + run(driver, args.root, 'scanner', threads) for threads in args.threads]
+    print(f'{args.files} files under {args.root}')
+    print(f'{"method":<9}{"threads":>8}{"files":>10}{"folders":>9}{"seconds":>10}{"files/s":>12}{"cache":>7}')
+    for method, threads, files, dirs, seconds, cold in results:
+        print(f'{method:<9}{threads:>8}{files:>10}{dirs:>9}{seconds:>10.3f}{files / seconds:>12.0f}{"cold" if cold else "warm":>7}')
+
+if __name__ == '__main__':
+    main()
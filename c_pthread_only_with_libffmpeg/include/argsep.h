@@ -3,6 +3,10 @@
 
 #include "common.h"
 
+#include <stddef.h>
+
 unsigned short parse_argument_seps(char const *arg, char const *seps[], unsigned short sep_max, char const **end);
 
+size_t parse_argument_size(char const *arg);
+
 #endif
\ No newline at end of file
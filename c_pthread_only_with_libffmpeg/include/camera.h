@@ -5,8 +5,33 @@
 
 #include <linux/limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "storage.h"
+#include "mux.h"
+
+#define CAMERA_SEGMENT_SECONDS 600 /* Boundaries are on every 10 minutes of wall clock */
+
+enum camera_record_mode {
+    CAMERA_RECORD_MODE_OVERLAP,
+    CAMERA_RECORD_MODE_PERSISTENT
+};
+
+enum camera_engine {
+    CAMERA_ENGINE_THREAD,
+    CAMERA_ENGINE_LOOP
+};
+
+struct camera;
+
+/* What a recorder thread gets, so this and last could be cancelled on their own */
+struct camera_recorder {
+    struct camera *camera;
+    atomic_bool cancel;
+    pthread_t thread; /* Only kept once cancelled and left behind */
+    struct camera_recorder *next_cancelled;
+};
 
 struct camera {
     struct camera *next_camera;
@@ -22,15 +47,32 @@ struct camera {
     bool recorder_working_last;
     pthread_t recorder_thread_this;
     pthread_t recorder_thread_last;
+    struct camera_recorder recorders[2];
+    struct camera_recorder *recorder_this;
+    struct camera_recorder *recorder_last;
+    struct camera_recorder *recorders_cancelled; /* Left behind still running, reaped by camera_check_last() */
     unsigned breaks;
     bool break_waiting;
-    unsigned break_wait_ticks;
+    time_t break_wait_until;
+    struct mux_state mux;
+    bool looped; /* Driven by a loop worker instead of its own threads */
+    time_t rotation_offset;
+    time_t time_next;
+    struct tm tms_now;
 };
 
+void camera_parse_record_mode(char const *arg);
+
+void camera_parse_engine(char const *arg);
+
+void camera_parse_rotation_window(char const *arg);
+
 struct camera *parse_argument_camera(char const *arg);
 
 int cameras_init(struct camera *camera_head, struct storage const *storage_head);
 
-int cameras_work(struct camera *camera_head);
+int cameras_start_loop(struct camera *camera_head);
+
+int cameras_work(struct camera *camera_head, time_t *time_wake);
 
 #endif
\ No newline at end of file
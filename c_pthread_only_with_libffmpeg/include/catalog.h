@@ -0,0 +1,85 @@
+#ifndef __HAVE_CATALOG_H
+#define __HAVE_CATALOG_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#define CATALOG_NAME ".nvr-catalog" /* Both files are skipped when scanning storages */
+#define CATALOG_PATHS_NAME ".nvr-catalog-paths"
+#define CATALOG_MAGIC "NVRCAT02"
+#define CATALOG_PATHS_MAGIC "NVRPTH01"
+#define CATALOG_ALLOC_STEP 0x10000 /* Entries the mapping grows by */
+#define CATALOG_COMPACT_MIN 0x400 /* Dead entries before compaction is worth it at all */
+#define CATALOG_LEN_CAMERA 24
+#define CATALOG_ENTRY_LIVE 0x1
+#define CATALOG_HANDLE_NONE -1
+
+struct catalog_header {
+    char magic[8];
+    uint32_t entry_size;
+    uint32_t generation; /* Bumped on every compaction, as entry indices change */
+    uint64_t count;
+    uint64_t dead;
+    uint8_t reserved[32];
+};
+
+/* At the start of the paths file, paths only come after it */
+struct catalog_paths_header {
+    char magic[8];
+    uint32_t generation; /* Same as the catalog's, or the two are from different compactions */
+    uint32_t reserved;
+};
+
+/* Fixed size, the path lives in the paths file at offset_path */
+struct catalog_entry {
+    uint32_t flags;
+    uint32_t len_path;
+    uint64_t offset_path;
+    int64_t time_start;
+    int64_t time_end; /* 0 while still recording */
+    int64_t size; /* 0 while still recording */
+    char camera[CATALOG_LEN_CAMERA];
+};
+
+/* Append-only, memory-mapped list of the record files in a storage, so start-up needs no scan,
+   entries are only ever flipped dead in place, and compacted away once most are dead.
+   All but catalog_open() and catalog_close() need mutex held */
+struct catalog {
+    pthread_mutex_t mutex;
+    int fd;
+    int fd_paths;
+    struct catalog_header *header;
+    uint64_t alloc;
+    uint64_t len_paths;
+    char path[PATH_MAX];
+    char path_paths[PATH_MAX];
+};
+
+typedef int (*catalog_entry_cb)(void *arg, uint32_t index, struct catalog_entry const *entry, char const *subpath);
+
+int catalog_open(struct catalog *catalog, char const *storage_path, bool *fresh);
+
+void catalog_close(struct catalog *catalog);
+
+int catalog_foreach(struct catalog *catalog, catalog_entry_cb cb, void *arg);
+
+int catalog_append(struct catalog *catalog, char const *subpath, char const *camera, time_t time_start, time_t time_end, int64_t size, uint32_t *index);
+
+int64_t catalog_handle(struct catalog const *catalog, uint32_t index);
+
+void catalog_finish(struct catalog *catalog, int64_t handle, time_t time_end, int64_t size);
+
+int catalog_get(struct catalog const *catalog, uint32_t index, struct catalog_entry *entry);
+
+void catalog_remove(struct catalog *catalog, uint32_t index);
+
+bool catalog_needs_compact(struct catalog const *catalog);
+
+int catalog_compact(struct catalog *catalog, uint32_t **map, uint64_t *map_size);
+
+#endif
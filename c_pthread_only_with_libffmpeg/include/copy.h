@@ -0,0 +1,42 @@
+#ifndef __HAVE_COPY_H
+#define __HAVE_COPY_H
+
+#include "common.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COPY_PROBE_NAME ".nvr-copy-probe"
+#define COPY_PROBE_SIZE 0x1000
+
+/* Fastest first, a pair only ever steps down */
+enum copy_strategy {
+    COPY_STRATEGY_CLONE, /* FICLONE, shares extents, nothing copied */
+    COPY_STRATEGY_RANGE, /* copy_file_range, could be offloaded by the filesystem */
+    COPY_STRATEGY_SENDFILE,
+    COPY_STRATEGY_COUNT
+};
+
+struct copy_stats {
+    unsigned long files;
+    unsigned long long bytes;
+    unsigned long long time_ns;
+};
+
+/* One per storage pair, only used by the cleaner of the older one */
+struct copy {
+    enum copy_strategy strategy;
+    struct copy_stats stats[COPY_STRATEGY_COUNT];
+};
+
+extern char const copy_strategy_strings[][9];
+
+int copy_probe(struct copy *copy, char const *dir_from, char const *dir_to);
+
+ssize_t copy_chunk(struct copy *copy, int fd_in, int fd_out, size_t remain);
+
+void copy_account(struct copy *copy, enum copy_strategy strategy, size_t bytes, unsigned long long time_ns);
+
+void copy_report(struct copy const *copy, char const *dir_from, char const *dir_to);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __HAVE_LOOP_H
+#define __HAVE_LOOP_H
+
+#include "common.h"
+
+#include <stdbool.h>
+
+#include "mux.h"
+
+bool loop_supports(char const *url);
+
+int loop_add(char const *url, char const *name, mux_next_segment_cb next_segment, void *arg, struct mux_state *state);
+
+int loop_start();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef __HAVE_MIGRATE_H
+#define __HAVE_MIGRATE_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "throttle.h"
+#include "writeback.h"
+
+#define MIGRATE_CHUNK_SIZE 0x100000 /* 1 MiB per read or write */
+#define MIGRATE_CHUNKS 16 /* So 16 MiB in flight at most */
+#define MIGRATE_FILES_MAX 4 /* Copied at the same time */
+#define MIGRATE_RING_ENTRIES 32 /* More than chunks and files together, each has one op in flight at most */
+
+enum migrate_engine {
+    MIGRATE_ENGINE_URING,
+    MIGRATE_ENGINE_SENDFILE
+};
+
+/* A file to move across filesystems, or to remove if path_new is NULL */
+struct migrate_item {
+    char const *path_old;
+    char const *path_new;
+    int result; /* 0, errno, or -1 if not done */
+};
+
+struct migrate_stats {
+    unsigned long files;
+    unsigned long bytes;
+    unsigned long unlinks;
+    unsigned long failures;
+};
+
+/* Minimal io_uring through raw syscalls */
+struct migrate_ring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+};
+
+/* One per cleaner, as rings are not shared between threads */
+struct migrate {
+    bool available;
+    bool fixed; /* Buffers registered */
+    bool unlink_async; /* IORING_OP_UNLINKAT supported */
+    struct migrate_ring ring;
+    unsigned char *buffers;
+    struct throttle *throttle; /* Charged before every read and unlink, could be NULL */
+    struct writeback_stats *writeback; /* Could be NULL */
+    struct migrate_stats stats;
+};
+
+void migrate_parse_engine(char const *arg);
+
+int migrate_init(struct migrate *migrate, bool copies, struct throttle *throttle, struct writeback_stats *writeback);
+
+int migrate_batch(struct migrate *migrate, struct migrate_item *items, size_t count);
+
+#endif
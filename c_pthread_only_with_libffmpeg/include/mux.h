@@ -2,8 +2,99 @@
 #define __HAVE_MUX_H
 
 #include "common.h"
+#include <stddef.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <libavformat/avformat.h>
 
-int mux(char const *in_filename, char const *out_filename, time_t time_end);
+#include "segment.h"
+
+#define MUX_CUTOVER_BUCKETS 12 /* Bucket i counts cutovers under 2^i ms, the last one everything slower */
+
+/* Only updated by the reader stage, unless noted, atomic as overlapping recorders of a camera share them */
+struct mux_stats {
+    atomic_ulong ring_high_water_bytes;
+    atomic_ulong ring_high_water_packets;
+    atomic_ulong ring_dropped_packets; /* Refused by the ring even after shedding, keyframes included */
+    atomic_ulong shed_disposable_packets; /* Non-reference frames shed at half of the budget */
+    atomic_ulong shed_gops; /* GOPs cut short at the full budget, only their keyframes kept */
+    atomic_ulong shed_gop_packets;
+    atomic_ulong opens_concurrent_peak; /* Most avformat_open_input() in flight when this camera opened */
+    atomic_ulong probe_cache_hits;
+    atomic_ulong probe_cache_misses;
+    atomic_long time_to_first_packet_last; /* In ms, from starting to open input to the first packet written, by the writer stage */
+    atomic_long time_to_first_packet_max;
+    atomic_ulong cutover_histogram[MUX_CUTOVER_BUCKETS]; /* From deciding to cut to the keyframe written to the new segment, by the writer stage */
+    atomic_ulong cutover_prepare_misses; /* Cuts that had to open the next segment synchronously, by the writer stage */
+    atomic_ulong paramset_changes; /* SPS/PPS/VPS replaced by a different one mid-stream, by the writer stage */
+    atomic_ulong paramset_injections; /* Segments whose first keyframe got the parameter sets prepended, by the writer stage */
+    atomic_ulong packets_corrupt; /* Flagged corrupt by the demuxer, e.g. RTP packets lost in a frame, still written */
+    atomic_ulong packets_discarded; /* Flagged discard by the demuxer, still written as decoders need them */
+    atomic_ulong timestamps_repaired; /* Missing, non-monotonic or PTS before DTS, fixed in place */
+    atomic_ulong timestamps_jumped; /* Discontinuities and wall clock drifts the timeline re-anchored over */
+    atomic_ulong timestamps_dropped; /* Packets dropped for timestamps, also by the muxer on the writer stage */
+    struct segment_stats segment; /* By the writer stage */
+    atomic_ulong stalls; /* Sessions interrupted as no packet came in for the stall timeout */
+    atomic_long stall_recovery_last; /* In ms, from a stall being detected to the first packet written again, by the writer stage */
+    atomic_long stall_recovery_max;
+};
+
+struct mux_stream_cache {
+    AVCodecParameters *codecpar;
+    AVRational time_base;
+};
+
+/* Stream parameters from the last full probe, so reconnects could skip avformat_find_stream_info() */
+struct mux_cache {
+    pthread_mutex_t mutex;
+    unsigned nb_streams;
+    struct mux_stream_cache *streams;
+};
+
+/* Per-camera state kept across sessions */
+struct mux_state {
+    struct mux_stats stats;
+    struct mux_cache cache;
+    AVDictionary *options; /* Passed to avformat_open_input() for every session */
+    atomic_llong time_stalled; /* Monotonic ms when the last stall was detected, 0 once recovered */
+    char const *name; /* Of the camera, kept with its segments in storage catalogs */
+    atomic_ulong bitrate; /* Moving average over finished segments, in bytes per second, to preallocate the next */
+};
+
+/* Fills the path of the segment starting at time_start and the time it should end, returns 0 on success,
+   called ahead of the cut so the next segment is already open when the keyframe arrives */
+typedef int (*mux_next_segment_cb)(void *arg, time_t time_start, char const **out_filename, time_t *time_end);
+
+/* Called by the reader over and over instead of blocking until the writer stage finishes */
+typedef void (*mux_wait_cb)(void *arg);
+
+int mux_state_init(struct mux_state *state);
+
+void mux_state_free(struct mux_state *state);
+
+int mux_state_parse_options(struct mux_state *state, char const *options);
+
+void mux_parse_ring_size(char const *arg);
+
+size_t mux_get_ring_size();
+
+void mux_parse_memory_budget(char const *arg);
+
+void mux_parse_stall_timeout(char const *arg);
+
+unsigned mux_get_opens_concurrent_peak();
+
+int mux_writers_start(unsigned count);
+
+/* cancel, if not NULL, stops the session once set, interrupting any blocking I/O */
+int mux(char const *in_filename, char const *out_filename, time_t time_end, struct mux_state *state, atomic_bool const *cancel);
+
+int mux_persistent(char const *in_filename, mux_next_segment_cb next_segment, void *arg, struct mux_state *state, atomic_bool const *cancel);
+
+/* Same as mux_persistent(), but reads through pb on the calling thread while segments are written
+   by the shared writers, for the loop engine whose workers must never wait on the disk */
+int mux_persistent_io(char const *in_filename, AVIOContext *pb, mux_next_segment_cb next_segment, void *arg, struct mux_state *state, mux_wait_cb wait, void *wait_arg);
 
 #endif
\ No newline at end of file
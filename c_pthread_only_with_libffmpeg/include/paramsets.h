@@ -0,0 +1,37 @@
+#ifndef __HAVE_PARAMSETS_H
+#define __HAVE_PARAMSETS_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+
+#define PARAMSETS_KINDS 3 /* VPS (H.265 only), SPS, PPS */
+#define PARAMSETS_IDS_MAX 256 /* H.264 PPS ids have the widest range of all */
+#define PARAMSETS_PARSE_MAX 128 /* Bytes unescaped to find an id, enough for any H.265 SPS header */
+
+struct paramset {
+    unsigned id;
+    uint8_t *data; /* Without start code */
+    int size;
+};
+
+/* Latest parameter sets of an Annex B H.264/H.265 stream, one per id of each kind */
+struct paramsets {
+    enum AVCodecID codec_id; /* AV_CODEC_ID_NONE if the stream is not one we could handle */
+    struct paramset *sets[PARAMSETS_KINDS]; /* Ordered by id */
+    unsigned counts[PARAMSETS_KINDS];
+};
+
+void paramsets_init(struct paramsets *paramsets, AVCodecParameters const *codecpar);
+
+void paramsets_free(struct paramsets *paramsets);
+
+unsigned paramsets_scan(struct paramsets *paramsets, uint8_t const *data, int size);
+
+int paramsets_inject(struct paramsets const *paramsets, AVPacket *pkt, bool *injected);
+
+bool paramsets_disposable(struct paramsets const *paramsets, uint8_t const *data, int size);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __HAVE_PATTERN_H
+#define __HAVE_PATTERN_H
+
+#include "common.h"
+
+#include <time.h>
+#include <linux/limits.h>
+
+#define PATTERN_TOKENS_MAX NAME_MAX
+
+enum pattern_token_type {
+    PATTERN_TOKEN_LITERAL,
+    PATTERN_TOKEN_YEAR, /* %Y */
+    PATTERN_TOKEN_YEAR_SHORT, /* %y */
+    PATTERN_TOKEN_MONTH, /* %m */
+    PATTERN_TOKEN_DAY, /* %d */
+    PATTERN_TOKEN_HOUR, /* %H */
+    PATTERN_TOKEN_MINUTE, /* %M */
+    PATTERN_TOKEN_SECOND, /* %S */
+    PATTERN_TOKEN_EPOCH /* %s */
+};
+
+struct pattern_token {
+    enum pattern_token_type type;
+    char literal;
+};
+
+/* A camera's strftime compiled backwards, to get the start time out of the name of a segment */
+struct pattern {
+    struct pattern_token tokens[PATTERN_TOKENS_MAX];
+    unsigned short count;
+};
+
+int pattern_compile(struct pattern *pattern, char const *format, char const *suffix);
+
+int pattern_match(struct pattern const *pattern, char const *name, time_t *time);
+
+#endif
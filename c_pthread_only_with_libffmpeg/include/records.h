@@ -0,0 +1,48 @@
+#ifndef __HAVE_RECORDS_H
+#define __HAVE_RECORDS_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define RECORDS_CATALOG_NONE UINT32_MAX
+
+struct record {
+    time_t mtime;
+    char *subpath; /* Relative to the storage, starting with '/' */
+    uint32_t catalog_index; /* Of its entry in the storage catalog, RECORDS_CATALOG_NONE if not in there */
+    size_t slot; /* Internal, where it is in the path index while in the heap */
+};
+
+/* Min-heap of the record files in a storage keyed on mtime, so the oldest is always on top,
+   also indexed by subpath, so a single record could be looked up or taken out */
+struct records {
+    pthread_mutex_t mutex;
+    struct record *heap;
+    size_t count;
+    size_t alloc;
+    size_t *slots; /* Heap positions, hashed by subpath */
+    size_t slots_alloc;
+};
+
+int records_init(struct records *records);
+
+int records_add(struct records *records, time_t mtime, char const *subpath, uint32_t catalog_index);
+
+int records_push(struct records *records, struct record const *record);
+
+int records_pop(struct records *records, struct record *record);
+
+int records_remove(struct records *records, char const *subpath, struct record *record);
+
+bool records_contains(struct records *records, char const *subpath);
+
+size_t records_count(struct records *records);
+
+void records_remap(struct records *records, uint32_t const *map, uint64_t map_size);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __HAVE_RING_H
+#define __HAVE_RING_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <libavcodec/avcodec.h>
+
+#define RING_SLOTS 1024 /* Must be power of 2 */
+#define RING_OVERSHOOT 2 /* Packets pushed with overshoot could take up to this times the budget */
+#define RING_FLOOR 8 /* A ring holding less than 1/this of its own budget is never refused by the global one */
+
+/* Single-producer/single-consumer packet ring, the producer never blocks */
+struct ring {
+    AVPacket *packets[RING_SLOTS];
+    atomic_uint head; /* Only written by producer */
+    atomic_uint tail; /* Only written by consumer */
+    atomic_size_t bytes;
+    size_t bytes_max;
+    sem_t items;
+};
+
+int ring_init(struct ring *ring, size_t bytes_max);
+
+void ring_free(struct ring *ring);
+
+void ring_set_bytes_all_max(size_t bytes_max);
+
+int ring_push(struct ring *ring, AVPacket *pkt, bool overshoot);
+
+int ring_pop(struct ring *ring, AVPacket *pkt);
+
+void ring_wait(struct ring *ring);
+
+int ring_try_wait(struct ring *ring);
+
+void ring_wake(struct ring *ring);
+
+static inline unsigned ring_count(struct ring *const ring) {
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+static inline size_t ring_bytes(struct ring *const ring) {
+    return atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+}
+
+unsigned ring_pressure(struct ring *ring);
+
+#endif
\ No newline at end of file
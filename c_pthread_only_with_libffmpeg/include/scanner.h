@@ -0,0 +1,32 @@
+#ifndef __HAVE_SCANNER_H
+#define __HAVE_SCANNER_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define SCANNER_BUFFER_SIZE 0x40000 /* 256 KiB of dirents per getdents64() */
+#define SCANNER_THREADS_MAX 64
+#define SCANNER_THREADS_PER_CPU 2 /* Scans are bound by I/O latency more than CPU */
+#define SCANNER_DEQUE_ALLOC_INITIAL 0x40
+
+/* Called from any scanner thread for every entry that's not a folder, name is in dir_fd,
+   subpath relative to the root starting with '/', returns non-zero to abort the scan */
+typedef int (*scanner_file_cb)(void *arg, int dir_fd, char const *name, char const *subpath);
+
+struct scanner_stats {
+    unsigned long dirs;
+    unsigned long files;
+    unsigned long dirs_removed; /* Left empty, they're removed as the scan goes */
+    unsigned long steals;
+    long time; /* In ms */
+};
+
+void scanner_parse_threads(char const *arg);
+
+int scanner_scan(char const *root, scanner_file_cb cb, void *arg, struct scanner_stats *stats);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __HAVE_SEGMENT_H
+#define __HAVE_SEGMENT_H
+
+#include "common.h"
+
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <libavformat/avio.h>
+
+#include "writeback.h"
+
+#define SEGMENT_BUFFER_SIZE 0x40000 /* 256 KiB */
+#define SEGMENT_NOSPACE_EVICTIONS_MAX 16 /* Give up a write on ENOSPC after this many evictions */
+#define SEGMENT_LATENCY_RECENT_SHIFT 4 /* Recent write latency moves 1/16 towards every write */
+#define SEGMENT_LATENCY_BASELINE_SHIFT 10 /* Baseline rises 1/1024 towards slower writes */
+
+/* Returns 0 if it freed some space so the write is worth retrying */
+typedef int (*segment_nospace_cb)(void *arg);
+
+/* Told about every segment file created, returns a handle later passed to segment_closed_cb */
+typedef int64_t (*segment_created_cb)(void *arg, char const *path, char const *name);
+
+/* Told the final size of a segment once it's closed */
+typedef void (*segment_closed_cb)(void *arg, int64_t handle, off_t size);
+
+/* Atomic as segments of overlapping recorders of a camera share them */
+struct segment_stats {
+    atomic_ulong nospace_stalls; /* Writes that hit ENOSPC */
+    atomic_ulong nospace_evictions; /* Files evicted to make room for them */
+    atomic_ulong nospace_failures; /* Writes that still failed after that */
+    atomic_long nospace_stall_last; /* In ms, from the first ENOSPC to the write done */
+    atomic_long nospace_stall_max;
+    struct writeback_stats writeback; /* Of all segments of the recorder */
+    atomic_ulong preallocated; /* Segments opened with space reserved */
+    atomic_ullong preallocated_bytes;
+    atomic_ullong trimmed_bytes; /* Reserved but not used, given back at close */
+    atomic_ulong extents_segments; /* Closed segments whose extents could be counted */
+    atomic_ullong extents_total;
+    atomic_ulong extents_last;
+    atomic_ulong extents_max;
+};
+
+/* An output file we own the fd of, written by the muxer through pb */
+struct segment {
+    int fd;
+    AVIOContext *pb;
+    off_t offset;
+    off_t size;
+    off_t preallocated;
+    int64_t handle; /* From segment_created_cb */
+    struct writeback writeback;
+    struct segment_stats *stats;
+    atomic_bool const *cancel; /* Could be NULL, checked between writes as the muxer's interrupt callback never sees our AVIO */
+};
+
+void segment_set_nospace_handler(segment_nospace_cb cb, void *arg);
+
+void segment_set_created_handler(segment_created_cb cb, void *arg);
+
+void segment_set_closed_handler(segment_closed_cb cb, void *arg);
+
+void segment_get_latency(unsigned long *recent, unsigned long *baseline);
+
+int segment_open(struct segment *segment, char const *path, off_t preallocate, char const *name, struct segment_stats *stats, atomic_bool const *cancel);
+
+int segment_close(struct segment *segment);
+
+#endif
\ No newline at end of file
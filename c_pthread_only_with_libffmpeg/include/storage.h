@@ -4,11 +4,31 @@
 #include "common.h"
 
 #include <stdbool.h>
+#include <time.h>
 #include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <pthread.h>
 #include <dirent.h>
 
+#include "records.h"
+#include "catalog.h"
+#include "migrate.h"
+#include "copy.h"
+#include "throttle.h"
+#include "writeback.h"
+
+#define STORAGE_EMERGENCY_MIN_AGE 60 /* Seconds since last modified before a file could be evicted in emergency */
+#define STORAGE_EMERGENCY_MIN_FREE 0x100000 /* Free bytes that already count as room in emergency */
+#define STORAGE_EMERGENCY_BACKOFF_MS 500 /* Recorders wait this long for the cleaner when they can't evict by themselves */
+#define STORAGE_PLAN_ROUNDS_MAX 16 /* Replans when evicting a whole plan still didn't reach the to threshold */
+#define STORAGE_PLAN_ALLOC_INITIAL 0x40
+
+enum storage_order {
+    STORAGE_ORDER_MTIME,
+    STORAGE_ORDER_NAME
+};
 
 enum storage_threshold_type {
     STORAGE_THRESHOLD_TYPE_PERCENT,
@@ -26,6 +46,12 @@ struct storage_thresholds {
     struct storage_threshold from, to;
 };
 
+/* A file taken out of the index to be evicted */
+struct storage_plan_item {
+    struct record record;
+    struct stat st;
+};
+
 struct storage {
     struct storage *next_storage;
     char path[PATH_MAX];
@@ -46,14 +72,37 @@ struct storage {
     char *subpath_new;
     size_t len_path_new_allow;
     bool move_to_next;
+    pthread_mutex_t evict_mutex; /* Between the cleaner and recorders evicting in emergency */
+    struct records records; /* Every file in the storage by mtime */
+    struct catalog catalog; /* The same files persisted, lock before records if both needed */
+    struct migrate migrate; /* Only used by the cleaner thread */
+    struct copy copy; /* How files are copied to the next storage when they can't be renamed */
+    struct throttle throttle; /* Of migration and deletion by the cleaner */
+    struct writeback_stats writeback; /* Of files copied by the cleaner */
 };
 
 void storage_parse_max_cleaners(char const *const arg);
 
+void storage_parse_order(char const *arg);
+
+int storage_add_name_pattern(char const *format);
+
+int storage_time_from_name(char const *subpath, time_t *time);
+
 struct storage *parse_argument_storage(char const *arg);
 
 int storages_init(struct storage *storage_head);
 
 int storages_clean(struct storage *storage_head);
 
+int64_t storage_index_add(struct storage *storage, char const *path, char const *name, time_t mtime);
+
+void storage_index_finish(struct storage *storage, int64_t handle, time_t time_end, off_t size);
+
+int storage_index_track(struct storage *storage, char const *subpath, time_t mtime, off_t size);
+
+void storage_index_forget(struct storage *storage, char const *subpath);
+
+int storage_evict_emergency(struct storage *storage);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef __HAVE_SUPERVISOR_H
+#define __HAVE_SUPERVISOR_H
+
+#include "common.h"
+
+#include "storage.h"
+#include "camera.h"
+
+int supervisor_init();
+
+void supervisor_notify();
+
+int supervisor_run(struct storage *storage_head, struct camera *camera_head);
+
+#endif
\ No newline at end of file
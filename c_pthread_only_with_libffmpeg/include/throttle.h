@@ -0,0 +1,46 @@
+#ifndef __HAVE_THROTTLE_H
+#define __HAVE_THROTTLE_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define THROTTLE_CHUNK_SIZE 0x400000 /* 4 MiB, what a throttled copy does between waits */
+#define THROTTLE_UNLINK_COST 0x40000 /* 256 KiB charged per unlink, roughly the metadata I/O of freeing a segment */
+#define THROTTLE_BURST_MS 100 /* Tokens saved up at most */
+#define THROTTLE_RATE_UNLIMITED 0x40000000 /* 1 GiB/s, what backing off starts from without a rate */
+#define THROTTLE_SHARES 64 /* Rate is cut into this many shares */
+#define THROTTLE_SHARES_REGAIN 4 /* Shares given back per interval while recorders write fine */
+#define THROTTLE_ADAPT_INTERVAL_MS 100
+#define THROTTLE_LATENCY_RATIO 2 /* Back off when recent recorder writes are this many times slower than baseline */
+#define THROTTLE_LATENCY_FLOOR_US 2000 /* and slower than this, page cache hits never matter */
+
+/* Recent and baseline write latency of recorders, in us */
+typedef void (*throttle_latency_cb)(unsigned long *recent, unsigned long *baseline);
+
+struct throttle_stats {
+    unsigned long long waited_ms;
+    unsigned long backoffs;
+};
+
+/* Token bucket for migration and deletion I/O of one storage, only used by its cleaner */
+struct throttle {
+    size_t rate; /* Bytes per second, 0 for unlimited */
+    throttle_latency_cb latency; /* Set if sharing a device with recorders, to back off when their writes slow down */
+    unsigned shares; /* Of THROTTLE_SHARES, of the rate currently allowed */
+    long long tokens; /* Could go negative, paid back by waiting */
+    long long time_refill; /* In ms */
+    long long time_adapt;
+    struct throttle_stats stats;
+};
+
+void throttle_init(struct throttle *throttle, size_t rate, throttle_latency_cb latency);
+
+bool throttle_active(struct throttle const *throttle);
+
+void throttle_take(struct throttle *throttle, size_t bytes);
+
+int throttle_set_idle_priority();
+
+#endif
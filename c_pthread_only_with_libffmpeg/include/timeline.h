@@ -0,0 +1,47 @@
+#ifndef __HAVE_TIMELINE_H
+#define __HAVE_TIMELINE_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <libavformat/avformat.h>
+
+#define TIMELINE_JUMP_SECONDS 10 /* DTS moving more than this either way is a jump, not jitter */
+#define TIMELINE_DRIFT_SECONDS 5 /* Re-anchor to wall clock when packet time drifts this far away */
+
+enum timeline_result {
+    TIMELINE_OK,
+    TIMELINE_REPAIRED, /* Missing, non-monotonic, or PTS before DTS, fixed in place */
+    TIMELINE_JUMPED, /* Discontinuity or drift, timeline re-anchored */
+    TIMELINE_DROPPED /* No timestamp and nothing to derive one from */
+};
+
+struct timeline_stream {
+    AVRational time_base;
+    int64_t offset; /* Added to the camera's timestamps */
+    int64_t dts_last; /* Normalized, AV_NOPTS_VALUE before the first packet */
+    int64_t duration_last;
+};
+
+/* Maps the camera's PTS/DTS to a per-stream monotonic timeline, one stream of it anchored to wall clock,
+   as streams could have unrelated bases until e.g. RTCP syncs them */
+struct timeline {
+    unsigned nb_streams;
+    struct timeline_stream *streams;
+    int anchor_stream; /* Whose packets anchor the timeline and could be told their wall clock, -1 for any */
+    bool anchored;
+    atomic_llong wallclock_offset; /* In us, wall clock minus normalized time of anchor_stream, read by the writer stage */
+};
+
+int timeline_init(struct timeline *timeline, AVFormatContext const *ifmt_ctx, int anchor_stream);
+
+void timeline_free(struct timeline *timeline);
+
+enum timeline_result timeline_normalize(struct timeline *timeline, AVPacket *pkt, bool check_drift);
+
+time_t timeline_wallclock(struct timeline *timeline, AVPacket const *pkt);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __HAVE_WATCHER_H
+#define __HAVE_WATCHER_H
+
+#include "common.h"
+
+#include "storage.h"
+
+#define WATCHER_BUFFER_SIZE 0x10000
+#define WATCHER_DIRS_ALLOC_INITIAL 0x100
+
+int watcher_init(struct storage *storage_head);
+
+int watcher_get_fd();
+
+int watcher_handle();
+
+#endif
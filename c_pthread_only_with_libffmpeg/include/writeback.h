@@ -0,0 +1,44 @@
+#ifndef __HAVE_WRITEBACK_H
+#define __HAVE_WRITEBACK_H
+
+#include "common.h"
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define WRITEBACK_WINDOW 0x800000 /* 8 MiB, writeback of a file is started every this many bytes */
+
+/* Shared by files written from different threads, e.g. both recorders of a camera while they overlap */
+struct writeback_stats {
+    atomic_ullong dirty; /* Written by files open now but not yet waited for */
+    atomic_ullong dirty_max;
+    atomic_ulong waits;
+    atomic_ullong stall_us; /* Spent waiting for writeback, in total */
+    atomic_ullong stall_max_us;
+};
+
+/* Dirty data of one file written front to back, kept to two windows */
+struct writeback {
+    off_t started; /* Writeback started up to here */
+    off_t dropped; /* Waited for and dropped from the page cache up to here */
+    off_t written;
+    struct writeback_stats *stats; /* Could be NULL */
+};
+
+void writeback_init(struct writeback *writeback, struct writeback_stats *stats);
+
+void writeback_account_dirty(struct writeback_stats *stats, unsigned long long bytes);
+
+void writeback_start(int fd, off_t offset, off_t len);
+
+void writeback_drop(int fd, off_t offset, off_t len);
+
+void writeback_wait(int fd, off_t offset, off_t len, struct writeback_stats *stats);
+
+void writeback_written(struct writeback *writeback, int fd, off_t offset);
+
+void writeback_finish(struct writeback *writeback, int fd);
+
+void writeback_abandon(struct writeback *writeback);
+
+#endif
@@ -1,5 +1,7 @@
 #include "argsep.h"
 
+#include <stdlib.h>
+
 unsigned short parse_argument_seps(char const *const arg, char const *seps[], unsigned short sep_max, char const **const end) {
     unsigned short sep_id = 0;
     for (char const *c = arg;; ++c) {
@@ -16,4 +18,34 @@ unsigned short parse_argument_seps(char const *const arg, char const *seps[], un
             break;
         }
     }
+}
+
+/* Size with optional B/K/M/G/T suffix, 0 for illegal */
+size_t parse_argument_size(char const *const arg) {
+    char *suffix;
+    size_t value = strtoul(arg, &suffix, 10);
+    switch (*suffix) {
+    case 'T':
+    case 't':
+        value *= 0x400;
+        __attribute__((fallthrough));
+    case 'G':
+    case 'g':
+        value *= 0x400;
+        __attribute__((fallthrough));
+    case 'M':
+    case 'm':
+        value *= 0x400;
+        __attribute__((fallthrough));
+    case 'K':
+    case 'k':
+        value *= 0x400;
+        __attribute__((fallthrough));
+    case 'B':
+    case 'b':
+    case '\0':
+        return value;
+    default:
+        return 0;
+    }
 }
\ No newline at end of file
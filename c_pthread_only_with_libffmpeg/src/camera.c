@@ -2,15 +2,65 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/wait.h>
 #include "print.h"
 #include "argsep.h"
 #include "mux.h"
 #include "mkdir.h"
+#include "loop.h"
+#include "supervisor.h"
 
 static struct storage const *storage;
-static time_t time_next = 0;
-static struct tm tms_now;
+static time_t rotation_window = 0;
+static enum camera_record_mode record_mode = CAMERA_RECORD_MODE_OVERLAP;
+static enum camera_engine engine = CAMERA_ENGINE_THREAD;
+
+char const camera_record_mode_strings[][11] = {
+    "overlap",
+    "persistent"
+};
+
+void camera_parse_rotation_window(char const *const arg) {
+    long window = strtol(arg, NULL, 10);
+    if (window <= 0) {
+        rotation_window = 0;
+    } else if (window >= CAMERA_SEGMENT_SECONDS) {
+        rotation_window = CAMERA_SEGMENT_SECONDS - 1;
+    } else {
+        rotation_window = window;
+    }
+    pr_warn("Spreading segment boundaries of cameras across %ld seconds\n", rotation_window);
+}
+
+char const camera_engine_strings[][7] = {
+    "thread",
+    "loop"
+};
+
+void camera_parse_record_mode(char const *const arg) {
+    if (!strcmp(arg, "persistent")) {
+        record_mode = CAMERA_RECORD_MODE_PERSISTENT;
+    } else {
+        if (strcmp(arg, "overlap")) {
+            pr_warn("Unknown record mode '%s', falling back to overlap\n", arg);
+        }
+        record_mode = CAMERA_RECORD_MODE_OVERLAP;
+    }
+    pr_warn("Using record mode %s\n", camera_record_mode_strings[record_mode]);
+}
+
+void camera_parse_engine(char const *const arg) {
+    if (!strcmp(arg, "loop")) {
+        engine = CAMERA_ENGINE_LOOP;
+    } else {
+        if (strcmp(arg, "thread")) {
+            pr_warn("Unknown engine '%s', falling back to thread\n", arg);
+        }
+        engine = CAMERA_ENGINE_THREAD;
+    }
+    pr_warn("Using engine %s\n", camera_engine_strings[engine]);
+}
 
 struct camera *parse_argument_camera(char const *const arg) {
     pr_debug("Parsing camera definition: '%s'\n", arg);
@@ -39,8 +89,18 @@ struct camera *parse_argument_camera(char const *const arg) {
         pr_error("Both strftime and name not defined in camera definition: '%s'\n", arg);
         return NULL;
     }
-    unsigned short len_url = end - seps[1] - 1;
-    if (len_url > PATH_MAX) {
+    /* Everything after the first '#' are options for libavformat, a '#' in the URL itself is escaped as '\#' */
+    char const *options = NULL;
+    for (char const *c = seps[1] + 1; c < end; ++c) {
+        if (*c == '\\' && c[1] == '#') {
+            ++c;
+        } else if (*c == '#') {
+            options = c;
+            break;
+        }
+    }
+    unsigned short len_url = (options ? options : end) - seps[1] - 1;
+    if (len_url >= PATH_MAX) {
         pr_error("URL in camera definition too long: '%s'\n", arg);
         return NULL;
     }
@@ -66,14 +126,42 @@ struct camera *parse_argument_camera(char const *const arg) {
         }
         pr_warn("Generated strftime '%s' from name '%s' since it's not set in camera definition '%s'\n", camera->strftime, camera->name, arg);
     }
-    strncpy(camera->url, seps[1] + 1, len_url);
-    camera->url[len_url] = '\0';
+    char *url = camera->url;
+    for (char const *c = seps[1] + 1; c < seps[1] + 1 + len_url; ++c) {
+        if (*c == '\\' && c[1] == '#') {
+            ++c;
+        }
+        *url++ = *c;
+    }
+    *url = '\0';
     camera->len_name = len_name;
     camera->next_camera = NULL;
     camera->recorder_working_this = false;
     camera->recorder_working_last = false;
+    for (unsigned i = 0; i < 2; ++i) {
+        camera->recorders[i].camera = camera;
+        atomic_init(&camera->recorders[i].cancel, false);
+    }
+    camera->recorder_this = camera->recorders;
+    camera->recorder_last = camera->recorders + 1;
+    camera->recorders_cancelled = NULL;
     camera->breaks = 0;
     camera->break_waiting = false;
+    if (mux_state_init(&camera->mux)) {
+        pr_error("Failed to init muxer state for camera\n");
+        free(camera);
+        return NULL;
+    }
+    camera->mux.name = camera->name;
+    if (options && options[1] && mux_state_parse_options(&camera->mux, options + 1)) {
+        pr_error("Failed to parse options in camera definition: '%s'\n", arg);
+        mux_state_free(&camera->mux);
+        free(camera);
+        return NULL;
+    }
+    camera->looped = false;
+    camera->rotation_offset = 0;
+    camera->time_next = 0;
     pr_debug("Camera defitnition: name: '%s', strftime: '%s', url: '%s'\n", camera->name, camera->strftime, camera->url);
     return camera;
 }
@@ -85,12 +173,87 @@ int cameras_init(struct camera *const camera_head, struct storage const *const s
         camera->path[storage->len_path] = '/';
         camera->subpath = camera->path + storage->len_path + 1;
         camera->len_subpath_max = PATH_MAX - storage->len_path - 1;
+        if (rotation_window) {
+            /* FNV-1a, so a camera always gets the same offset across restarts */
+            uint32_t hash = 0x811c9dc5;
+            for (char const *c = camera->len_name ? camera->name : camera->url; *c; ++c) {
+                hash = (hash ^ (unsigned char)*c) * 0x01000193;
+            }
+            camera->rotation_offset = hash % (rotation_window + 1);
+            pr_warn("Segment boundaries of camera '%s' are offset by %lds\n", camera->name, camera->rotation_offset);
+        }
     }
     return 0;
 }
 
-static int camera_record(struct camera *const camera) {
-    size_t len = strftime(camera->subpath, camera->len_subpath_max, camera->strftime, &tms_now);
+static int camera_next_segment(void *arg, time_t time_start, char const **out_filename, time_t *time_end);
+
+static time_t camera_get_time_next(time_t const time_now, struct tm *const tms) {
+    localtime_r(&time_now, tms);
+    struct tm tms_next = *tms;
+    int minute = (tms->tm_min + 11) / 10 * 10;
+    if (minute >= 60) {
+        tms_next.tm_min = minute % 60;
+        ++tms_next.tm_hour;
+    } else {
+        tms_next.tm_min = minute;
+    }
+    tms_next.tm_sec = 0;
+    return mktime(&tms_next);
+}
+
+/* Like camera_get_time_next(), but the boundaries are shifted by the camera's rotation offset, tms is still for now */
+static time_t camera_get_time_next_staggered(struct camera const *const camera, time_t const time_now, struct tm *const tms) {
+    if (!camera->rotation_offset) {
+        return camera_get_time_next(time_now, tms);
+    }
+    struct tm tms_shifted;
+    time_t const time_next = camera_get_time_next(time_now - camera->rotation_offset, &tms_shifted) + camera->rotation_offset;
+    localtime_r(&time_now, tms);
+    return time_next;
+}
+
+#ifdef DEBUGGING
+/* One line per camera per segment, so hundreds of cameras don't flood the log */
+static void camera_report_stats(struct camera const *const camera) {
+    struct mux_stats const *const stats = &camera->mux.stats;
+    char histogram[MUX_CUTOVER_BUCKETS * 24];
+    size_t len = 0;
+    for (unsigned i = 0; i < MUX_CUTOVER_BUCKETS - 1; ++i) {
+        len += snprintf(histogram + len, sizeof histogram - len, " <%lums:%lu", 1UL << i, stats->cutover_histogram[i]);
+    }
+    snprintf(histogram + len, sizeof histogram - len, " slower:%lu", stats->cutover_histogram[MUX_CUTOVER_BUCKETS - 1]);
+    pr_debug("Stats for camera '%s': "
+        "ring %lu/%zu bytes %lu packets dropped %lu; "
+        "shed non-ref %lu gops %lu (%lu packets); "
+        "opens peak %lu/%u probe cache %lu/%lu first packet %ld/%ldms; "
+        "cutover%s sync %lu; "
+        "timestamps repaired %lu jumped %lu dropped %lu; "
+        "enospc %lu evicted %lu failed %lu stalled %ld/%ldms; "
+        "dirty %llu/%llu bytes writeback waits %lu stalled %llu/%llums; "
+        "preallocated %lu (%llu bytes, %llu trimmed, %lu bytes/s) extents %llu in %lu segments last %lu max %lu; "
+        "stalls %lu recovered %ld/%ldms; "
+        "corrupt %lu discarded %lu; "
+        "parameter sets changed %lu injected %lu\n",
+        camera->name,
+        stats->ring_high_water_bytes, mux_get_ring_size(), stats->ring_high_water_packets, stats->ring_dropped_packets,
+        stats->shed_disposable_packets, stats->shed_gops, stats->shed_gop_packets,
+        stats->opens_concurrent_peak, mux_get_opens_concurrent_peak(), stats->probe_cache_hits, stats->probe_cache_misses, stats->time_to_first_packet_last, stats->time_to_first_packet_max,
+        histogram, stats->cutover_prepare_misses,
+        stats->timestamps_repaired, stats->timestamps_jumped, stats->timestamps_dropped,
+        stats->segment.nospace_stalls, stats->segment.nospace_evictions, stats->segment.nospace_failures, stats->segment.nospace_stall_last, stats->segment.nospace_stall_max,
+        stats->segment.writeback.dirty, stats->segment.writeback.dirty_max, stats->segment.writeback.waits, stats->segment.writeback.stall_us / 1000, stats->segment.writeback.stall_max_us / 1000,
+        stats->segment.preallocated, stats->segment.preallocated_bytes, stats->segment.trimmed_bytes, camera->mux.bitrate, stats->segment.extents_total, stats->segment.extents_segments, stats->segment.extents_last, stats->segment.extents_max,
+        stats->stalls, stats->stall_recovery_last, stats->stall_recovery_max,
+        stats->packets_corrupt, stats->packets_discarded,
+        stats->paramset_changes, stats->paramset_injections);
+}
+#else
+#define camera_report_stats(camera)
+#endif
+
+static int camera_record(struct camera *const camera, atomic_bool const *const cancel) {
+    size_t len = strftime(camera->subpath, camera->len_subpath_max, camera->strftime, &camera->tms_now);
     if (!len) {
         pr_error_with_errno("Failed to create strftime file name");
         return 1;
@@ -101,33 +264,88 @@ static int camera_record(struct camera *const camera) {
         pr_error("Failed to mkdir for all parents for '%s'\n", camera->path);
         return 2;
     }
-    pr_warn("Recording from '%s' to '%s', duration %lds, thread %lx\n", camera->url, camera->path, time_next - time(NULL), pthread_self());
-    if (mux(camera->url, camera->path, time_next + 5)) {
+    pr_warn("Recording from '%s' to '%s', duration %lds, thread %lx\n", camera->url, camera->path, camera->time_next - time(NULL), pthread_self());
+    if (mux(camera->url, camera->path, camera->time_next + 5, &camera->mux, cancel)) {
         pr_error("Failed to record from '%s' to '%s' (path might be reused and changed), thread %lx\n", camera->url, camera->path, pthread_self());
         return 3;
     }
     pr_warn("Recording ended from '%s' to '%s' (path could've changed as we reuse memory)\n", camera->url, camera->path);
+    camera_report_stats(camera);
     return 0;
 }
 
 static void *camera_record_thread(void *arg) {
-    long r = camera_record((struct camera *)(arg));
+    struct camera_recorder *const recorder = arg;
+    long r = camera_record(recorder->camera, &recorder->cancel);
+    supervisor_notify();
+    return (void *)r;
+}
+
+/* Called by the persistent muxer a few seconds before it cuts at a keyframe, to open the next segment ahead */
+static int camera_next_segment(void *const arg, time_t const time_start, char const **const out_filename, time_t *const time_end) {
+    struct camera *const camera = arg;
+    struct tm tms;
+    if (*out_filename) { /* Last segment is about to end */
+        camera_report_stats(camera);
+    }
+    *time_end = camera_get_time_next_staggered(camera, time_start, &tms);
+    size_t len = strftime(camera->subpath, camera->len_subpath_max, camera->strftime, &tms);
+    if (!len) {
+        pr_error_with_errno("Failed to create strftime file name");
+        return 1;
+    }
+    strncpy(camera->subpath + len, ".mkv", 5);
+    if (mkdir_recursive_only_parent(camera->path, 0755)) {
+        pr_error("Failed to mkdir for all parents for '%s'\n", camera->path);
+        return 2;
+    }
+    pr_warn("Recording from '%s' to '%s', duration %lds, thread %lx\n", camera->url, camera->path, *time_end - time_start, pthread_self());
+    *out_filename = camera->path;
+    supervisor_notify(); /* A good time to check free space */
+    return 0;
+}
+
+static int camera_record_persistent(struct camera *const camera, atomic_bool const *const cancel) {
+    if (mux_persistent(camera->url, camera_next_segment, camera, &camera->mux, cancel)) {
+        pr_error("Persistent recording from '%s' breaks, thread %lx\n", camera->url, pthread_self());
+        return 1;
+    }
+    pr_warn("Persistent recording from '%s' ended\n", camera->url);
+    return 0;
+}
+
+static void *camera_record_persistent_thread(void *arg) {
+    struct camera_recorder *const recorder = arg;
+    long r = camera_record_persistent(recorder->camera, &recorder->cancel);
+    supervisor_notify();
     return (void *)r;
 }
 
+/* The last recorder should have ended by its own deadline long ago, if not it's cancelled and
+   left behind to unwind by itself, never waited for here as it could be stuck in a disk write */
 static int camera_push_this_to_last(struct camera *camera) {
     if (camera->recorder_working_this) {
         if (camera->recorder_working_last) {
-            if (pthread_kill(camera->recorder_thread_last, SIGINT)) {
-                pr_error("Faile to send kill signal to last record thread for camera of url '%s'\n", camera->url);
-                return 1;
-            }
             int r;
             long ret;
             switch ((r = pthread_tryjoin_np(camera->recorder_thread_last, (void **)&ret))) {
-            case EBUSY:
-                pr_error("Failed to kill pthread for last record thread for camera of url '%s' for good\n", camera->url);
-                return 2;
+            case EBUSY: {
+                /* Its struct stays with it, the slot gets a new one */
+                struct camera_recorder *const recorder = malloc(sizeof *recorder);
+                if (!recorder) {
+                    pr_error_with_errno("Failed to allocate recorder for camera of url '%s'", camera->url);
+                    return 1;
+                }
+                pr_warn("Last record thread for camera of url '%s' still running, cancelling it\n", camera->url);
+                recorder->camera = camera;
+                atomic_init(&recorder->cancel, false);
+                atomic_store(&camera->recorder_last->cancel, true);
+                camera->recorder_last->thread = camera->recorder_thread_last;
+                camera->recorder_last->next_cancelled = camera->recorders_cancelled;
+                camera->recorders_cancelled = camera->recorder_last;
+                camera->recorder_last = recorder;
+                break;
+            }
             case 0:
                 if (ret) {
                     pr_error("Thread for killed recorder of camera of url '%s' breaks with %ld\n", camera->url, ret);
@@ -139,11 +357,14 @@ static int camera_push_this_to_last(struct camera *camera) {
                 }
                 break;
             default:
-                pr_error("Unexpected return from pthread_tryjoin_np: %d\n", r);
+                pr_error("Unexpected return from joining last record thread: %d\n", r);
                 return -1;
             }
         }
         camera->recorder_thread_last = camera->recorder_thread_this;
+        struct camera_recorder *const recorder = camera->recorder_last;
+        camera->recorder_last = camera->recorder_this;
+        camera->recorder_this = recorder;
         camera->recorder_working_last = true;
         camera->recorder_working_this = false;
     }
@@ -152,24 +373,25 @@ static int camera_push_this_to_last(struct camera *camera) {
 
 static int camera_create_thread(struct camera *const camera) {
     if (camera->break_waiting) {
-        if (--camera->break_wait_ticks) {
+        if (time(NULL) < camera->break_wait_until) {
             return 0;
         } else {
-            /* if wait ticks is 0, it can enter the following logic */
+            /* if wait is over, it can enter the following logic */
             camera->break_waiting = false;
         }
     } else if (camera->breaks > 100) {
         if (camera->breaks > 10000) {
-            camera->break_wait_ticks = 600;
+            camera->break_wait_until = time(NULL) + 600;
         } else if (camera->breaks > 1000)  {
-            camera->break_wait_ticks = 90;
+            camera->break_wait_until = time(NULL) + 90;
         } else {
-            camera->break_wait_ticks = 10;
+            camera->break_wait_until = time(NULL) + 10;
         }
         camera->break_waiting = true;
         return 0;
     }
-    if (pthread_create(&camera->recorder_thread_this, NULL, camera_record_thread, (void *)camera)) {
+    atomic_store(&camera->recorder_this->cancel, false);
+    if (pthread_create(&camera->recorder_thread_this, NULL, record_mode == CAMERA_RECORD_MODE_PERSISTENT ? camera_record_persistent_thread : camera_record_thread, (void *)camera->recorder_this)) {
         pr_error("Failed to create thread to record camera for url '%s'\n", camera->url);
         return 1;
     }
@@ -208,7 +430,33 @@ static int camera_make_sure_working(struct camera *const camera) {
     return 0;
 }
 
+/* Cancelled recorders left behind, those in recorders were never allocated on their own */
+static void camera_reap_cancelled(struct camera *const camera) {
+    for (struct camera_recorder **recorder = &camera->recorders_cancelled; *recorder;) {
+        long ret;
+        int const r = pthread_tryjoin_np((*recorder)->thread, (void **)&ret);
+        if (r == EBUSY) {
+            recorder = &(*recorder)->next_cancelled;
+            continue;
+        }
+        if (r) {
+            pr_error("Unexpected return from joining cancelled record thread: %d\n", r);
+        } else if (ret) {
+            pr_error("Thread for cancelled recorder of camera of url '%s' breaks with %ld\n", camera->url, ret);
+            ++camera->breaks;
+        } else {
+            pr_warn("Cancelled camera recorder for url '%s' safely ends\n", camera->url);
+        }
+        struct camera_recorder *const reaped = *recorder;
+        *recorder = reaped->next_cancelled;
+        if (reaped < camera->recorders || reaped >= camera->recorders + 2) {
+            free(reaped);
+        }
+    }
+}
+
 static int camera_check_last(struct camera *const camera) {
+    camera_reap_cancelled(camera);
     if (camera->recorder_working_last) {
         int r;
         long ret;
@@ -233,21 +481,59 @@ static int camera_check_last(struct camera *const camera) {
     return 0;
 }
 
-int cameras_work(struct camera *const camera_head) {
-    time_t time_now = time(NULL);
-    if (time_now >= time_next) {
-        localtime_r(&time_now, &tms_now);
-        struct tm tms_next = tms_now;
-        int minute = (tms_now.tm_min + 11) / 10 * 10;
-        if (minute >= 60) {
-            tms_next.tm_min = minute % 60;
-            ++tms_next.tm_hour;
-        } else {
-            tms_next.tm_min = minute;
+/* Cameras the loop engine can't drive are still recorded with threads */
+int cameras_start_loop(struct camera *const camera_head) {
+    if (engine != CAMERA_ENGINE_LOOP) {
+        return 0;
+    }
+    for (struct camera *camera = camera_head; camera; camera = camera->next_camera) {
+        if (!loop_supports(camera->url)) {
+            pr_warn("URL '%s' of camera '%s' not supported by loop engine, recording it with threads\n", camera->url, camera->name);
+            continue;
         }
-        tms_next.tm_sec = 0;
-        time_next = mktime(&tms_next);
+        if (loop_add(camera->url, camera->name, camera_next_segment, camera, &camera->mux)) {
+            pr_error("Failed to add camera '%s' to loop engine\n", camera->name);
+            return 1;
+        }
+        camera->looped = true;
+    }
+    if (loop_start()) {
+        pr_error("Failed to start loop engine\n");
+        return 2;
+    }
+    return 0;
+}
+
+static void camera_update_time_wake(struct camera const *const camera, time_t *const time_wake) {
+    if (camera->break_waiting && (!*time_wake || camera->break_wait_until < *time_wake)) {
+        *time_wake = camera->break_wait_until;
+    }
+}
+
+/* time_wake is set to when we need to be called again, or 0 if only when a recorder ends */
+int cameras_work(struct camera *const camera_head, time_t *const time_wake) {
+    *time_wake = 0;
+    if (record_mode == CAMERA_RECORD_MODE_PERSISTENT) {
+        /* The recorders cut segments by themselves, we only need to bring them back when they break */
         for (struct camera *camera = camera_head; camera; camera = camera->next_camera) {
+            if (camera->looped) {
+                continue;
+            }
+            if (camera_make_sure_working(camera)) {
+                pr_error("Failed to make sure camera for url '%s' is working\n", camera->url);
+                return 3;
+            }
+            camera_update_time_wake(camera, time_wake);
+        }
+        return 0;
+    }
+    time_t time_now = time(NULL);
+    for (struct camera *camera = camera_head; camera; camera = camera->next_camera) {
+        if (camera->looped) {
+            continue;
+        }
+        if (time_now >= camera->time_next) {
+            camera->time_next = camera_get_time_next_staggered(camera, time_now, &camera->tms_now);
             if (camera_push_this_to_last(camera)) {
                 pr_error("Failed to push this to last for camera of url '%s'\n", camera->url);
                 return 1;
@@ -257,8 +543,6 @@ int cameras_work(struct camera *const camera_head) {
                 return 2;
             }
         }
-    }
-    for (struct camera *camera = camera_head; camera; camera = camera->next_camera) {
         if (camera_make_sure_working(camera)) {
             pr_error("Failed to make sure camera for url '%s' is working\n", camera->url);
             return 3;
@@ -267,6 +551,10 @@ int cameras_work(struct camera *const camera_head) {
             pr_error("Failed to check last camera for url '%s'\n", camera->url);
             return 3;
         }
+        camera_update_time_wake(camera, time_wake);
+        if (!*time_wake || camera->time_next < *time_wake) {
+            *time_wake = camera->time_next;
+        }
     }
     return 0;
 }
\ No newline at end of file
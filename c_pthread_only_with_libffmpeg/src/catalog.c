@@ -0,0 +1,415 @@
+#include "catalog.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "print.h"
+
+#define catalog_entries(header) ((struct catalog_entry *)((header) + 1))
+
+static size_t catalog_map_size(uint64_t const alloc) {
+    return sizeof(struct catalog_header) + alloc * sizeof(struct catalog_entry);
+}
+
+static int catalog_map(struct catalog *const catalog, uint64_t const alloc) {
+    size_t const size = catalog_map_size(alloc);
+    if (ftruncate(catalog->fd, size) < 0) {
+        pr_error_with_errno("Failed to size catalog '%s' to %zu bytes", catalog->path, size);
+        return 1;
+    }
+    void *const map = catalog->header ?
+        mremap(catalog->header, catalog_map_size(catalog->alloc), size, MREMAP_MAYMOVE) :
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, catalog->fd, 0);
+    if (map == MAP_FAILED) {
+        pr_error_with_errno("Failed to map catalog '%s'", catalog->path);
+        return 2;
+    }
+    catalog->header = map;
+    catalog->alloc = alloc;
+    return 0;
+}
+
+static int catalog_write_paths_header(int const fd, uint32_t const generation) {
+    struct catalog_paths_header header = {
+        .generation = generation,
+        .reserved = 0
+    };
+    memcpy(header.magic, CATALOG_PATHS_MAGIC, sizeof header.magic);
+    return pwrite(fd, &header, sizeof header, 0) != sizeof header;
+}
+
+static int catalog_reset(struct catalog *const catalog) {
+    if (ftruncate(catalog->fd_paths, 0) < 0 || ftruncate(catalog->fd, 0) < 0) {
+        pr_error_with_errno("Failed to truncate catalog '%s'", catalog->path);
+        return 1;
+    }
+    if (catalog_write_paths_header(catalog->fd_paths, 0)) {
+        pr_error_with_errno("Failed to write header of catalog paths '%s'", catalog->path_paths);
+        return 1;
+    }
+    catalog->len_paths = sizeof(struct catalog_paths_header);
+    if (catalog_map(catalog, CATALOG_ALLOC_STEP)) {
+        return 2;
+    }
+    memset(catalog->header, 0, sizeof *catalog->header);
+    memcpy(catalog->header->magic, CATALOG_MAGIC, sizeof catalog->header->magic);
+    catalog->header->entry_size = sizeof(struct catalog_entry);
+    return 0;
+}
+
+/* fresh is set if there was no usable catalog, so the storage must be scanned to fill it */
+int catalog_open(struct catalog *const catalog, char const *const storage_path, bool *const fresh) {
+    catalog->header = NULL;
+    catalog->alloc = 0;
+    catalog->fd_paths = -1;
+    if (snprintf(catalog->path, PATH_MAX, "%s/"CATALOG_NAME, storage_path) >= PATH_MAX ||
+        snprintf(catalog->path_paths, PATH_MAX, "%s/"CATALOG_PATHS_NAME, storage_path) >= PATH_MAX) {
+        pr_error("Path of catalog for storage '%s' too long\n", storage_path);
+        return 1;
+    }
+    if ((catalog->fd = open(catalog->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        pr_error_with_errno("Failed to open catalog '%s'", catalog->path);
+        return 2;
+    }
+    if ((catalog->fd_paths = open(catalog->path_paths, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        pr_error_with_errno("Failed to open catalog paths '%s'", catalog->path_paths);
+        close(catalog->fd);
+        return 3;
+    }
+    if (pthread_mutex_init(&catalog->mutex, NULL)) {
+        pr_error("Failed to init mutex for catalog '%s'\n", catalog->path);
+        catalog_close(catalog);
+        return 4;
+    }
+    struct stat st, st_paths;
+    if (fstat(catalog->fd, &st) < 0 || fstat(catalog->fd_paths, &st_paths) < 0) {
+        pr_error_with_errno("Failed to get stat of catalog '%s'", catalog->path);
+        catalog_close(catalog);
+        return 5;
+    }
+    *fresh = true;
+    if ((size_t)st.st_size >= sizeof(struct catalog_header)) {
+        uint64_t const alloc = (st.st_size - sizeof(struct catalog_header)) / sizeof(struct catalog_entry);
+        if (catalog_map(catalog, alloc > CATALOG_ALLOC_STEP ? alloc : CATALOG_ALLOC_STEP)) {
+            catalog_close(catalog);
+            return 6;
+        }
+        struct catalog_header const *const header = catalog->header;
+        struct catalog_paths_header header_paths;
+        /* Both files from the same compaction, a crash between its renames leaves them apart */
+        if (!memcmp(header->magic, CATALOG_MAGIC, sizeof header->magic) &&
+            header->entry_size == sizeof(struct catalog_entry) && header->count <= alloc &&
+            pread(catalog->fd_paths, &header_paths, sizeof header_paths, 0) == sizeof header_paths &&
+            !memcmp(header_paths.magic, CATALOG_PATHS_MAGIC, sizeof header_paths.magic) &&
+            header_paths.generation == header->generation) {
+            catalog->len_paths = st_paths.st_size;
+            *fresh = false;
+            return 0;
+        }
+        pr_warn("Catalog '%s' is not usable, rebuilding it\n", catalog->path);
+    }
+    if (catalog_reset(catalog)) {
+        catalog_close(catalog);
+        return 7;
+    }
+    return 0;
+}
+
+void catalog_close(struct catalog *const catalog) {
+    if (catalog->header) {
+        munmap(catalog->header, catalog_map_size(catalog->alloc));
+        catalog->header = NULL;
+    }
+    if (catalog->fd_paths >= 0) {
+        close(catalog->fd_paths);
+        catalog->fd_paths = -1;
+    }
+    if (catalog->fd >= 0) {
+        close(catalog->fd);
+        catalog->fd = -1;
+    }
+}
+
+/* Calls back for every live entry, entries pointing outside of the paths file (torn by a crash) are killed */
+int catalog_foreach(struct catalog *const catalog, catalog_entry_cb const cb, void *const arg) {
+    uint64_t const count = catalog->header->count;
+    if (!count) {
+        return 0;
+    }
+    char const *paths = NULL;
+    if (catalog->len_paths && (paths = mmap(NULL, catalog->len_paths, PROT_READ, MAP_SHARED, catalog->fd_paths, 0)) == MAP_FAILED) {
+        pr_error_with_errno("Failed to map catalog paths '%s'", catalog->path_paths);
+        return 1;
+    }
+    int r = 0;
+    struct catalog_entry *const entries = catalog_entries(catalog->header);
+    for (uint64_t i = 0; i < count; ++i) {
+        struct catalog_entry *const entry = entries + i;
+        if (!(entry->flags & CATALOG_ENTRY_LIVE)) {
+            continue;
+        }
+        if (!entry->len_path || entry->offset_path + entry->len_path >= catalog->len_paths || paths[entry->offset_path + entry->len_path]) {
+            catalog_remove(catalog, i);
+            continue;
+        }
+        if ((r = cb(arg, i, entry, paths + entry->offset_path))) {
+            break;
+        }
+    }
+    if (paths) {
+        munmap((void *)paths, catalog->len_paths);
+    }
+    return r;
+}
+
+static int catalog_write_path(int const fd, uint64_t const offset, char const *const subpath, size_t const len) {
+    size_t remain = len + 1;
+    char const *buffer = subpath;
+    uint64_t at = offset;
+    while (remain) {
+        ssize_t const r = pwrite(fd, buffer, remain, at);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        buffer += r;
+        at += r;
+        remain -= r;
+    }
+    return 0;
+}
+
+int catalog_append(struct catalog *const catalog, char const *const subpath, char const *const camera, time_t const time_start, time_t const time_end, int64_t const size, uint32_t *const index) {
+    struct catalog_header *header = catalog->header;
+    if (header->count >= UINT32_MAX) {
+        pr_error("Catalog '%s' full\n", catalog->path);
+        return 1;
+    }
+    if (header->count == catalog->alloc) {
+        if (catalog_map(catalog, catalog->alloc + CATALOG_ALLOC_STEP)) {
+            return 2;
+        }
+        header = catalog->header;
+    }
+    size_t const len_path = strlen(subpath);
+    if (catalog_write_path(catalog->fd_paths, catalog->len_paths, subpath, len_path)) {
+        pr_error_with_errno("Failed to append '%s' to catalog paths '%s'", subpath, catalog->path_paths);
+        return 3;
+    }
+    struct catalog_entry *const entry = catalog_entries(header) + header->count;
+    entry->len_path = len_path;
+    entry->offset_path = catalog->len_paths;
+    entry->time_start = time_start;
+    entry->time_end = time_end;
+    entry->size = size;
+    memset(entry->camera, 0, sizeof entry->camera);
+    if (camera) {
+        strncpy(entry->camera, camera, sizeof entry->camera - 1);
+    }
+    entry->flags = CATALOG_ENTRY_LIVE;
+    catalog->len_paths += len_path + 1;
+    *index = header->count++;
+    return 0;
+}
+
+/* A reference to an entry that outlives compactions, they just make it stale */
+int64_t catalog_handle(struct catalog const *const catalog, uint32_t const index) {
+    return (int64_t)catalog->header->generation << 32 | index;
+}
+
+void catalog_finish(struct catalog *const catalog, int64_t const handle, time_t const time_end, int64_t const size) {
+    if (handle == CATALOG_HANDLE_NONE || (uint32_t)(handle >> 32) != catalog->header->generation) {
+        return;
+    }
+    uint32_t const index = handle & UINT32_MAX;
+    if (index >= catalog->header->count) {
+        return;
+    }
+    struct catalog_entry *const entry = catalog_entries(catalog->header) + index;
+    if (entry->flags & CATALOG_ENTRY_LIVE) {
+        entry->time_end = time_end;
+        entry->size = size;
+    }
+}
+
+/* Returns 1 if there's no live entry at index */
+int catalog_get(struct catalog const *const catalog, uint32_t const index, struct catalog_entry *const entry) {
+    if (index >= catalog->header->count) {
+        return 1;
+    }
+    *entry = catalog_entries(catalog->header)[index];
+    return !(entry->flags & CATALOG_ENTRY_LIVE);
+}
+
+void catalog_remove(struct catalog *const catalog, uint32_t const index) {
+    if (index >= catalog->header->count) {
+        return;
+    }
+    struct catalog_entry *const entry = catalog_entries(catalog->header) + index;
+    if (entry->flags & CATALOG_ENTRY_LIVE) {
+        entry->flags &= ~CATALOG_ENTRY_LIVE;
+        ++catalog->header->dead;
+    }
+}
+
+bool catalog_needs_compact(struct catalog const *const catalog) {
+    struct catalog_header const *const header = catalog->header;
+    return header->dead >= CATALOG_COMPACT_MIN && header->dead * 2 > header->count;
+}
+
+/* So the renames of a compaction survive a power loss */
+static int catalog_sync_dir(struct catalog const *const catalog) {
+    char path_dir[PATH_MAX];
+    strncpy(path_dir, catalog->path, PATH_MAX);
+    char *const slash = strrchr(path_dir, '/');
+    if (slash) {
+        *slash = '\0';
+    }
+    int const fd = open(slash ? path_dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    int const r = fsync(fd);
+    close(fd);
+    return r < 0;
+}
+
+struct catalog_compact_arg {
+    struct catalog *catalog;
+    int fd;
+    int fd_paths;
+    uint64_t len_paths;
+    uint32_t *map;
+    struct catalog_entry *entries;
+    uint32_t count;
+};
+
+static int catalog_compact_entry(void *const arg, uint32_t const index, struct catalog_entry const *const entry, char const *const subpath) {
+    struct catalog_compact_arg *const compact = arg;
+    if (catalog_write_path(compact->fd_paths, compact->len_paths, subpath, entry->len_path)) {
+        pr_error_with_errno("Failed to write compacted catalog paths");
+        return 1;
+    }
+    struct catalog_entry *const entry_new = compact->entries + compact->count;
+    *entry_new = *entry;
+    entry_new->offset_path = compact->len_paths;
+    compact->len_paths += entry->len_path + 1;
+    compact->map[index] = compact->count++;
+    return 0;
+}
+
+/* Rewrites both files with only live entries, map[old index] is then the new index, or UINT32_MAX if gone,
+   the caller frees map; on failure the catalog is left as it was, still mapped */
+int catalog_compact(struct catalog *const catalog, uint32_t **const map, uint64_t *const map_size) {
+    struct catalog_header const *const header = catalog->header;
+    uint64_t const count = header->count;
+    uint64_t const live = count - header->dead;
+    char path_new[PATH_MAX + 4], path_paths_new[PATH_MAX + 4];
+    snprintf(path_new, sizeof path_new, "%s.new", catalog->path);
+    snprintf(path_paths_new, sizeof path_paths_new, "%s.new", catalog->path_paths);
+    struct catalog_compact_arg compact = {
+        .catalog = catalog,
+        .len_paths = sizeof(struct catalog_paths_header),
+        .count = 0
+    };
+    if (!(compact.map = malloc(sizeof *compact.map * (count ? count : 1)))) {
+        pr_error_with_errno("Failed to allocate catalog compaction map");
+        return 1;
+    }
+    memset(compact.map, 0xff, sizeof *compact.map * count);
+    if (!(compact.entries = malloc(sizeof *compact.entries * (live ? live : 1)))) {
+        pr_error_with_errno("Failed to allocate compacted catalog entries");
+        free(compact.map);
+        return 2;
+    }
+    if ((compact.fd_paths = open(path_paths_new, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        pr_error_with_errno("Failed to create compacted catalog paths '%s'", path_paths_new);
+        free(compact.entries);
+        free(compact.map);
+        return 3;
+    }
+    int r = 0;
+    if (catalog_write_paths_header(compact.fd_paths, header->generation + 1)) {
+        pr_error_with_errno("Failed to write header of compacted catalog paths '%s'", path_paths_new);
+        r = 4;
+        goto compact_fail_paths;
+    }
+    if (catalog_foreach(catalog, catalog_compact_entry, &compact)) {
+        r = 4;
+        goto compact_fail_paths;
+    }
+    if ((compact.fd = open(path_new, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        pr_error_with_errno("Failed to create compacted catalog '%s'", path_new);
+        r = 5;
+        goto compact_fail_paths;
+    }
+    struct catalog_header header_new = *header;
+    header_new.count = compact.count;
+    header_new.dead = 0;
+    ++header_new.generation;
+    if (pwrite(compact.fd, &header_new, sizeof header_new, 0) != sizeof header_new ||
+        pwrite(compact.fd, compact.entries, sizeof *compact.entries * compact.count, sizeof header_new) != (ssize_t)(sizeof *compact.entries * compact.count)) {
+        pr_error_with_errno("Failed to write compacted catalog '%s'", path_new);
+        r = 6;
+        goto compact_fail;
+    }
+    /* Mapped before the old one is given up, so a failure leaves the catalog as it was */
+    uint64_t const alloc = (compact.count / CATALOG_ALLOC_STEP + 1) * CATALOG_ALLOC_STEP;
+    size_t const size = catalog_map_size(alloc);
+    if (ftruncate(compact.fd, size) < 0) {
+        pr_error_with_errno("Failed to size compacted catalog '%s' to %zu bytes", path_new, size);
+        r = 7;
+        goto compact_fail;
+    }
+    struct catalog_header *const header_mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, compact.fd, 0);
+    if (header_mapped == MAP_FAILED) {
+        pr_error_with_errno("Failed to map compacted catalog '%s'", path_new);
+        r = 8;
+        goto compact_fail;
+    }
+    /* Both whole on disk before either replaces the old one, a crash between the renames leaves
+       the generations apart, and the catalog is then rebuilt from a scan */
+    if (fsync(compact.fd_paths) < 0 || fsync(compact.fd) < 0 || catalog_sync_dir(catalog)) {
+        pr_error_with_errno("Failed to sync compacted catalog '%s'", path_new);
+        r = 9;
+        goto compact_fail_mapped;
+    }
+    if (rename(path_paths_new, catalog->path_paths) < 0 || rename(path_new, catalog->path) < 0) {
+        pr_error_with_errno("Failed to replace catalog '%s' with compacted one", catalog->path);
+        r = 10;
+        goto compact_fail_mapped;
+    }
+    if (catalog_sync_dir(catalog)) {
+        pr_warn("Failed to sync folder of catalog '%s', errno: %d, error: %s\n", catalog->path, errno, strerror(errno));
+    }
+    munmap(catalog->header, catalog_map_size(catalog->alloc));
+    catalog->header = header_mapped;
+    catalog->alloc = alloc;
+    close(catalog->fd);
+    close(catalog->fd_paths);
+    catalog->fd = compact.fd;
+    catalog->fd_paths = compact.fd_paths;
+    catalog->len_paths = compact.len_paths;
+    free(compact.entries);
+    pr_warn("Compacted catalog '%s' from %lu to %u entries\n", catalog->path, count, compact.count);
+    *map = compact.map;
+    *map_size = count;
+    return 0;
+compact_fail_mapped:
+    munmap(header_mapped, size);
+compact_fail:
+    close(compact.fd);
+    unlink(path_new);
+compact_fail_paths:
+    close(compact.fd_paths);
+    unlink(path_paths_new);
+    free(compact.entries);
+    free(compact.map);
+    return r;
+}
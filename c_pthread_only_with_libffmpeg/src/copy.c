@@ -0,0 +1,145 @@
+#include "copy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "print.h"
+
+char const copy_strategy_strings[][9] = {
+    "clone",
+    "range",
+    "sendfile"
+};
+
+/* Errors that only say the strategy does not work between these two files */
+static bool copy_unsupported(int const error) {
+    switch (error) {
+    case EXDEV:
+    case EOPNOTSUPP:
+    case EINVAL:
+    case ENOTTY:
+    case ENOSYS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Copies up to remain bytes with the fastest strategy that works, from and to the current
+   offsets of both fds, a clone always takes the whole file but counts no more than remain,
+   the pair is stepped down for good only if its strategy turns out unsupported, returns
+   bytes copied or -1 with errno set */
+ssize_t copy_chunk(struct copy *const copy, int const fd_in, int const fd_out, size_t const remain) {
+    ssize_t r;
+    switch (copy->strategy) {
+    case COPY_STRATEGY_CLONE:
+        /* All or nothing, and only onto an empty file, so only tried for whole files, the rest
+           of a file already partly there goes by copy_file_range without stepping the pair down */
+        if (lseek(fd_out, 0, SEEK_CUR) == 0) {
+            if (!ioctl(fd_out, FICLONE, fd_in)) {
+                /* The whole file, however little was asked for, a tail grown since is taken along */
+                off_t const size = lseek(fd_in, 0, SEEK_END);
+                if (size < 0 || lseek(fd_out, 0, SEEK_END) < 0) {
+                    return -1;
+                }
+                return (size_t)size < remain ? size : (ssize_t)remain;
+            }
+            if (!copy_unsupported(errno)) {
+                return -1;
+            }
+            pr_warn("Cloning not supported between these files (%s), falling back to copy_file_range\n", strerror(errno));
+            copy->strategy = COPY_STRATEGY_RANGE;
+        }
+        __attribute__((fallthrough));
+    case COPY_STRATEGY_RANGE:
+        r = copy_file_range(fd_in, NULL, fd_out, NULL, remain, 0);
+        if (!r) {
+            /* Shrunk under us, never loop on it, nor take it for the pair not supporting it */
+            errno = ENODATA;
+            return -1;
+        }
+        if (r > 0 || !copy_unsupported(errno)) {
+            return r;
+        }
+        pr_warn("copy_file_range not supported between these files (%s), falling back to sendfile\n", strerror(errno));
+        copy->strategy = COPY_STRATEGY_SENDFILE;
+        __attribute__((fallthrough));
+    case COPY_STRATEGY_SENDFILE:
+    default:
+        r = sendfile(fd_out, fd_in, NULL, remain);
+        if (!r) {
+            /* Shrunk under us, never loop on it */
+            errno = ENODATA;
+            return -1;
+        }
+        return r;
+    }
+}
+
+void copy_account(struct copy *const copy, enum copy_strategy const strategy, size_t const bytes, unsigned long long const time_ns) {
+    struct copy_stats *const stats = copy->stats + strategy;
+    ++stats->files;
+    stats->bytes += bytes;
+    stats->time_ns += time_ns;
+}
+
+void copy_report(struct copy const *const copy, char const *const dir_from, char const *const dir_to) {
+    for (enum copy_strategy strategy = COPY_STRATEGY_CLONE; strategy < COPY_STRATEGY_COUNT; ++strategy) {
+        struct copy_stats const *const stats = copy->stats + strategy;
+        if (!stats->files) {
+            continue;
+        }
+        pr_warn("Copied %lu files (%llu bytes) from '%s' to '%s' with %s in %llums, %llu MiB/s\n", stats->files, stats->bytes, dir_from, dir_to, copy_strategy_strings[strategy], stats->time_ns / 1000000, stats->time_ns ? stats->bytes * 1000000000 / stats->time_ns / 0x100000 : 0);
+    }
+}
+
+/* Picks the strategy for files going from one storage to another by copying a small file
+   between them, the strategy is kept at sendfile if the probe could not even be set up */
+int copy_probe(struct copy *const copy, char const *const dir_from, char const *const dir_to) {
+    copy->strategy = COPY_STRATEGY_SENDFILE;
+    char path_from[PATH_MAX];
+    char path_to[PATH_MAX];
+    if (snprintf(path_from, PATH_MAX, "%s/"COPY_PROBE_NAME, dir_from) >= PATH_MAX ||
+        snprintf(path_to, PATH_MAX, "%s/"COPY_PROBE_NAME, dir_to) >= PATH_MAX) {
+        pr_error("Path too long to probe copying from '%s' to '%s'\n", dir_from, dir_to);
+        return 1;
+    }
+    int const fd_in = open(path_from, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_in < 0) {
+        pr_error_with_errno("Failed to create probe file '%s'", path_from);
+        return 2;
+    }
+    int const fd_out = open(path_to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_out < 0) {
+        pr_error_with_errno("Failed to create probe file '%s'", path_to);
+        close(fd_in);
+        unlink(path_from);
+        return 3;
+    }
+    int r = 0;
+    char buffer[COPY_PROBE_SIZE];
+    memset(buffer, 'n', COPY_PROBE_SIZE);
+    if (write(fd_in, buffer, COPY_PROBE_SIZE) != COPY_PROBE_SIZE || fsync(fd_in) < 0 || lseek(fd_in, 0, SEEK_SET) < 0) {
+        pr_error_with_errno("Failed to write probe file '%s'", path_from);
+        r = 4;
+    } else if (!ioctl(fd_out, FICLONE, fd_in)) {
+        copy->strategy = COPY_STRATEGY_CLONE;
+    } else if (copy_file_range(fd_in, NULL, fd_out, NULL, COPY_PROBE_SIZE, 0) == COPY_PROBE_SIZE) {
+        copy->strategy = COPY_STRATEGY_RANGE;
+    }
+    close(fd_in);
+    close(fd_out);
+    unlink(path_from);
+    unlink(path_to);
+    pr_warn("Files would be copied from '%s' to '%s' with %s\n", dir_from, dir_to, copy_strategy_strings[copy->strategy]);
+    return r;
+}
@@ -3,6 +3,15 @@
 char const help[] = 
     "./nvr --storage [storage definition] (--storage [storage definition] (--storage [storage definition] (...)))\n"
     "      --camera [camera definition] (--camera [camera definition] (--camera [camera definition] (...)))\n"
+    "      (--record-mode [overlap|persistent])\n"
+    "      (--ring-size [size])\n"
+    "      (--memory-budget [size])\n"
+    "      (--engine [thread|loop])\n"
+    "      (--rotation-window [seconds])\n"
+    "      (--stall-timeout [seconds])\n"
+    "      (--storage-order [mtime|name])\n"
+    "      (--scan-threads [threads])\n"
+    "      (--migrate-engine [engine])\n"
     "      --help\n"
     "      --version\n\n"
     "  - [storage deinition]: [path]:[thresholds](:[flags])\n"
@@ -14,7 +23,24 @@ char const help[] =
     "      - [to]: when free space >= this, stops cleaning\n"
     "      - [flags]: optional flags seperated by comma, currently supported:\n"
     "        - half_duplex: this storage device has half-duplex I/O behaviour, make sure only one of read/write is performed on it at the same time, useful for e.g. usb 2.0 drive. \n"
-    "  - [camera definition]: [name]:[strftime]:[url]\n"
+    "        - rate=[size]: bytes per second the cleaner of this storage could read and write when moving or removing files, e.g. rate=50M, default no limit; cleaners always run with idle I/O priority, and those sharing a device with recorders also back off while recorder writes get slow\n"
+    "  - [camera definition]: [name]:[strftime]:[url](#[options])\n"
     "    - [name]: used to generate output name if strftime not set, or only for reminder if strftime set\n"
     "    - [strftime]: will be used to construct the output name, without suffix, appended after storage\n"
-    "    - [url]: a valid input url for ffmpeg\n";
\ No newline at end of file
+    "    - [url]: a valid input url for ffmpeg, with any '#' in it escaped as '\\#' as the first '#' starts the options\n"
+    "    - [options]: optional libavformat/protocol options for this camera in the form of key=value seperated by comma, e.g. rtsp_transport=tcp,buffer_size=4194304,reorder_queue_size=500,stimeout=5000000,fflags=nobuffer,probesize=1000000\n"
+    "  - --record-mode: how segments are cut, one of:\n"
+    "    - overlap (default): start a new recorder with its own connection every 10 minutes, overlapping the last one for 5 seconds\n"
+    "    - persistent: keep one connection per camera and switch output file at the first keyframe after every 10 minutes, the next file is opened a few seconds ahead so the switch itself is only a swap\n"
+    "  - --ring-size: byte budget of the packet ring between the reader and the writer of each recorder, e.g. 16M (default), when the writer falls behind non-reference frames are shed from half of it, the rest of each GOP but its keyframe when it's full\n"
+    "  - --memory-budget: byte budget of the packet rings of all recorders together, e.g. 512M, default 0 for no limit; an empty ring, or one holding less than 1/8 of --ring-size, still takes packets past it so rings stalled on one disk never starve the other cameras\n"
+    "  - --engine: how recorders are driven, one of:\n"
+    "    - thread (default): each recorder has its own threads\n"
+    "    - loop: a fixed pool of workers (one per core) drives the sockets of tcp:// and http:// cameras only through epoll, always cutting segments like persistent record mode, their segments are written by a small pool of writers (two per worker) shared by all of them so the workers never wait on the disk; rtsp:// and other cameras still use threads\n"
+    "  - --rotation-window: spread the 10-minute segment boundaries of cameras by a fixed per-camera offset (hash of name) up to this many seconds, to avoid all cameras reconnecting at once, default 0\n"
+    "  - --stall-timeout: reconnect a camera when no packet came from it for this many seconds once it is opened, 0 to never, default 10\n"
+    "  - --storage-order: how files in storages are ordered to find the oldest, one of:\n"
+    "    - mtime (default): by modification time\n"
+    "    - name: by the start time parsed back from names with the strftime of cameras, so scanning needs no stat; only fixed-width numeric conversions (%Y %y %m %d %H %M %S %s %F %T) could be parsed, names not matching any camera still go by mtime\n"
+    "  - --scan-threads: threads walking a storage together when it has to be scanned (first run, or catalog deleted), default 0 for 2 per CPU\n"
+    "  - --migrate-engine: how files are copied when moved to a next storage on another filesystem, and removed from the last storage, either uring (default, several files and MiBs in flight through io_uring, falls back to sendfile if the kernel lacks it) or sendfile (one file at a time); either way files are cloned (FICLONE) or copied with copy_file_range instead when a probe at start shows the two storages support it\n";
\ No newline at end of file
@@ -0,0 +1,575 @@
+#include "loop.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <signal.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <libavformat/avio.h>
+
+#include "print.h"
+
+#define LOOP_STACK_SIZE 0x100000 /* 1 MiB, only the touched pages count against RSS */
+#define LOOP_IO_BUFFER_SIZE 0x10000
+#define LOOP_HEADER_SIZE 0x1000
+#define LOOP_STALL_SECONDS 30
+#define LOOP_POLL_SECONDS 1 /* How often a session waiting on the writers to let it go is looked at */
+#define LOOP_WRITERS_PER_WORKER 2 /* Writers block on the disk, so one slow disk can't take all of them as easily */
+#define LOOP_EVENTS 64
+
+struct loop_worker;
+
+struct loop_session {
+    struct loop_session *next_session;
+    struct loop_worker *worker;
+    char const *url;
+    char const *name;
+    mux_next_segment_cb next_segment;
+    void *arg;
+    struct mux_state *state;
+    bool http;
+    char host[NAME_MAX];
+    char port[8];
+    char path[PATH_MAX];
+    int fd;
+    int resolve_fd; /* Written once a name resolution is done, kept for good as a late write must not hit a reused fd */
+    ucontext_t context;
+    void *stack;
+    bool running;
+    bool waiting;
+    bool polling; /* Resumed every LOOP_POLL_SECONDS instead of on socket events */
+    bool timed_out;
+    time_t wait_since;
+    time_t restart_at;
+    unsigned breaks;
+    int ret;
+    char header[LOOP_HEADER_SIZE];
+    char *pending;
+    size_t len_pending;
+};
+
+struct loop_worker {
+    struct loop_session *session_head;
+    unsigned id;
+    int epoll_fd;
+    pthread_t thread;
+    ucontext_t context;
+};
+
+static struct loop_session *session_head = NULL;
+static struct loop_session *session_last = NULL;
+static unsigned sessions_count = 0;
+/* The session being started on this worker, makecontext() can't portably pass pointers */
+static __thread struct loop_session *session_starting;
+
+/* Only byte-stream sources where we own the socket, RTSP opens its own transports so stays on threads */
+bool loop_supports(char const *const url) {
+    return !strncmp(url, "tcp://", 6) || !strncmp(url, "http://", 7);
+}
+
+static int loop_parse_url(struct loop_session *const session) {
+    char const *host;
+    if (!strncmp(session->url, "tcp://", 6)) {
+        host = session->url + 6;
+        session->http = false;
+    } else if (!strncmp(session->url, "http://", 7)) {
+        host = session->url + 7;
+        session->http = true;
+    } else {
+        pr_error("URL '%s' not supported by loop engine\n", session->url);
+        return 1;
+    }
+    size_t len_host = strcspn(host, ":/?");
+    if (!len_host || len_host >= sizeof session->host) {
+        pr_error("Host in URL '%s' illegal\n", session->url);
+        return 2;
+    }
+    strncpy(session->host, host, len_host);
+    session->host[len_host] = '\0';
+    char const *rest = host + len_host;
+    if (*rest == ':') {
+        size_t len_port = strcspn(++rest, "/?");
+        if (!len_port || len_port >= sizeof session->port) {
+            pr_error("Port in URL '%s' illegal\n", session->url);
+            return 3;
+        }
+        strncpy(session->port, rest, len_port);
+        session->port[len_port] = '\0';
+        rest += len_port;
+    } else if (session->http) {
+        strncpy(session->port, "80", sizeof session->port);
+    } else {
+        pr_error("Port not defined in URL '%s'\n", session->url);
+        return 4;
+    }
+    if (*rest) {
+        strncpy(session->path, rest, sizeof session->path - 1);
+        session->path[sizeof session->path - 1] = '\0';
+    } else {
+        strncpy(session->path, "/", 2);
+    }
+    return 0;
+}
+
+int loop_add(char const *const url, char const *const name, mux_next_segment_cb next_segment, void *const arg, struct mux_state *const state) {
+    struct loop_session *const session = malloc(sizeof *session);
+    if (!session) {
+        pr_error_with_errno("Failed to allocate memory for loop session");
+        return 1;
+    }
+    session->url = url;
+    session->name = name;
+    session->next_segment = next_segment;
+    session->arg = arg;
+    session->state = state;
+    if (loop_parse_url(session)) {
+        free(session);
+        return 2;
+    }
+    session->stack = mmap(NULL, LOOP_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (session->stack == MAP_FAILED) {
+        pr_error_with_errno("Failed to map stack for loop session of '%s'", url);
+        free(session);
+        return 3;
+    }
+    /* Guard page at the bottom, stack grows down */
+    if (mprotect(session->stack, sysconf(_SC_PAGESIZE), PROT_NONE)) {
+        pr_error_with_errno("Failed to protect stack guard for loop session of '%s'", url);
+    }
+    session->next_session = NULL;
+    session->worker = NULL;
+    session->fd = -1;
+    session->resolve_fd = -1;
+    session->running = false;
+    session->waiting = false;
+    session->polling = false;
+    session->timed_out = false;
+    session->restart_at = 0;
+    session->breaks = 0;
+    if (session_last) {
+        session_last->next_session = session;
+    } else {
+        session_head = session;
+    }
+    session_last = session;
+    ++sessions_count;
+    return 0;
+}
+
+/* Back to the worker until the socket is ready, returns 1 if we stalled for too long */
+static int loop_session_yield(struct loop_session *const session) {
+    session->waiting = true;
+    session->wait_since = time(NULL);
+    swapcontext(&session->context, &session->worker->context);
+    session->waiting = false;
+    bool const timed_out = session->timed_out;
+    session->timed_out = false;
+    return timed_out;
+}
+
+/* Given to the muxer to wait for the writers without blocking the worker */
+static void loop_session_poll(void *const arg) {
+    struct loop_session *const session = arg;
+    session->polling = true;
+    loop_session_yield(session);
+    session->polling = false;
+}
+
+/* Runs on a thread of the resolver, not the worker */
+static void loop_session_resolved(union sigval const value) {
+    struct loop_session const *const session = value.sival_ptr;
+    eventfd_write(session->resolve_fd, 1);
+}
+
+/* getaddrinfo() could block for seconds, so the resolver does it while we yield, with no timeout
+   of our own as the request can't be abandoned while it still points to our stack */
+static int loop_session_resolve(struct loop_session *const session, struct addrinfo **const result) {
+    if (session->resolve_fd < 0) {
+        if ((session->resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            pr_error_with_errno("Failed to create eventfd for resolving '%s'", session->host);
+            return EAI_SYSTEM;
+        }
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLET,
+            .data.ptr = session
+        };
+        if (epoll_ctl(session->worker->epoll_fd, EPOLL_CTL_ADD, session->resolve_fd, &event)) {
+            pr_error_with_errno("Failed to add eventfd for resolving '%s' to epoll", session->host);
+            close(session->resolve_fd);
+            session->resolve_fd = -1;
+            return EAI_SYSTEM;
+        }
+    }
+    struct addrinfo const hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    struct gaicb request = {
+        .ar_name = session->host,
+        .ar_service = session->port,
+        .ar_request = &hints
+    };
+    struct gaicb *requests[] = {&request};
+    struct sigevent notify = {
+        .sigev_notify = SIGEV_THREAD,
+        .sigev_notify_function = loop_session_resolved,
+        .sigev_value.sival_ptr = session
+    };
+    eventfd_t stale; /* From a notification that came after we saw the last request done */
+    eventfd_read(session->resolve_fd, &stale);
+    int r = getaddrinfo_a(GAI_NOWAIT, requests, 1, &notify);
+    if (r) {
+        return r;
+    }
+    while ((r = gai_error(&request)) == EAI_INPROGRESS) {
+        loop_session_yield(session);
+    }
+    *result = request.ar_result;
+    return r;
+}
+
+static int loop_session_connect(struct loop_session *const session) {
+    struct addrinfo *result;
+    int r = loop_session_resolve(session, &result);
+    if (r) {
+        pr_error("Failed to resolve '%s': %s\n", session->host, gai_strerror(r));
+        return 1;
+    }
+    for (struct addrinfo *addr = result; addr; addr = addr->ai_next) {
+        int const fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = session
+        };
+        if (epoll_ctl(session->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            pr_error_with_errno("Failed to add socket of '%s' to epoll", session->url);
+            close(fd);
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+            if (errno != EINPROGRESS) {
+                close(fd);
+                continue;
+            }
+            int error = 0;
+            while (true) {
+                struct pollfd pollfd = {
+                    .fd = fd,
+                    .events = POLLOUT
+                };
+                if (poll(&pollfd, 1, 0) > 0) {
+                    socklen_t len = sizeof error;
+                    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+                        error = errno;
+                    }
+                    break;
+                }
+                if (loop_session_yield(session)) {
+                    error = ETIMEDOUT;
+                    break;
+                }
+            }
+            if (error) {
+                close(fd);
+                continue;
+            }
+        }
+        session->fd = fd;
+        freeaddrinfo(result);
+        return 0;
+    }
+    freeaddrinfo(result);
+    pr_error("Failed to connect to '%s' port '%s'\n", session->host, session->port);
+    return 2;
+}
+
+static int loop_session_request(struct loop_session *const session) {
+    int len = snprintf(session->header, sizeof session->header, "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: nvr\r\n\r\n", session->path, session->host);
+    if (len < 0 || (size_t)len >= sizeof session->header) {
+        pr_error("HTTP request for '%s' too long\n", session->url);
+        return 1;
+    }
+    for (char const *c = session->header; len;) {
+        ssize_t r = send(session->fd, c, len, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && !loop_session_yield(session)) {
+                continue;
+            }
+            pr_error_with_errno("Failed to send HTTP request to '%s'", session->url);
+            return 2;
+        }
+        c += r;
+        len -= r;
+    }
+    size_t len_header = 0;
+    char *end;
+    while (true) {
+        ssize_t r = recv(session->fd, session->header + len_header, sizeof session->header - len_header - 1, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && !loop_session_yield(session)) {
+                continue;
+            }
+            pr_error_with_errno("Failed to receive HTTP response from '%s'", session->url);
+            return 3;
+        }
+        if (!r) {
+            pr_error("HTTP connection to '%s' closed before response finished\n", session->url);
+            return 4;
+        }
+        len_header += r;
+        session->header[len_header] = '\0';
+        if ((end = strstr(session->header, "\r\n\r\n"))) {
+            break;
+        }
+        if (len_header == sizeof session->header - 1) {
+            pr_error("HTTP response header from '%s' too long\n", session->url);
+            return 5;
+        }
+    }
+    if (strncmp(session->header, "HTTP/1.", 7) || strncmp(session->header + 8, " 200", 4)) {
+        pr_error("HTTP response from '%s' not OK: '%.*s'\n", session->url, (int)strcspn(session->header, "\r\n"), session->header);
+        return 6;
+    }
+    /* Body bytes already received together with the header */
+    session->pending = end + 4;
+    session->len_pending = session->header + len_header - session->pending;
+    return 0;
+}
+
+static int loop_session_read(void *const opaque, uint8_t *const buf, int const buf_size) {
+    struct loop_session *const session = opaque;
+    if (session->len_pending) {
+        size_t const len = (size_t)buf_size < session->len_pending ? (size_t)buf_size : session->len_pending;
+        memcpy(buf, session->pending, len);
+        session->pending += len;
+        session->len_pending -= len;
+        return len;
+    }
+    while (true) {
+        ssize_t r = recv(session->fd, buf, buf_size, 0);
+        if (r > 0) {
+            return r;
+        }
+        if (!r) {
+            return AVERROR_EOF;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            return AVERROR(errno);
+        }
+        if (loop_session_yield(session)) {
+            pr_error("No data from '%s' for %d seconds\n", session->url, LOOP_STALL_SECONDS);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+}
+
+static int loop_session_record(struct loop_session *const session) {
+    session->len_pending = 0;
+    if (loop_session_connect(session)) {
+        pr_error("Failed to connect for '%s'\n", session->url);
+        return 1;
+    }
+    int r = 0;
+    if (session->http && loop_session_request(session)) {
+        pr_error("Failed to request '%s'\n", session->url);
+        r = 2;
+        goto record_close;
+    }
+    unsigned char *const buffer = av_malloc(LOOP_IO_BUFFER_SIZE);
+    if (!buffer) {
+        pr_error("Failed to allocate I/O buffer for '%s'\n", session->url);
+        r = 3;
+        goto record_close;
+    }
+    AVIOContext *pb = avio_alloc_context(buffer, LOOP_IO_BUFFER_SIZE, 0, session, loop_session_read, NULL, NULL);
+    if (!pb) {
+        pr_error("Failed to allocate I/O context for '%s'\n", session->url);
+        av_free(buffer);
+        r = 4;
+        goto record_close;
+    }
+    if (mux_persistent_io(session->url, pb, session->next_segment, session->arg, session->state, loop_session_poll, session)) {
+        pr_error("Persistent recording from '%s' breaks in loop worker %u\n", session->url, session->worker->id);
+        r = 5;
+    }
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+record_close:
+    close(session->fd);
+    session->fd = -1;
+    return r;
+}
+
+static void loop_session_entry() {
+    struct loop_session *const session = session_starting;
+    session->ret = loop_session_record(session);
+    session->running = false;
+    /* Returns to uc_link, i.e. the worker */
+}
+
+static void loop_session_finish(struct loop_session *const session) {
+    if (session->ret) {
+        pr_error("Loop session for '%s' breaks with return value '%d'\n", session->url, session->ret);
+        ++session->breaks;
+    } else {
+        pr_warn("Loop session for '%s' safely ends\n", session->url);
+        session->breaks = 0;
+    }
+    time_t wait;
+    if (session->breaks > 10000) {
+        wait = 600;
+    } else if (session->breaks > 1000) {
+        wait = 90;
+    } else if (session->breaks > 100) {
+        wait = 10;
+    } else {
+        wait = 1;
+    }
+    session->restart_at = time(NULL) + wait;
+}
+
+static void loop_session_resume(struct loop_session *const session) {
+    swapcontext(&session->worker->context, &session->context);
+    if (!session->running) {
+        loop_session_finish(session);
+    }
+}
+
+static int loop_session_start(struct loop_session *const session) {
+    if (getcontext(&session->context)) {
+        pr_error_with_errno("Failed to get context for loop session of '%s'", session->url);
+        return 1;
+    }
+    session->context.uc_stack.ss_sp = session->stack;
+    session->context.uc_stack.ss_size = LOOP_STACK_SIZE;
+    session->context.uc_link = &session->worker->context;
+    makecontext(&session->context, loop_session_entry, 0);
+    session->running = true;
+    session->polling = false;
+    session->timed_out = false;
+    pr_warn("Starting loop session for '%s' in worker %u\n", session->url, session->worker->id);
+    session_starting = session;
+    loop_session_resume(session);
+    return 0;
+}
+
+static int loop_worker(struct loop_worker *const worker) {
+    struct epoll_event events[LOOP_EVENTS];
+    while (true) {
+        time_t const now = time(NULL);
+        time_t deadline = now + LOOP_STALL_SECONDS;
+        for (struct loop_session *session = worker->session_head; session; session = session->next_session) {
+            if (session->running) {
+                if (session->waiting) {
+                    if (session->polling) {
+                        loop_session_resume(session);
+                        if (now + LOOP_POLL_SECONDS < deadline) {
+                            deadline = now + LOOP_POLL_SECONDS;
+                        }
+                    } else if (now - session->wait_since >= LOOP_STALL_SECONDS) {
+                        session->timed_out = true;
+                        loop_session_resume(session);
+                    } else if (session->wait_since + LOOP_STALL_SECONDS < deadline) {
+                        deadline = session->wait_since + LOOP_STALL_SECONDS;
+                    }
+                }
+            } else if (now >= session->restart_at) {
+                if (loop_session_start(session)) {
+                    return 1;
+                }
+            } else if (session->restart_at < deadline) {
+                deadline = session->restart_at;
+            }
+        }
+        /* Sleeps until some socket is ready or the earliest restart/stall deadline */
+        int const count = epoll_wait(worker->epoll_fd, events, LOOP_EVENTS, deadline > now ? (deadline - now) * 1000 : 0);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pr_error_with_errno("Failed to wait for epoll events in loop worker %u", worker->id);
+            return 2;
+        }
+        for (int i = 0; i < count; ++i) {
+            struct loop_session *const session = events[i].data.ptr;
+            if (session->running && session->waiting) {
+                loop_session_resume(session);
+            }
+        }
+    }
+    return 0;
+}
+
+static void *loop_worker_thread(void *arg) {
+    long r = loop_worker((struct loop_worker *)arg);
+    pr_error("Loop worker breaks with return value '%ld'\n", r);
+    return (void *)r;
+}
+
+int loop_start() {
+    if (!sessions_count) {
+        return 0;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers_count = cores > 0 ? cores : 1;
+    if (workers_count > sessions_count) {
+        workers_count = sessions_count;
+    }
+    struct loop_worker *const workers = calloc(workers_count, sizeof *workers);
+    if (!workers) {
+        pr_error_with_errno("Failed to allocate memory for loop workers");
+        return 1;
+    }
+    unsigned id = 0;
+    struct loop_session *session = session_head;
+    while (session) {
+        struct loop_session *const next_session = session->next_session;
+        struct loop_worker *const worker = workers + id;
+        session->worker = worker;
+        session->next_session = worker->session_head;
+        worker->session_head = session;
+        session = next_session;
+        id = (id + 1) % workers_count;
+    }
+    for (id = 0; id < workers_count; ++id) {
+        struct loop_worker *const worker = workers + id;
+        worker->id = id;
+        if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            pr_error_with_errno("Failed to create epoll for loop worker %u", id);
+            return 2;
+        }
+        if (pthread_create(&worker->thread, NULL, loop_worker_thread, worker)) {
+            pr_error("Failed to create thread for loop worker %u\n", id);
+            return 3;
+        }
+    }
+    unsigned writers_count = workers_count * LOOP_WRITERS_PER_WORKER;
+    if (writers_count > sessions_count) {
+        writers_count = sessions_count;
+    }
+    if (mux_writers_start(writers_count)) {
+        pr_error("Failed to start writers for loop workers\n");
+        return 4;
+    }
+    pr_warn("Started %u loop workers and %u writers for %u sessions\n", workers_count, writers_count, sessions_count);
+    return 0;
+}
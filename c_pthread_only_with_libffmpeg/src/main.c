@@ -3,28 +3,20 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "print.h"
 #include "version.h"
 #include "storage.h"
 #include "camera.h"
+#include "mux.h"
 #include "mkdir.h"
 #include "help.h"
-
-int wait_all(struct storage *const storage_head, struct camera *const camera_head) {
-    while (true) {
-        if (storages_clean(storage_head)) {
-            pr_error("Storages cleaner breaks\n");
-            return 1;
-        }
-        if (cameras_work(camera_head)) {
-            pr_error("Cameras worker breaks\n");
-            return 2;
-        }
-        sleep(1);
-    }
-    return 0;
-}
+#include "supervisor.h"
+#include "segment.h"
+#include "watcher.h"
+#include "scanner.h"
+#include "migrate.h"
 
 int unbuffer() {
     if (setvbuf(stdout, NULL, _IOLBF, BUFSIZ)) {
@@ -38,6 +30,19 @@ int unbuffer() {
     return 0;
 }
 
+/* Recorders only ever write to the first storage */
+static int evict_on_nospace(void *arg) {
+    return storage_evict_emergency((struct storage *)arg);
+}
+
+static int64_t index_on_created(void *arg, char const *path, char const *name) {
+    return storage_index_add((struct storage *)arg, path, name, time(NULL));
+}
+
+static void index_on_closed(void *arg, int64_t handle, off_t size) {
+    storage_index_finish((struct storage *)arg, handle, time(NULL), size);
+}
+
 int main(int const argc, char const *const argv[]) {
     if (unbuffer()) {
         return -1;
@@ -94,6 +99,24 @@ int main(int const argc, char const *const argv[]) {
                 storage_last = storage_current;
             } else if (!strncmp(arg, "max-cleaners", 13)) {
                 storage_parse_max_cleaners(argv[i]);
+            } else if (!strncmp(arg, "storage-order", 14)) {
+                storage_parse_order(argv[i]);
+            } else if (!strncmp(arg, "scan-threads", 13)) {
+                scanner_parse_threads(argv[i]);
+            } else if (!strncmp(arg, "migrate-engine", 15)) {
+                migrate_parse_engine(argv[i]);
+            } else if (!strncmp(arg, "record-mode", 12)) {
+                camera_parse_record_mode(argv[i]);
+            } else if (!strncmp(arg, "rotation-window", 16)) {
+                camera_parse_rotation_window(argv[i]);
+            } else if (!strncmp(arg, "engine", 7)) {
+                camera_parse_engine(argv[i]);
+            } else if (!strncmp(arg, "ring-size", 10)) {
+                mux_parse_ring_size(argv[i]);
+            } else if (!strncmp(arg, "memory-budget", 14)) {
+                mux_parse_memory_budget(argv[i]);
+            } else if (!strncmp(arg, "stall-timeout", 14)) {
+                mux_parse_stall_timeout(argv[i]);
             } else {
                 pr_error("Illegal argument, unrecognized --argument: '%s'\n", argv[i - 1]);
                 return 5;
@@ -114,15 +137,35 @@ int main(int const argc, char const *const argv[]) {
         puts(help);
         return 8;
     }
+    if (supervisor_init()) {
+        pr_error("Failed to init supervisor\n");
+        return 13;
+    }
+    for (struct camera *camera = camera_head; camera; camera = camera->next_camera) {
+        if (storage_add_name_pattern(camera->strftime)) {
+            pr_error("Failed to add name pattern of camera '%s'\n", camera->name);
+            return 14;
+        }
+    }
     if (storages_init(storage_head)) {
         pr_error("Failed to init storages\n");
         return 9;
     }
+    if (watcher_init(storage_head)) {
+        pr_warn("Failed to init watcher, files put into storages by others would only be noticed after deleting catalogs\n");
+    }
+    segment_set_nospace_handler(evict_on_nospace, storage_head);
+    segment_set_created_handler(index_on_created, storage_head);
+    segment_set_closed_handler(index_on_closed, storage_head);
     if (cameras_init(camera_head, storage_head)) {
         pr_error("Failed to init cameras\n");
         return 10;
     }
-    if (wait_all(storage_head, camera_head)) {
+    if (cameras_start_loop(camera_head)) {
+        pr_error("Failed to start loop engine for cameras\n");
+        return 12;
+    }
+    if (supervisor_run(storage_head, camera_head)) {
         pr_error("Bad things happended when we working on storage and cameras\n");
         return 11;
     }
@@ -0,0 +1,463 @@
+#include "migrate.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "print.h"
+
+#define MIGRATE_TAG_CHUNK 1ULL
+#define MIGRATE_TAG_UNLINK 2ULL
+#define MIGRATE_USER_DATA(tag, index) ((tag) << 32 | (index))
+
+static enum migrate_engine engine = MIGRATE_ENGINE_URING;
+
+char const migrate_engine_strings[][9] = {
+    "uring",
+    "sendfile"
+};
+
+void migrate_parse_engine(char const *const arg) {
+    if (!strcmp(arg, "sendfile")) {
+        engine = MIGRATE_ENGINE_SENDFILE;
+    } else {
+        if (strcmp(arg, "uring")) {
+            pr_warn("Unknown migrate engine '%s', falling back to uring\n", arg);
+        }
+        engine = MIGRATE_ENGINE_URING;
+    }
+    pr_warn("Migrating files between storages with %s\n", migrate_engine_strings[engine]);
+}
+
+static int migrate_ring_init(struct migrate_ring *const ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    if ((ring->fd = syscall(__NR_io_uring_setup, MIGRATE_RING_ENTRIES, &params)) < 0) {
+        pr_warn("Failed to set up io_uring, errno: %d, error: %s\n", errno, strerror(errno));
+        return 1;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        pr_error_with_errno("Failed to map io_uring submission ring");
+        close(ring->fd);
+        return 2;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+        ring->cq_ring_size = 0;
+    } else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        pr_error_with_errno("Failed to map io_uring completion ring");
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return 3;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        pr_error_with_errno("Failed to map io_uring submission entries");
+        if (ring->cq_ring_size) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return 4;
+    }
+    unsigned char *const sq = ring->sq_ring;
+    unsigned char *const cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+/* Never full, there's at most one op in flight for every chunk and file */
+static struct io_uring_sqe *migrate_ring_sqe(struct migrate_ring *const ring, uint64_t const user_data) {
+    unsigned const tail = *ring->sq_tail + ring->to_submit;
+    unsigned const index = tail & ring->sq_mask;
+    struct io_uring_sqe *const sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ++ring->to_submit;
+    return sqe;
+}
+
+static int migrate_ring_submit_and_wait(struct migrate_ring *const ring) {
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + ring->to_submit, memory_order_release);
+    unsigned const to_submit = ring->to_submit;
+    ring->to_submit = 0;
+    while (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            pr_error_with_errno("Failed to enter io_uring");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int migrate_init(struct migrate *const migrate, bool const copies, struct throttle *const throttle, struct writeback_stats *const writeback) {
+    memset(migrate, 0, sizeof *migrate);
+    migrate->ring.fd = -1;
+    migrate->throttle = throttle;
+    migrate->writeback = writeback;
+    if (engine != MIGRATE_ENGINE_URING) {
+        return 0;
+    }
+    if (migrate_ring_init(&migrate->ring)) {
+        pr_warn("Falling back to sendfile to migrate files\n");
+        return 0;
+    }
+    migrate->available = true;
+    if (copies) {
+        if ((migrate->buffers = mmap(NULL, MIGRATE_CHUNK_SIZE * MIGRATE_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+            pr_error_with_errno("Failed to allocate migrate buffers");
+            migrate->buffers = NULL;
+            migrate->available = false;
+            return 1;
+        }
+        struct iovec iovecs[MIGRATE_CHUNKS];
+        for (unsigned i = 0; i < MIGRATE_CHUNKS; ++i) {
+            iovecs[i].iov_base = migrate->buffers + i * MIGRATE_CHUNK_SIZE;
+            iovecs[i].iov_len = MIGRATE_CHUNK_SIZE;
+        }
+        /* Pinned memory counts against RLIMIT_MEMLOCK, plain reads and writes work all the same */
+        if (syscall(__NR_io_uring_register, migrate->ring.fd, IORING_REGISTER_BUFFERS, iovecs, MIGRATE_CHUNKS) < 0) {
+            pr_warn("Failed to register migrate buffers, using them unregistered, errno: %d, error: %s\n", errno, strerror(errno));
+        } else {
+            migrate->fixed = true;
+        }
+    }
+    migrate->unlink_async = true;
+    return 0;
+}
+
+enum migrate_job_state {
+    MIGRATE_JOB_FREE,
+    MIGRATE_JOB_COPYING,
+    MIGRATE_JOB_UNLINKING
+};
+
+struct migrate_job {
+    enum migrate_job_state state;
+    struct migrate_item *item;
+    int fd_in;
+    int fd_out;
+    struct stat st;
+    off_t offset_next; /* Where the next chunk starts */
+    unsigned chunks; /* In flight */
+    size_t dirty; /* Written but not waited for */
+    int error;
+};
+
+struct migrate_chunk {
+    struct migrate_job *job;
+    off_t offset;
+    size_t len;
+    size_t got; /* Read into the buffer */
+    size_t put; /* Written from the buffer */
+};
+
+struct migrate_batch {
+    struct migrate *migrate;
+    struct migrate_job jobs[MIGRATE_FILES_MAX];
+    struct migrate_chunk chunks[MIGRATE_CHUNKS];
+    unsigned ops; /* In flight */
+};
+
+static void migrate_submit_rw(struct migrate_batch *const batch, unsigned const index, bool const write) {
+    struct migrate *const migrate = batch->migrate;
+    struct migrate_chunk *const chunk = batch->chunks + index;
+    struct io_uring_sqe *const sqe = migrate_ring_sqe(&migrate->ring, MIGRATE_USER_DATA(MIGRATE_TAG_CHUNK, index));
+    size_t const done = write ? chunk->put : chunk->got;
+    sqe->opcode = migrate->fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED) : (write ? IORING_OP_WRITE : IORING_OP_READ);
+    sqe->fd = write ? chunk->job->fd_out : chunk->job->fd_in;
+    sqe->addr = (uintptr_t)(migrate->buffers + index * MIGRATE_CHUNK_SIZE + done);
+    sqe->len = (write ? chunk->got : chunk->len) - done;
+    sqe->off = chunk->offset + done;
+    sqe->buf_index = index;
+    /* Requests carry their own class, not the one of the submitting thread */
+    sqe->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    ++batch->ops;
+}
+
+static void migrate_submit_unlink(struct migrate_batch *const batch, struct migrate_job *const job) {
+    job->state = MIGRATE_JOB_UNLINKING;
+    if (batch->migrate->throttle) {
+        throttle_take(batch->migrate->throttle, THROTTLE_UNLINK_COST);
+    }
+    if (!batch->migrate->unlink_async) {
+        job->item->result = unlink(job->item->path_old) < 0 ? errno : 0;
+        job->state = MIGRATE_JOB_FREE;
+        return;
+    }
+    struct io_uring_sqe *const sqe = migrate_ring_sqe(&batch->migrate->ring, MIGRATE_USER_DATA(MIGRATE_TAG_UNLINK, job - batch->jobs));
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->item->path_old;
+    ++batch->ops;
+}
+
+/* All chunks of it are done, keep the times like move_between_fs() does and unlink the old one */
+static void migrate_job_finish(struct migrate_batch *const batch, struct migrate_job *const job) {
+    struct migrate *const migrate = batch->migrate;
+    if (!job->error) {
+        /* On disk before the old one goes, like move_between_fs() */
+        writeback_wait(job->fd_out, 0, 0, migrate->writeback);
+        writeback_drop(job->fd_in, 0, 0);
+        struct timespec const times[2] = {job->st.st_atim, job->st.st_mtim};
+        if (futimens(job->fd_out, times) < 0) {
+            pr_warn("Failed to keep times of '%s' on '%s', errno: %d, error: %s\n", job->item->path_old, job->item->path_new, errno, strerror(errno));
+        }
+    }
+    if (migrate->writeback) {
+        atomic_fetch_sub_explicit(&migrate->writeback->dirty, job->dirty, memory_order_relaxed);
+    }
+    if (close(job->fd_out) < 0 && !job->error) {
+        job->error = errno;
+    }
+    close(job->fd_in);
+    if (job->error) {
+        pr_error("Failed to migrate '%s' to '%s', error: %s\n", job->item->path_old, job->item->path_new, strerror(job->error));
+        unlink(job->item->path_new);
+        job->item->result = job->error;
+        job->state = MIGRATE_JOB_FREE;
+        ++migrate->stats.failures;
+        return;
+    }
+    ++migrate->stats.files;
+    migrate_submit_unlink(batch, job);
+}
+
+static void migrate_job_start(struct migrate_batch *const batch, struct migrate_job *const job, struct migrate_item *const item) {
+    job->item = item;
+    job->chunks = 0;
+    job->offset_next = 0;
+    job->dirty = 0;
+    job->error = 0;
+    item->result = -1; /* Only done once the old one is gone */
+    if (!item->path_new) {
+        migrate_submit_unlink(batch, job);
+        return;
+    }
+    if ((job->fd_in = open(item->path_old, O_RDONLY | O_CLOEXEC)) < 0) {
+        item->result = errno;
+        pr_error_with_errno("Failed to open old file '%s'", item->path_old);
+        return;
+    }
+    if (fstat(job->fd_in, &job->st) < 0) {
+        item->result = errno;
+        pr_error_with_errno("Failed to get stat of old file '%s'", item->path_old);
+        close(job->fd_in);
+        return;
+    }
+    if ((job->fd_out = open(item->path_new, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        item->result = errno;
+        pr_error_with_errno("Failed to open new file '%s'", item->path_new);
+        close(job->fd_in);
+        return;
+    }
+    /* Lets the destination lay it out in one go */
+    if (job->st.st_size && fallocate(job->fd_out, 0, 0, job->st.st_size) < 0 && errno != EOPNOTSUPP) {
+        pr_warn("Failed to preallocate '%s', errno: %d, error: %s\n", item->path_new, errno, strerror(errno));
+    }
+    job->state = MIGRATE_JOB_COPYING;
+    if (!job->st.st_size) {
+        migrate_job_finish(batch, job);
+    }
+}
+
+/* Hands free chunks to copying files round-robin, so several files have I/O in flight */
+static void migrate_assign_chunks(struct migrate_batch *const batch, unsigned *const job_next) {
+    for (unsigned index = 0; index < MIGRATE_CHUNKS; ++index) {
+        struct migrate_chunk *const chunk = batch->chunks + index;
+        if (chunk->job) {
+            continue;
+        }
+        struct migrate_job *job = NULL;
+        for (unsigned i = 0; i < MIGRATE_FILES_MAX && !job; ++i) {
+            struct migrate_job *const candidate = batch->jobs + (*job_next + i) % MIGRATE_FILES_MAX;
+            if (candidate->state == MIGRATE_JOB_COPYING && !candidate->error && candidate->offset_next < candidate->st.st_size) {
+                job = candidate;
+                *job_next = (*job_next + i + 1) % MIGRATE_FILES_MAX;
+            }
+        }
+        if (!job) {
+            return;
+        }
+        chunk->job = job;
+        chunk->offset = job->offset_next;
+        chunk->len = job->st.st_size - job->offset_next < MIGRATE_CHUNK_SIZE ? job->st.st_size - job->offset_next : MIGRATE_CHUNK_SIZE;
+        if (batch->migrate->throttle) {
+            /* Chunks already in flight go on meanwhile, the rate still holds on average */
+            throttle_take(batch->migrate->throttle, chunk->len);
+        }
+        chunk->got = 0;
+        chunk->put = 0;
+        job->offset_next += chunk->len;
+        ++job->chunks;
+        migrate_submit_rw(batch, index, false);
+    }
+}
+
+static void migrate_chunk_done(struct migrate_batch *const batch, struct migrate_chunk *const chunk) {
+    struct migrate_job *const job = chunk->job;
+    chunk->job = NULL;
+    if (chunk->put) {
+        /* Chunks finish out of order, so each starts its own writeback, waited for at the end */
+        writeback_start(job->fd_out, chunk->offset, chunk->put);
+        writeback_drop(job->fd_in, chunk->offset, chunk->put);
+        job->dirty += chunk->put;
+        if (batch->migrate->writeback) {
+            writeback_account_dirty(batch->migrate->writeback, chunk->put);
+        }
+    }
+    batch->migrate->stats.bytes += chunk->put;
+    if (!--job->chunks && (job->error || job->offset_next >= job->st.st_size)) {
+        migrate_job_finish(batch, job);
+    }
+}
+
+static void migrate_complete_chunk(struct migrate_batch *const batch, unsigned const index, int const res) {
+    struct migrate_chunk *const chunk = batch->chunks + index;
+    struct migrate_job *const job = chunk->job;
+    bool const writing = chunk->got == chunk->len;
+    if (res == -EINTR || res == -EAGAIN) {
+        migrate_submit_rw(batch, index, writing);
+        return;
+    }
+    if (res < 0 || job->error) {
+        if (!job->error) {
+            job->error = -res;
+        }
+        migrate_chunk_done(batch, chunk);
+        return;
+    }
+    if (!writing) {
+        if (!res) {
+            /* Shrunk under us, whatever's there is all there is */
+            job->error = EIO;
+            migrate_chunk_done(batch, chunk);
+            return;
+        }
+        chunk->got += res;
+        migrate_submit_rw(batch, index, chunk->got == chunk->len);
+        return;
+    }
+    chunk->put += res;
+    if (chunk->put < chunk->len) {
+        migrate_submit_rw(batch, index, true);
+        return;
+    }
+    migrate_chunk_done(batch, chunk);
+}
+
+static void migrate_complete_unlink(struct migrate_batch *const batch, struct migrate_job *const job, int const res) {
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+        /* Kernel before 5.11, no async unlink */
+        batch->migrate->unlink_async = false;
+        job->item->result = unlink(job->item->path_old) < 0 ? errno : 0;
+    } else {
+        job->item->result = -res;
+    }
+    if (job->item->result) {
+        pr_error("Failed to unlink old file '%s', error: %s\n", job->item->path_old, strerror(job->item->result));
+    } else {
+        ++batch->migrate->stats.unlinks;
+    }
+    job->state = MIGRATE_JOB_FREE;
+}
+
+/* The ring broke with jobs half done, none of them counts as done, and copies are given up */
+static void migrate_batch_abort(struct migrate_batch *const batch) {
+    for (unsigned i = 0; i < MIGRATE_FILES_MAX; ++i) {
+        struct migrate_job *const job = batch->jobs + i;
+        if (job->state == MIGRATE_JOB_FREE) {
+            continue;
+        }
+        if (job->state == MIGRATE_JOB_COPYING) {
+            if (batch->migrate->writeback) {
+                atomic_fetch_sub_explicit(&batch->migrate->writeback->dirty, job->dirty, memory_order_relaxed);
+            }
+            close(job->fd_in);
+            close(job->fd_out);
+            unlink(job->item->path_new);
+        }
+        job->item->result = -1;
+        job->state = MIGRATE_JOB_FREE;
+    }
+}
+
+/* Moves or removes all items, with up to MIGRATE_FILES_MAX files and MIGRATE_CHUNKS chunks
+   in flight, results are per item, returns non-zero only if the ring itself broke */
+int migrate_batch(struct migrate *const migrate, struct migrate_item *const items, size_t const count) {
+    struct migrate_batch batch = {
+        .migrate = migrate,
+        .ops = 0
+    };
+    for (unsigned i = 0; i < MIGRATE_FILES_MAX; ++i) {
+        batch.jobs[i].state = MIGRATE_JOB_FREE;
+    }
+    for (unsigned i = 0; i < MIGRATE_CHUNKS; ++i) {
+        batch.chunks[i].job = NULL;
+    }
+    struct migrate_ring *const ring = &migrate->ring;
+    size_t item_next = 0;
+    unsigned job_next = 0;
+    while (true) {
+        for (unsigned i = 0; i < MIGRATE_FILES_MAX && item_next < count; ++i) {
+            if (batch.jobs[i].state == MIGRATE_JOB_FREE) {
+                migrate_job_start(&batch, batch.jobs + i, items + item_next++);
+            }
+        }
+        migrate_assign_chunks(&batch, &job_next);
+        if (!batch.ops) {
+            bool idle = item_next == count;
+            for (unsigned i = 0; i < MIGRATE_FILES_MAX && idle; ++i) {
+                idle = batch.jobs[i].state == MIGRATE_JOB_FREE;
+            }
+            if (idle) {
+                return 0;
+            }
+            continue;
+        }
+        if (migrate_ring_submit_and_wait(ring)) {
+            migrate_batch_abort(&batch);
+            return 1;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned const tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe const *const cqe = ring->cqes + (head & ring->cq_mask);
+            unsigned const index = cqe->user_data & UINT32_MAX;
+            int const res = cqe->res;
+            --batch.ops;
+            switch (cqe->user_data >> 32) {
+            case MIGRATE_TAG_CHUNK:
+                migrate_complete_chunk(&batch, index, res);
+                break;
+            case MIGRATE_TAG_UNLINK:
+                migrate_complete_unlink(&batch, batch.jobs + index, res);
+                break;
+            }
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+    }
+}
@@ -1,9 +1,35 @@
 #include "mux.h"
 
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 
 #include "print.h"
+#include "argsep.h"
+#include "ring.h"
+#include "segment.h"
+#include "paramsets.h"
+#include "timeline.h"
+
+#define MUX_PROBESIZE_DEFAULT 5000000 /* libavformat's own default */
+#define MUX_PREPARE_SECONDS 5 /* Open the next segment this long before the current one ends */
+#define MUX_SHED_DISPOSABLE_PRESSURE 50 /* Percent of the ring budget above which non-reference frames are shed */
+#define MUX_SHED_GOP_PRESSURE 100 /* And above which everything but keyframes is */
+#define MUX_BITRATE_SAMPLE_MIN 10 /* Segments shorter than this many seconds don't tell the bitrate */
+#define MUX_BITRATE_WEIGHT 4 /* Every segment moves the bitrate 1/4 towards its own */
+#define MUX_PREALLOCATE_HEADROOM 8 /* Preallocate 1/8 more than the bitrate predicts, the tail is trimmed anyway */
+#define MUX_WRITE_BATCH 64 /* Packets a shared writer takes from one session before moving on to the next */
+
+static size_t ring_size = 0x1000000; /* 16 MiB */
+static long stall_timeout = 10; /* In seconds, 0 to never treat a silent input as stalled */
+static atomic_uint opens_concurrent = 0;
+static atomic_uint opens_concurrent_peak = 0;
 
 #ifdef DEBUGGING
 static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, const char *tag)
@@ -21,141 +47,993 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, cons
 #define log_packet(fmt_ctx, pkg, tag)
 #endif
 
-int mux(char const *in_filename, char const *out_filename, time_t time_end) {
-    const AVOutputFormat *ofmt = NULL;
-    AVFormatContext *ifmt_ctx = NULL, *ofmt_ctx = NULL;
-    AVPacket *pkt = NULL;
-    int ret;
-    int stream_index = 0;
-    int *stream_mapping = NULL;
-    int stream_mapping_size = 0;
+static void mux_raise_max(atomic_ulong *const max, unsigned long const value) {
+    unsigned long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed));
+}
 
-    pkt = av_packet_alloc();
-    if (!pkt) {
-        pr_error("Could not allocate AVPacket\n");
+static void mux_raise_max_ms(atomic_long *const max, long const value) {
+    long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static int64_t mux_time_ms() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return (int64_t)time_now.tv_sec * 1000 + time_now.tv_nsec / 1000000;
+}
+
+unsigned mux_get_opens_concurrent_peak() {
+    return atomic_load(&opens_concurrent_peak);
+}
+
+int mux_state_init(struct mux_state *const state) {
+    memset(&state->stats, 0, sizeof state->stats);
+    state->cache.nb_streams = 0;
+    state->cache.streams = NULL;
+    state->options = NULL;
+    atomic_init(&state->time_stalled, 0);
+    state->name = NULL;
+    atomic_init(&state->bitrate, 0);
+    if (pthread_mutex_init(&state->cache.mutex, NULL)) {
+        pr_error("Failed to init mutex for stream cache\n");
         return 1;
     }
+    return 0;
+}
 
-    if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
-        pr_error("Could not open input file '%s'\n", in_filename);
-        goto remux_end;
-    }
+/* Only for a state no session ever used */
+void mux_state_free(struct mux_state *const state) {
+    av_dict_free(&state->options);
+    pthread_mutex_destroy(&state->cache.mutex);
+}
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
-        pr_error("Failed to retrieve input stream information\n");
-        goto remux_end;
+/* options in the form of key=value,key=value */
+int mux_state_parse_options(struct mux_state *const state, char const *const options) {
+    int ret;
+    if ((ret = av_dict_parse_string(&state->options, options, "=", ",", 0)) < 0) {
+        pr_error("Failed to parse input options '%s': %s\n", options, av_err2str(ret));
+        return 1;
     }
+    return 0;
+}
 
-    // av_dump_format(ifmt_ctx, 0, in_filename, 0);
-
-    avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, out_filename);
-    if (!ofmt_ctx) {
-        pr_error("Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto remux_end;
+static void mux_cache_clear(struct mux_cache *const cache) {
+    for (unsigned i = 0; i < cache->nb_streams; ++i) {
+        avcodec_parameters_free(&cache->streams[i].codecpar);
     }
+    av_freep(&cache->streams);
+    cache->nb_streams = 0;
+}
 
-    stream_mapping_size = ifmt_ctx->nb_streams;
-    stream_mapping = av_calloc(stream_mapping_size, sizeof(*stream_mapping));
-    if (!stream_mapping) {
+static int mux_cache_store(struct mux_cache *const cache, AVFormatContext const *const ifmt_ctx) {
+    int ret = 0;
+    pthread_mutex_lock(&cache->mutex);
+    mux_cache_clear(cache);
+    if (!(cache->streams = av_calloc(ifmt_ctx->nb_streams, sizeof *cache->streams))) {
         ret = AVERROR(ENOMEM);
-        goto remux_end;
+        goto store_unlock;
     }
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; ++i) {
+        AVStream const *const stream = ifmt_ctx->streams[i];
+        if (!(cache->streams[i].codecpar = avcodec_parameters_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        cache->nb_streams = i + 1;
+        if ((ret = avcodec_parameters_copy(cache->streams[i].codecpar, stream->codecpar)) < 0) {
+            break;
+        }
+        cache->streams[i].time_base = stream->time_base;
+    }
+    if (ret < 0) {
+        mux_cache_clear(cache);
+    }
+store_unlock:
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
 
-    ofmt = ofmt_ctx->oformat;
+/* Whether there's a layout to open with, an overlapping recorder of the camera could be storing one right now */
+static bool mux_cache_filled(struct mux_cache *const cache) {
+    pthread_mutex_lock(&cache->mutex);
+    bool const filled = cache->nb_streams;
+    pthread_mutex_unlock(&cache->mutex);
+    return filled;
+}
 
+/* Fills streams of a lightly probed input from the cache, returns 1 if the layout changed and a full probe is needed */
+static int mux_cache_apply(struct mux_cache *const cache, AVFormatContext *const ifmt_ctx) {
+    int ret = 0;
+    pthread_mutex_lock(&cache->mutex);
+    if (!ifmt_ctx->nb_streams || ifmt_ctx->nb_streams != cache->nb_streams) {
+        ret = 1;
+        goto apply_unlock;
+    }
     for (unsigned i = 0; i < ifmt_ctx->nb_streams; ++i) {
-        AVStream *out_stream;
-        AVStream *in_stream = ifmt_ctx->streams[i];
-        AVCodecParameters *in_codecpar = in_stream->codecpar;
+        AVStream const *const stream = ifmt_ctx->streams[i];
+        struct mux_stream_cache const *const stream_cache = cache->streams + i;
+        AVCodecParameters const *const codecpar = stream_cache->codecpar;
+        if (stream->codecpar->codec_type != codecpar->codec_type ||
+            stream->codecpar->codec_id != codecpar->codec_id ||
+            stream->time_base.num != stream_cache->time_base.num ||
+            stream->time_base.den != stream_cache->time_base.den) {
+            ret = 1;
+            goto apply_unlock;
+        }
+        /* Fresh parameter sets (e.g. from SDP) that differ mean the camera was reconfigured */
+        if (stream->codecpar->extradata_size &&
+            (stream->codecpar->extradata_size != codecpar->extradata_size ||
+             memcmp(stream->codecpar->extradata, codecpar->extradata, codecpar->extradata_size))) {
+            ret = 1;
+            goto apply_unlock;
+        }
+    }
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; ++i) {
+        if (avcodec_parameters_copy(ifmt_ctx->streams[i]->codecpar, cache->streams[i].codecpar) < 0) {
+            ret = 1;
+            break;
+        }
+    }
+apply_unlock:
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
 
+static int mux_open_input(AVFormatContext **ifmt_ctx, char const *in_filename, AVIOContext *pb, AVIOInterruptCB const *interrupt, struct mux_state *state) {
+    int ret;
+    /* Allocated by ourselves so the interrupt callback also covers connecting and probing */
+    if (!(*ifmt_ctx = avformat_alloc_context())) {
+        pr_error("Could not allocate input context\n");
+        return AVERROR(ENOMEM);
+    }
+    (*ifmt_ctx)->interrupt_callback = *interrupt;
+    if (pb) {
+        (*ifmt_ctx)->pb = pb;
+        (*ifmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    unsigned const concurrent = atomic_fetch_add(&opens_concurrent, 1) + 1;
+    unsigned peak = atomic_load(&opens_concurrent_peak);
+    while (concurrent > peak && !atomic_compare_exchange_weak(&opens_concurrent_peak, &peak, concurrent));
+    mux_raise_max(&state->stats.opens_concurrent_peak, concurrent);
+    /* With a cached layout, only probe as little as needed to open */
+    AVDictionary *options = NULL;
+    if (av_dict_copy(&options, state->options, 0) < 0) {
+        pr_error("Failed to copy input options\n");
+        atomic_fetch_sub(&opens_concurrent, 1);
+        av_dict_free(&options);
+        return AVERROR(ENOMEM);
+    }
+    bool const cached = mux_cache_filled(&state->cache);
+    if (cached) {
+        av_dict_set(&options, "probesize", "32", 0);
+        av_dict_set(&options, "analyzeduration", "0", 0);
+    }
+    ret = avformat_open_input(ifmt_ctx, in_filename, 0, &options);
+    atomic_fetch_sub(&opens_concurrent, 1);
+    for (AVDictionaryEntry const *entry = NULL; (entry = av_dict_get(options, "", entry, AV_DICT_IGNORE_SUFFIX));) {
+        pr_warn("Input option '%s' not used by any component when opening '%s'\n", entry->key, in_filename);
+    }
+    av_dict_free(&options);
+    if (ret < 0) {
+        pr_error("Could not open input file '%s'\n", in_filename);
+        return ret;
+    }
+
+    if (cached) {
+        if (!mux_cache_apply(&state->cache, *ifmt_ctx)) {
+            atomic_fetch_add_explicit(&state->stats.probe_cache_hits, 1, memory_order_relaxed);
+            return 0;
+        }
+        pr_warn("Stream layout of '%s' changed since last probe, probing fully\n", in_filename);
+        atomic_fetch_add_explicit(&state->stats.probe_cache_misses, 1, memory_order_relaxed);
+        /* Back to what the camera asked for, or libavformat's defaults */
+        AVDictionaryEntry const *entry;
+        (*ifmt_ctx)->probesize = (entry = av_dict_get(state->options, "probesize", NULL, 0)) ? strtoll(entry->value, NULL, 10) : MUX_PROBESIZE_DEFAULT;
+        (*ifmt_ctx)->max_analyze_duration = (entry = av_dict_get(state->options, "analyzeduration", NULL, 0)) ? strtoll(entry->value, NULL, 10) : 0;
+    }
+
+    if ((ret = avformat_find_stream_info(*ifmt_ctx, 0)) < 0) {
+        pr_error("Failed to retrieve input stream information\n");
+        return ret;
+    }
+    if (mux_cache_store(&state->cache, *ifmt_ctx) < 0) {
+        pr_warn("Failed to cache stream parameters of '%s', next reconnect would probe fully\n", in_filename);
+    }
+    return 0;
+}
+
+static int mux_map_streams(AVFormatContext const *ifmt_ctx, int **stream_mapping, int *stream_mapping_size) {
+    int stream_index = 0;
+    *stream_mapping_size = ifmt_ctx->nb_streams;
+    *stream_mapping = av_calloc(*stream_mapping_size, sizeof(**stream_mapping));
+    if (!*stream_mapping) {
+        return AVERROR(ENOMEM);
+    }
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; ++i) {
+        AVCodecParameters const *in_codecpar = ifmt_ctx->streams[i]->codecpar;
         if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
             in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
             in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-            stream_mapping[i] = -1;
+            (*stream_mapping)[i] = -1;
             continue;
         }
+        (*stream_mapping)[i] = stream_index++;
+    }
+    return 0;
+}
 
-        stream_mapping[i] = stream_index++;
+enum mux_interrupt {
+    MUX_INTERRUPT_NONE,
+    MUX_INTERRUPT_CANCEL,
+    MUX_INTERRUPT_DEADLINE,
+    MUX_INTERRUPT_STALL
+};
 
-        out_stream = avformat_new_stream(ofmt_ctx, NULL);
+struct mux_output {
+    AVFormatContext *ofmt_ctx;
+    struct segment segment;
+    time_t time_start; /* When it became the current segment */
+    time_t time_end;
+    char path[PATH_MAX];
+};
+
+static void mux_close_output(struct mux_output *const output) {
+    if (!output->ofmt_ctx) {
+        return;
+    }
+    /* pb is ours, avformat_free_context() leaves it alone */
+    avformat_free_context(output->ofmt_ctx);
+    output->ofmt_ctx = NULL;
+    if (segment_close(&output->segment)) {
+        pr_error("Failed to close output file '%s'\n", output->path);
+    }
+}
+
+static void mux_finish_output(struct mux_output *const output) {
+    if (!output->ofmt_ctx) {
+        return;
+    }
+    av_write_trailer(output->ofmt_ctx);
+    mux_close_output(output);
+}
+
+static int mux_open_output(struct mux_output *const output, AVFormatContext const *ifmt_ctx, int const *stream_mapping, char const *out_filename, off_t const preallocate, AVIOInterruptCB const *interrupt, char const *name, struct segment_stats *stats, atomic_bool const *cancel) {
+    int ret;
+    strncpy(output->path, out_filename, PATH_MAX - 1);
+    output->path[PATH_MAX - 1] = '\0';
+    output->segment.pb = NULL;
+    output->segment.size = 0;
+    avformat_alloc_output_context2(&output->ofmt_ctx, NULL, NULL, out_filename);
+    if (!output->ofmt_ctx) {
+        pr_error("Could not create output context\n");
+        return AVERROR_UNKNOWN;
+    }
+    output->ofmt_ctx->interrupt_callback = *interrupt;
+
+    for (unsigned i = 0; i < ifmt_ctx->nb_streams; ++i) {
+        if (stream_mapping[i] < 0) {
+            continue;
+        }
+        AVStream *out_stream = avformat_new_stream(output->ofmt_ctx, NULL);
         if (!out_stream) {
             pr_error("Failed allocating output stream\n");
             ret = AVERROR_UNKNOWN;
-            goto remux_end;
+            goto open_output_fail;
         }
 
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+        ret = avcodec_parameters_copy(out_stream->codecpar, ifmt_ctx->streams[i]->codecpar);
         if (ret < 0) {
             pr_error("Failed to copy codec parameters\n");
-            goto remux_end;
+            goto open_output_fail;
         }
         out_stream->codecpar->codec_tag = 0;
     }
-    // av_dump_format(ofmt_ctx, 0, out_filename, 1);
+    // av_dump_format(output->ofmt_ctx, 0, out_filename, 1);
 
-    if (!(ofmt->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ofmt_ctx->pb, out_filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
+    if (!(output->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (segment_open(&output->segment, out_filename, preallocate, name, stats, cancel)) {
             pr_error("Could not open output file '%s'\n", out_filename);
-            goto remux_end;
+            ret = AVERROR(EIO);
+            goto open_output_fail;
         }
+        output->ofmt_ctx->pb = output->segment.pb;
     }
 
-    ret = avformat_write_header(ofmt_ctx, NULL);
+    ret = avformat_write_header(output->ofmt_ctx, NULL);
     if (ret < 0) {
         pr_error("Error occurred when opening output file\n");
-        goto remux_end;
+        goto open_output_fail;
     }
+    return 0;
+open_output_fail:
+    mux_close_output(output);
+    return ret;
+}
 
-    while (time(NULL) < time_end) {
-        AVStream *in_stream, *out_stream;
+static int mux_write_packet(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, int const *stream_mapping, AVPacket *pkt, int64_t ts_offset) {
+    AVStream *in_stream, *out_stream;
+    int ret;
 
-        ret = av_read_frame(ifmt_ctx, pkt);
-        if (ret < 0)
-            break;
+    in_stream  = ifmt_ctx->streams[pkt->stream_index];
+    pkt->stream_index = stream_mapping[pkt->stream_index];
+    out_stream = ofmt_ctx->streams[pkt->stream_index];
+    log_packet(ifmt_ctx, pkt, "in");
+
+    if (ts_offset) {
+        int64_t const offset = av_rescale_q(ts_offset, AV_TIME_BASE_Q, in_stream->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts -= offset;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts -= offset;
+        }
+    }
+
+    /* copy packet */
+    av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
+    pkt->pos = -1;
+    log_packet(ofmt_ctx, pkt, "out");
+
+    ret = av_interleaved_write_frame(ofmt_ctx, pkt);
+    /* pkt is now blank (av_interleaved_write_frame() takes ownership of
+     * its contents and resets pkt), so that no unreferencing is necessary.
+     * This would be different if one used av_write_frame(). */
+    if (ret < 0 && ret != AVERROR(EINVAL)) {
+        pr_error("Error muxing packet\n");
+    }
+    return ret;
+}
+
+struct mux_session {
+    char const *in_filename;
+    char const *out_filename;
+    time_t time_end;
+    mux_next_segment_cb next_segment; /* NULL for a single segment ending at time_end */
+    void *arg;
+    AVIOContext *pb; /* Custom input I/O */
+    mux_wait_cb wait; /* NULL for a writer thread of its own, otherwise the shared writers take the writer stage */
+    void *wait_arg;
+    struct mux_state *state;
+    struct mux_stats *stats;
+    AVFormatContext *ifmt_ctx;
+    struct mux_output outputs[2];
+    struct mux_output *output;
+    struct mux_output *output_next; /* Opened with its header written ahead of the cut, only with next_segment */
+    bool output_next_ready;
+    bool output_next_failed; /* Don't retry every packet, the cut would open it synchronously */
+    int *stream_mapping;
+    int stream_mapping_size;
+    int cut_stream;
+    int64_t ts_offset;
+    struct timespec time_start;
+    bool first_written;
+    atomic_bool const *cancel;
+    atomic_llong time_packet; /* Monotonic ms of the last packet read, for stall detection, 0 until the input is open */
+    atomic_int interrupted; /* Why blocking I/O was interrupted, enum mux_interrupt */
+    AVIOInterruptCB interrupt;
+    bool output_fresh; /* No keyframe of cut_stream written to the current segment yet */
+    struct paramsets paramsets; /* Of cut_stream, prepended to the first keyframe of every segment */
+    struct timeline timeline; /* Normalized by the reader stage, segment ends are decided on its time */
+    struct ring ring;
+    atomic_bool reader_done;
+    atomic_bool writer_done;
+    int writer_ret;
+    bool writer_started; /* First segment opened, by the shared writers */
+    atomic_uint writer_kicks; /* Since a shared writer last looked, 0 once none has the session queued or running */
+    struct mux_session *writer_next;
+};
+
+enum mux_write_turn {
+    MUX_WRITE_IDLE, /* Nothing left, the session was released */
+    MUX_WRITE_AGAIN, /* Still packets, queue it again behind the others */
+    MUX_WRITE_DONE
+};
+
+static pthread_mutex_t writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writers_cond = PTHREAD_COND_INITIALIZER;
+static struct mux_session *writers_head = NULL;
+static struct mux_session *writers_tail = NULL;
+
+void mux_parse_stall_timeout(char const *const arg) {
+    long timeout = strtol(arg, NULL, 10);
+    stall_timeout = timeout > 0 ? timeout : 0;
+    if (stall_timeout) {
+        pr_warn("Treating inputs without packets for %ld seconds as stalled\n", stall_timeout);
+    } else {
+        pr_warn("Never treating inputs as stalled\n");
+    }
+}
 
-        in_stream  = ifmt_ctx->streams[pkt->stream_index];
-        if (pkt->stream_index >= stream_mapping_size ||
-            stream_mapping[pkt->stream_index] < 0) {
+/* Polled by libavformat during any blocking I/O, on both the reader and the writer stage */
+static int mux_session_interrupt(void *const arg) {
+    struct mux_session *const session = arg;
+    enum mux_interrupt reason = MUX_INTERRUPT_NONE;
+    if (session->cancel && atomic_load(session->cancel)) {
+        reason = MUX_INTERRUPT_CANCEL;
+    } else if (!session->next_segment && time(NULL) >= session->time_end) {
+        reason = MUX_INTERRUPT_DEADLINE;
+    } else if (stall_timeout && atomic_load(&session->time_packet) && mux_time_ms() - atomic_load(&session->time_packet) >= stall_timeout * 1000) {
+        reason = MUX_INTERRUPT_STALL;
+    } else {
+        return 0;
+    }
+    int expected = MUX_INTERRUPT_NONE;
+    atomic_compare_exchange_strong(&session->interrupted, &expected, reason);
+    return 1;
+}
+
+void mux_parse_memory_budget(char const *const arg) {
+    size_t size = parse_argument_size(arg);
+    ring_set_bytes_all_max(size);
+    if (size) {
+        pr_warn("Limited packet rings of all recorders to %zu bytes in total\n", size);
+    } else {
+        pr_warn("Not limiting packet rings of all recorders in total\n");
+    }
+}
+
+void mux_parse_ring_size(char const *const arg) {
+    size_t size = parse_argument_size(arg);
+    if (size) {
+        ring_size = size;
+    } else {
+        pr_warn("Illegal ring size '%s', keeping %zu bytes\n", arg, ring_size);
+    }
+    pr_warn("Limited packet ring of each recorder to %zu bytes\n", ring_size);
+}
+
+size_t mux_get_ring_size() {
+    return ring_size;
+}
+
+/* What a segment lasting duration seconds would take at the moving-average bitrate of the camera,
+   before any segment was finished the last one is the best guess */
+static off_t mux_session_preallocate_size(struct mux_session const *const session, time_t const duration) {
+    if (duration <= 0) {
+        return 0;
+    }
+    unsigned long const bitrate = atomic_load_explicit(&session->state->bitrate, memory_order_relaxed);
+    if (!bitrate) {
+        return session->output->ofmt_ctx ? session->output->segment.size : 0;
+    }
+    off_t const size = (off_t)bitrate * duration;
+    return size + size / MUX_PREALLOCATE_HEADROOM;
+}
+
+/* Finishes a segment and learns the bitrate from it */
+static void mux_session_finish_output(struct mux_session *const session, struct mux_output *const output) {
+    if (!output->ofmt_ctx) {
+        return;
+    }
+    mux_finish_output(output);
+    time_t const duration = time(NULL) - output->time_start;
+    if (duration < MUX_BITRATE_SAMPLE_MIN || !output->segment.size) {
+        return;
+    }
+    unsigned long const bitrate = output->segment.size / duration;
+    /* Overlapping recorders of a camera could finish segments at the same time */
+    unsigned long average = atomic_load_explicit(&session->state->bitrate, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&session->state->bitrate, &average, average ? average + ((long)bitrate - (long)average) / MUX_BITRATE_WEIGHT : bitrate, memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Opens the segment after the current one, so the cut only has to swap the contexts */
+static int mux_session_prepare(struct mux_session *const session) {
+    char const *out_filename = session->out_filename;
+    if (session->next_segment(session->arg, session->time_end, &out_filename, &session->output_next->time_end)) {
+        pr_error("Failed to get next segment for input '%s'\n", session->in_filename);
+        return AVERROR_UNKNOWN;
+    }
+    session->out_filename = out_filename;
+    int ret = mux_open_output(session->output_next, session->ifmt_ctx, session->stream_mapping, out_filename, mux_session_preallocate_size(session, session->output_next->time_end - session->time_end), &session->interrupt, session->state->name, &session->stats->segment, session->cancel);
+    if (ret < 0) {
+        return ret;
+    }
+    session->output_next_ready = true;
+    return 0;
+}
+
+/* Drops a prepared segment that never got any packet */
+static void mux_session_discard_prepared(struct mux_session *const session) {
+    if (!session->output_next_ready) {
+        return;
+    }
+    mux_close_output(session->output_next);
+    if (unlink(session->output_next->path)) {
+        pr_warn("Failed to remove unused segment '%s', errno: %d, error: %s\n", session->output_next->path, errno, strerror(errno));
+    }
+    session->output_next_ready = false;
+}
+
+static void mux_session_record_cutover(struct mux_session *const session, struct timespec const *const time_cut) {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    long const ms = (time_now.tv_sec - time_cut->tv_sec) * 1000 + (time_now.tv_nsec - time_cut->tv_nsec) / 1000000;
+    unsigned bucket = 0;
+    while (bucket < MUX_CUTOVER_BUCKETS - 1 && ms >= 1L << bucket) {
+        ++bucket;
+    }
+    atomic_fetch_add_explicit(&session->stats->cutover_histogram[bucket], 1, memory_order_relaxed);
+}
+
+/* Writes pkt to the current segment, the first keyframe gets the parameter sets in-band so
+   the segment decodes on its own no matter where in the stream it was cut */
+static int mux_session_write_output(struct mux_session *const session, AVPacket *const pkt) {
+    int ret;
+    if (session->output_fresh && pkt->stream_index == session->cut_stream && pkt->flags & AV_PKT_FLAG_KEY) {
+        bool injected;
+        if ((ret = paramsets_inject(&session->paramsets, pkt, &injected)) < 0) {
             av_packet_unref(pkt);
-            continue;
+            return ret;
+        }
+        if (injected) {
+            atomic_fetch_add_explicit(&session->stats->paramset_injections, 1, memory_order_relaxed);
         }
-        // pkt->
+        session->output_fresh = false;
+    }
+    ret = mux_write_packet(session->ifmt_ctx, session->output->ofmt_ctx, session->stream_mapping, pkt, session->ts_offset);
+    /* Timestamps the muxer still refused, the timeline should've left none */
+    if (ret == AVERROR(EINVAL)) {
+        atomic_fetch_add_explicit(&session->stats->timestamps_dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+    return ret;
+}
 
-        pkt->stream_index = stream_mapping[pkt->stream_index];
-        out_stream = ofmt_ctx->streams[pkt->stream_index];
-        log_packet(ifmt_ctx, pkt, "in");
+/* Switches to the next segment at the keyframe pkt, which is written as its first packet,
+   the old segment is only finished after that so its trailer never delays the new one */
+static int mux_session_cutover(struct mux_session *const session, AVPacket *const pkt) {
+    int ret;
+    struct timespec time_cut;
+    clock_gettime(CLOCK_MONOTONIC, &time_cut);
+    if (!session->output_next_ready) {
+        atomic_fetch_add_explicit(&session->stats->cutover_prepare_misses, 1, memory_order_relaxed);
+        if ((ret = mux_session_prepare(session)) < 0) {
+            return ret;
+        }
+    }
+    struct mux_output *const output_last = session->output;
+    session->output = session->output_next;
+    session->output_next = output_last;
+    session->output->time_start = time(NULL);
+    session->time_end = session->output->time_end;
+    session->output_next_ready = false;
+    session->output_next_failed = false;
+    session->output_fresh = true;
+    /* Every segment starts from 0, just like a fresh session */
+    AVStream const *in_stream = session->ifmt_ctx->streams[pkt->stream_index];
+    int64_t const ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    session->ts_offset = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, in_stream->time_base, AV_TIME_BASE_Q) : 0;
+    ret = mux_session_write_output(session, pkt);
+    mux_session_record_cutover(session, &time_cut);
+    mux_session_finish_output(session, output_last);
+    return ret;
+}
 
-        /* copy packet */
-        av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
-        pkt->pos = -1;
-        log_packet(ofmt_ctx, pkt, "out");
+static int mux_session_write_packet(struct mux_session *const session, AVPacket *const pkt) {
+    int ret;
+    /* Parameter sets come in front of the keyframes that need them, or as new extradata */
+    if (pkt->stream_index == session->cut_stream) {
+        size_t size_extradata;
+        uint8_t const *const extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &size_extradata);
+        if (extradata) {
+            atomic_fetch_add_explicit(&session->stats->paramset_changes, paramsets_scan(&session->paramsets, extradata, size_extradata), memory_order_relaxed);
+        }
+        if (extradata || pkt->flags & AV_PKT_FLAG_KEY) {
+            atomic_fetch_add_explicit(&session->stats->paramset_changes, paramsets_scan(&session->paramsets, pkt->data, pkt->size), memory_order_relaxed);
+        }
+    }
+    /* Only the cut stream's packets are on the wall clock, other streams could have unrelated bases */
+    if (session->next_segment && (session->cut_stream < 0 || pkt->stream_index == session->cut_stream)) {
+        time_t const time_now = timeline_wallclock(&session->timeline, pkt);
+        if (!session->output_next_ready && !session->output_next_failed &&
+            time_now >= session->time_end - MUX_PREPARE_SECONDS) {
+            if (mux_session_prepare(session) < 0) {
+                pr_warn("Failed to prepare next segment for input '%s', would retry at cut\n", session->in_filename);
+                session->output_next_failed = true;
+            }
+        }
+        if ((session->cut_stream < 0 || pkt->flags & AV_PKT_FLAG_KEY) && time_now >= session->time_end) {
+            if ((ret = mux_session_cutover(session, pkt)) < 0) {
+                av_packet_unref(pkt);
+            }
+            return ret;
+        }
+    }
+    if ((ret = mux_session_write_output(session, pkt)) < 0) {
+        return ret;
+    }
+    if (!session->first_written) {
+        struct timespec time_now;
+        clock_gettime(CLOCK_MONOTONIC, &time_now);
+        long const ms = (time_now.tv_sec - session->time_start.tv_sec) * 1000 + (time_now.tv_nsec - session->time_start.tv_nsec) / 1000000;
+        atomic_store_explicit(&session->stats->time_to_first_packet_last, ms, memory_order_relaxed);
+        mux_raise_max_ms(&session->stats->time_to_first_packet_max, ms);
+        session->first_written = true;
+        /* Only the first recorder to write after a stall takes it */
+        int64_t const time_stalled = atomic_exchange(&session->state->time_stalled, 0);
+        if (time_stalled) {
+            long const recovery = mux_time_ms() - time_stalled;
+            atomic_store_explicit(&session->stats->stall_recovery_last, recovery, memory_order_relaxed);
+            mux_raise_max_ms(&session->stats->stall_recovery_max, recovery);
+        }
+    }
+    return 0;
+}
 
-        ret = av_interleaved_write_frame(ofmt_ctx, pkt);
-        /* pkt is now blank (av_interleaved_write_frame() takes ownership of
-         * its contents and resets pkt), so that no unreferencing is necessary.
-         * This would be different if one used av_write_frame(). */
-        if (ret < 0) {
-            if (ret != AVERROR(EINVAL)) {
-                pr_error("Error muxing packet\n");
+/* Writer stage, runs in its own thread so a slow disk never stalls the socket */
+static int mux_session_write(struct mux_session *const session) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt) {
+        pr_error("Could not allocate AVPacket\n");
+        return AVERROR(ENOMEM);
+    }
+    int ret = 0;
+    while (true) {
+        ring_wait(&session->ring);
+        if (ring_pop(&session->ring, pkt)) {
+            if (atomic_load(&session->reader_done)) {
                 break;
             }
+            continue;
+        }
+        if ((ret = mux_session_write_packet(session, pkt)) < 0) {
+            break;
+        }
+    }
+    av_packet_free(&pkt);
+    return ret;
+}
+
+/* The first segment is opened by the writer too, so the reader never touches the disk */
+static int mux_session_open_first(struct mux_session *const session) {
+    int ret;
+    if (session->next_segment && session->next_segment(session->arg, time(NULL), &session->out_filename, &session->time_end)) {
+        pr_error("Failed to get first segment for input '%s'\n", session->in_filename);
+        return AVERROR_UNKNOWN;
+    }
+    if ((ret = mux_open_output(session->output, session->ifmt_ctx, session->stream_mapping, session->out_filename, mux_session_preallocate_size(session, session->time_end - time(NULL)), &session->interrupt, session->state->name, &session->stats->segment, session->cancel)) < 0) {
+        return ret;
+    }
+    session->output->time_start = time(NULL);
+    session->output->time_end = session->time_end;
+    return 0;
+}
+
+static void *mux_session_write_thread(void *arg) {
+    struct mux_session *const session = arg;
+    if ((session->writer_ret = mux_session_open_first(session)) >= 0) {
+        session->writer_ret = mux_session_write(session);
+        mux_session_finish_output(session, session->output);
+    }
+    atomic_store(&session->writer_done, true);
+    return NULL;
+}
+
+/* One turn of the writer stage on a shared writer, at most MUX_WRITE_BATCH packets so a busy session
+   can't hold it up for the others */
+static enum mux_write_turn mux_session_write_some(struct mux_session *const session, AVPacket *const pkt) {
+    int ret = 0;
+    if (atomic_load(&session->writer_done)) {
+        return MUX_WRITE_DONE;
+    }
+    if (!session->writer_started) {
+        session->writer_started = true;
+        if ((ret = mux_session_open_first(session)) < 0) {
+            goto write_done;
+        }
+    }
+    for (unsigned i = 0; i < MUX_WRITE_BATCH; ++i) {
+        /* Loaded before looking at the ring, so a kick after a packet we missed fails the release below */
+        unsigned kicks = atomic_load(&session->writer_kicks);
+        if (ring_try_wait(&session->ring)) {
+            if (atomic_compare_exchange_strong(&session->writer_kicks, &kicks, 0)) {
+                return MUX_WRITE_IDLE; /* Another writer could have it already, not to be touched any more */
+            }
+            continue;
+        }
+        if (ring_pop(&session->ring, pkt)) {
+            if (atomic_load(&session->reader_done)) {
+                goto write_finish;
+            }
+            continue;
+        }
+        if ((ret = mux_session_write_packet(session, pkt)) < 0) {
+            goto write_finish;
+        }
+    }
+    /* Still ours, any kick since is covered by the next turn, and the count can't wrap to 0 */
+    atomic_store(&session->writer_kicks, 1);
+    return MUX_WRITE_AGAIN;
+write_finish:
+    mux_session_finish_output(session, session->output);
+write_done:
+    session->writer_ret = ret;
+    atomic_store(&session->writer_done, true);
+    return MUX_WRITE_DONE;
+}
+
+static void mux_writers_queue(struct mux_session *const session) {
+    session->writer_next = NULL;
+    pthread_mutex_lock(&writers_mutex);
+    if (writers_tail) {
+        writers_tail->writer_next = session;
+    } else {
+        writers_head = session;
+    }
+    writers_tail = session;
+    pthread_cond_signal(&writers_cond);
+    pthread_mutex_unlock(&writers_mutex);
+}
+
+/* Queues the session on the shared writers, unless one of them has it already */
+static void mux_session_kick(struct mux_session *const session) {
+    if (!atomic_fetch_add(&session->writer_kicks, 1)) {
+        mux_writers_queue(session);
+    }
+}
+
+static void *mux_writer_thread(void *arg) {
+    AVPacket *const pkt = arg;
+    while (true) {
+        pthread_mutex_lock(&writers_mutex);
+        while (!writers_head) {
+            pthread_cond_wait(&writers_cond, &writers_mutex);
+        }
+        struct mux_session *const session = writers_head;
+        if (!(writers_head = session->writer_next)) {
+            writers_tail = NULL;
+        }
+        pthread_mutex_unlock(&writers_mutex);
+        switch (mux_session_write_some(session, pkt)) {
+        case MUX_WRITE_AGAIN:
+            mux_writers_queue(session);
+            break;
+        case MUX_WRITE_DONE:
+            /* The last touch, the reader could return and take the session with it right after */
+            atomic_store(&session->writer_kicks, 0);
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Writers shared by all sessions with a wait callback, a slow disk only holds up the one it's on */
+int mux_writers_start(unsigned const count) {
+    for (unsigned i = 0; i < count; ++i) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt) {
+            pr_error("Could not allocate AVPacket for writer %u\n", i);
+            return 1;
         }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, mux_writer_thread, pkt)) {
+            pr_error("Failed to create thread for writer %u\n", i);
+            av_packet_free(&pkt);
+            return 2;
+        }
+        pthread_detach(thread);
     }
+    return 0;
+}
+
+/* Reader stage, never blocks on the writer: when the ring is full the packet is dropped,
+   and the video stream is dropped until its next keyframe so the output stays decodable */
+static int mux_session_read(struct mux_session *const session) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt) {
+        pr_error("Could not allocate AVPacket\n");
+        return AVERROR(ENOMEM);
+    }
+    struct mux_stats *const stats = session->stats;
+    bool skip_to_key = false;
+    int ret = 0;
+    while (!atomic_load(&session->writer_done)) {
+        ret = av_read_frame(session->ifmt_ctx, pkt);
+        if (ret < 0)
+            break;
+        atomic_store(&session->time_packet, mux_time_ms());
 
-    av_write_trailer(ofmt_ctx);
-remux_end:
+        if (pkt->stream_index >= session->stream_mapping_size ||
+            session->stream_mapping[pkt->stream_index] < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
+            atomic_fetch_add_explicit(&stats->packets_corrupt, 1, memory_order_relaxed);
+        }
+        if (pkt->flags & AV_PKT_FLAG_DISCARD) {
+            atomic_fetch_add_explicit(&stats->packets_discarded, 1, memory_order_relaxed);
+        }
+        bool const check_drift = session->cut_stream < 0 || (pkt->stream_index == session->cut_stream && pkt->flags & AV_PKT_FLAG_KEY);
+        switch (timeline_normalize(&session->timeline, pkt, check_drift)) {
+        case TIMELINE_REPAIRED:
+            atomic_fetch_add_explicit(&stats->timestamps_repaired, 1, memory_order_relaxed);
+            break;
+        case TIMELINE_JUMPED:
+            atomic_fetch_add_explicit(&stats->timestamps_jumped, 1, memory_order_relaxed);
+            break;
+        case TIMELINE_DROPPED:
+            atomic_fetch_add_explicit(&stats->timestamps_dropped, 1, memory_order_relaxed);
+            av_packet_unref(pkt);
+            continue;
+        default:
+            break;
+        }
+        /* Single segment ends by the cut stream's packet time, the interrupt callback covers a silent input */
+        if (!session->next_segment && (session->cut_stream < 0 || pkt->stream_index == session->cut_stream) &&
+            timeline_wallclock(&session->timeline, pkt) >= session->time_end) {
+            av_packet_unref(pkt);
+            break;
+        }
+
+        /* Shed the least useful video first when the writer falls behind, keyframes are kept as long as there's room */
+        bool const is_cut_stream = pkt->stream_index == session->cut_stream;
+        bool const is_key = pkt->flags & AV_PKT_FLAG_KEY;
+        if (is_cut_stream) {
+            if (is_key) {
+                skip_to_key = false;
+            } else if (skip_to_key) {
+                atomic_fetch_add_explicit(&stats->shed_gop_packets, 1, memory_order_relaxed);
+                av_packet_unref(pkt);
+                continue;
+            } else {
+                unsigned const pressure = ring_pressure(&session->ring);
+                if (pressure >= MUX_SHED_GOP_PRESSURE) {
+                    atomic_fetch_add_explicit(&stats->shed_gops, 1, memory_order_relaxed);
+                    atomic_fetch_add_explicit(&stats->shed_gop_packets, 1, memory_order_relaxed);
+                    skip_to_key = true;
+                    av_packet_unref(pkt);
+                    continue;
+                }
+                if (pressure >= MUX_SHED_DISPOSABLE_PRESSURE &&
+                    (pkt->flags & AV_PKT_FLAG_DISPOSABLE || paramsets_disposable(&session->paramsets, pkt->data, pkt->size))) {
+                    atomic_fetch_add_explicit(&stats->shed_disposable_packets, 1, memory_order_relaxed);
+                    av_packet_unref(pkt);
+                    continue;
+                }
+            }
+        }
+        if (ring_push(&session->ring, pkt, is_cut_stream && is_key)) {
+            atomic_fetch_add_explicit(&stats->ring_dropped_packets, 1, memory_order_relaxed);
+            if (is_cut_stream) {
+                skip_to_key = true;
+            }
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (session->wait) {
+            mux_session_kick(session);
+        }
+        mux_raise_max(&stats->ring_high_water_bytes, ring_bytes(&session->ring));
+        mux_raise_max(&stats->ring_high_water_packets, ring_count(&session->ring));
+    }
     av_packet_free(&pkt);
+    return ret;
+}
+
+static int mux_session_run(struct mux_session *const session) {
+    int ret;
+    pthread_t writer_thread;
 
-    avformat_close_input(&ifmt_ctx);
+    session->ifmt_ctx = NULL;
+    session->output = session->outputs;
+    session->output_next = session->outputs + 1;
+    session->output->ofmt_ctx = NULL;
+    session->output_next->ofmt_ctx = NULL;
+    session->output_next_ready = false;
+    session->output_next_failed = false;
+    session->stream_mapping = NULL;
+    session->stream_mapping_size = 0;
+    session->cut_stream = -1;
+    session->ts_offset = 0;
+    session->first_written = false;
+    atomic_init(&session->time_packet, 0);
+    atomic_init(&session->interrupted, MUX_INTERRUPT_NONE);
+    session->interrupt.callback = mux_session_interrupt;
+    session->interrupt.opaque = session;
+    session->output_fresh = true;
+    memset(&session->paramsets, 0, sizeof session->paramsets);
+    session->timeline.streams = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &session->time_start);
+    session->writer_ret = 0;
+    atomic_init(&session->reader_done, false);
+    atomic_init(&session->writer_done, false);
+    session->writer_started = false;
+    atomic_init(&session->writer_kicks, 0);
+
+    if ((ret = mux_open_input(&session->ifmt_ctx, session->in_filename, session->pb, &session->interrupt, session->state)) < 0) {
+        goto session_end;
+    }
+    /* Only armed now, the handshake and probing could take longer than the stall timeout */
+    atomic_store(&session->time_packet, mux_time_ms());
+
+    // av_dump_format(session->ifmt_ctx, 0, session->in_filename, 0);
+
+    if ((ret = mux_map_streams(session->ifmt_ctx, &session->stream_mapping, &session->stream_mapping_size)) < 0) {
+        goto session_end;
+    }
+
+    /* Segments are only cut on keyframes of the first video stream, or on any packet if there's none */
+    for (unsigned i = 0; i < session->ifmt_ctx->nb_streams; ++i) {
+        if (session->stream_mapping[i] >= 0 && session->ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            session->cut_stream = i;
+            break;
+        }
+    }
+
+    if (timeline_init(&session->timeline, session->ifmt_ctx, session->cut_stream)) {
+        ret = AVERROR(ENOMEM);
+        goto session_end;
+    }
+
+    if (session->cut_stream >= 0) {
+        paramsets_init(&session->paramsets, session->ifmt_ctx->streams[session->cut_stream]->codecpar);
+    }
+
+    if (ring_init(&session->ring, ring_size)) {
+        pr_error("Failed to init packet ring for input '%s'\n", session->in_filename);
+        ret = AVERROR(ENOMEM);
+        goto session_end;
+    }
+
+    if (session->wait) {
+        mux_session_kick(session);
+    } else if (pthread_create(&writer_thread, NULL, mux_session_write_thread, session)) {
+        pr_error("Failed to create writer thread for input '%s'\n", session->in_filename);
+        ring_free(&session->ring);
+        ret = AVERROR_UNKNOWN;
+        goto session_end;
+    }
+
+    ret = mux_session_read(session);
+
+    atomic_store(&session->reader_done, true);
+    ring_wake(&session->ring);
+    if (session->wait) {
+        mux_session_kick(session);
+        /* Not only done, but also let go by the writer that was last on it */
+        while (!atomic_load(&session->writer_done) || atomic_load(&session->writer_kicks)) {
+            session->wait(session->wait_arg);
+        }
+    } else {
+        pthread_join(writer_thread, NULL);
+    }
+    ring_free(&session->ring);
+
+    if (session->writer_ret < 0) {
+        ret = session->writer_ret;
+    }
+session_end:
+    avformat_close_input(&session->ifmt_ctx);
 
     /* close output */
-    if (ofmt_ctx && !(ofmt->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
+    mux_close_output(session->output);
+    mux_session_discard_prepared(session);
+
+    av_freep(&session->stream_mapping);
 
-    av_freep(&stream_mapping);
+    paramsets_free(&session->paramsets);
+
+    timeline_free(&session->timeline);
+
+    switch (atomic_load(&session->interrupted)) {
+    case MUX_INTERRUPT_CANCEL:
+        pr_warn("Recording from '%s' cancelled\n", session->in_filename);
+        return 0;
+    case MUX_INTERRUPT_DEADLINE:
+        pr_warn("Recording from '%s' interrupted at its end time\n", session->in_filename);
+        return 0;
+    case MUX_INTERRUPT_STALL:
+        pr_error("No packet from '%s' for %ld seconds, reconnecting\n", session->in_filename, stall_timeout);
+        atomic_fetch_add_explicit(&session->stats->stalls, 1, memory_order_relaxed);
+        atomic_store(&session->state->time_stalled, atomic_load(&session->time_packet) + stall_timeout * 1000);
+        return 1;
+    default:
+        break;
+    }
 
     if (ret < 0 && ret != AVERROR_EOF) {
         pr_error("Error occurred: %s\n", av_err2str(ret));
@@ -165,4 +1043,53 @@ remux_end:
     return 0;
 }
 
+int mux(char const *in_filename, char const *out_filename, time_t time_end, struct mux_state *state, atomic_bool const *cancel) {
+    struct mux_session session = {
+        .in_filename = in_filename,
+        .out_filename = out_filename,
+        .time_end = time_end,
+        .next_segment = NULL,
+        .arg = NULL,
+        .pb = NULL,
+        .wait = NULL,
+        .wait_arg = NULL,
+        .state = state,
+        .stats = &state->stats,
+        .cancel = cancel
+    };
+    return mux_session_run(&session);
+}
+
+int mux_persistent(char const *in_filename, mux_next_segment_cb next_segment, void *arg, struct mux_state *state, atomic_bool const *cancel) {
+    struct mux_session session = {
+        .in_filename = in_filename,
+        .out_filename = NULL,
+        .time_end = 0,
+        .next_segment = next_segment,
+        .arg = arg,
+        .pb = NULL,
+        .wait = NULL,
+        .wait_arg = NULL,
+        .state = state,
+        .stats = &state->stats,
+        .cancel = cancel
+    };
+    return mux_session_run(&session);
+}
 
+int mux_persistent_io(char const *in_filename, AVIOContext *pb, mux_next_segment_cb next_segment, void *arg, struct mux_state *state, mux_wait_cb wait, void *wait_arg) {
+    struct mux_session session = {
+        .in_filename = in_filename,
+        .out_filename = NULL,
+        .time_end = 0,
+        .next_segment = next_segment,
+        .arg = arg,
+        .pb = pb,
+        .wait = wait,
+        .wait_arg = wait_arg,
+        .state = state,
+        .stats = &state->stats,
+        .cancel = NULL
+    };
+    return mux_session_run(&session);
+}
@@ -0,0 +1,334 @@
+#include "paramsets.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <libavutil/mem.h>
+
+#include "print.h"
+
+static uint8_t const paramsets_start_code[] = {0, 0, 0, 1};
+
+static uint8_t const *paramsets_find_start(uint8_t const *data, uint8_t const *const end) {
+    for (; data + 3 <= end; ++data) {
+        if (!data[0] && !data[1] && data[2] == 1) {
+            return data;
+        }
+    }
+    return end;
+}
+
+static int paramsets_kind(enum AVCodecID const codec_id, uint8_t const header) {
+    if (codec_id == AV_CODEC_ID_H264) {
+        switch (header & 0x1f) {
+        case 7: return 1;
+        case 8: return 2;
+        }
+    } else {
+        switch ((header >> 1) & 0x3f) {
+        case 32: return 0;
+        case 33: return 1;
+        case 34: return 2;
+        }
+    }
+    return -1;
+}
+
+/* Reads the fields before an id from a NAL with its emulation prevention bytes already taken out */
+struct paramsets_bits {
+    uint8_t const *data;
+    unsigned size; /* In bits */
+    unsigned offset;
+};
+
+static bool paramsets_bits_skip(struct paramsets_bits *const bits, unsigned const count) {
+    if (bits->offset + count > bits->size) {
+        return false;
+    }
+    bits->offset += count;
+    return true;
+}
+
+static bool paramsets_bits_read(struct paramsets_bits *const bits, unsigned const count, unsigned *const value) {
+    if (bits->offset + count > bits->size) {
+        return false;
+    }
+    *value = 0;
+    for (unsigned i = 0; i < count; ++i, ++bits->offset) {
+        *value = *value << 1 | (bits->data[bits->offset >> 3] >> (7 - (bits->offset & 7)) & 1);
+    }
+    return true;
+}
+
+/* Exp-Golomb ue(v) */
+static bool paramsets_bits_read_ue(struct paramsets_bits *const bits, unsigned *const value) {
+    unsigned zeros = 0;
+    unsigned bit;
+    while (true) {
+        if (!paramsets_bits_read(bits, 1, &bit)) {
+            return false;
+        }
+        if (bit) {
+            break;
+        }
+        if (++zeros > 31) {
+            return false;
+        }
+    }
+    if (!paramsets_bits_read(bits, zeros, value)) {
+        return false;
+    }
+    *value += (1U << zeros) - 1;
+    return true;
+}
+
+/* H.265 profile_tier_level() of an SPS, only to get past it */
+static bool paramsets_skip_profile_tier_level(struct paramsets_bits *const bits, unsigned const sub_layers) {
+    unsigned present[8];
+    if (!paramsets_bits_skip(bits, 96)) { /* General profile, tier and level */
+        return false;
+    }
+    for (unsigned i = 0; i < sub_layers; ++i) {
+        if (!paramsets_bits_read(bits, 2, present + i)) {
+            return false;
+        }
+    }
+    if (sub_layers && !paramsets_bits_skip(bits, 2 * (8 - sub_layers))) {
+        return false;
+    }
+    for (unsigned i = 0; i < sub_layers; ++i) {
+        if (!paramsets_bits_skip(bits, (present[i] & 2 ? 88 : 0) + (present[i] & 1 ? 8 : 0))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns the id of a parameter set NAL, or -1 if it's cut too short to tell */
+static int paramsets_id(enum AVCodecID const codec_id, int const kind, uint8_t const *const nal, int const size) {
+    uint8_t rbsp[PARAMSETS_PARSE_MAX];
+    unsigned len = 0;
+    unsigned zeros = 0;
+    for (int i = 0; i < size && len < sizeof rbsp; ++i) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] ? 0 : zeros + 1;
+        rbsp[len++] = nal[i];
+    }
+    struct paramsets_bits bits = {
+        .data = rbsp,
+        .size = len * 8,
+        .offset = 0
+    };
+    unsigned id;
+    unsigned sub_layers;
+    if (codec_id == AV_CODEC_ID_H264) {
+        /* An SPS has profile, constraints and level before its id */
+        if (!paramsets_bits_skip(&bits, kind == 1 ? 32 : 8) || !paramsets_bits_read_ue(&bits, &id)) {
+            return -1;
+        }
+    } else {
+        if (!paramsets_bits_skip(&bits, 16)) {
+            return -1;
+        }
+        switch (kind) {
+        case 0:
+            if (!paramsets_bits_read(&bits, 4, &id)) {
+                return -1;
+            }
+            break;
+        case 1:
+            if (!paramsets_bits_skip(&bits, 4) || !paramsets_bits_read(&bits, 3, &sub_layers) || !paramsets_bits_skip(&bits, 1) ||
+                !paramsets_skip_profile_tier_level(&bits, sub_layers) || !paramsets_bits_read_ue(&bits, &id)) {
+                return -1;
+            }
+            break;
+        default:
+            if (!paramsets_bits_read_ue(&bits, &id)) {
+                return -1;
+            }
+            break;
+        }
+    }
+    return id < PARAMSETS_IDS_MAX ? (int)id : -1;
+}
+
+/* Calls back for every parameter set NAL in data whose id could be read, stops early if the callback returns non-zero */
+static void paramsets_foreach(enum AVCodecID const codec_id, uint8_t const *const data, int const size, int (*const cb)(void *arg, int kind, unsigned id, uint8_t const *nal, int size), void *const arg) {
+    uint8_t const *const end = data + size;
+    uint8_t const *start = paramsets_find_start(data, end);
+    while (start < end) {
+        uint8_t const *const nal = start + 3;
+        start = paramsets_find_start(nal, end);
+        uint8_t const *nal_end = start;
+        while (nal_end > nal && !nal_end[-1]) { /* Leading zero of a 4-byte start code, or trailing zeros */
+            --nal_end;
+        }
+        if (nal_end == nal) {
+            continue;
+        }
+        int const kind = paramsets_kind(codec_id, nal[0]);
+        if (kind < 0) {
+            continue;
+        }
+        int const id = paramsets_id(codec_id, kind, nal, nal_end - nal);
+        if (id >= 0 && cb(arg, kind, id, nal, nal_end - nal)) {
+            return;
+        }
+    }
+}
+
+struct paramsets_scan_arg {
+    struct paramsets *paramsets;
+    unsigned changes;
+};
+
+static int paramsets_store(void *const arg, int const kind, unsigned const id, uint8_t const *const nal, int const size) {
+    struct paramsets_scan_arg *const scan = arg;
+    struct paramsets *const paramsets = scan->paramsets;
+    unsigned i = 0;
+    while (i < paramsets->counts[kind] && paramsets->sets[kind][i].id < id) {
+        ++i;
+    }
+    struct paramset *set = paramsets->sets[kind] + i;
+    if (i < paramsets->counts[kind] && set->id == id) {
+        if (set->size == size && !memcmp(set->data, nal, size)) {
+            return 0;
+        }
+        ++scan->changes;
+    } else {
+        struct paramset *const sets = av_realloc_array(paramsets->sets[kind], paramsets->counts[kind] + 1, sizeof *sets);
+        if (!sets) {
+            pr_error("Failed to allocate memory for parameter sets\n");
+            return 1;
+        }
+        paramsets->sets[kind] = sets;
+        set = sets + i;
+        memmove(set + 1, set, sizeof *set * (paramsets->counts[kind]++ - i));
+        set->id = id;
+        set->data = NULL;
+        set->size = 0;
+    }
+    uint8_t *const data = av_realloc(set->data, size);
+    if (!data) {
+        pr_error("Failed to allocate memory for parameter set\n");
+        return 1;
+    }
+    memcpy(data, nal, size);
+    set->data = data;
+    set->size = size;
+    return 0;
+}
+
+void paramsets_init(struct paramsets *const paramsets, AVCodecParameters const *const codecpar) {
+    memset(paramsets, 0, sizeof *paramsets);
+    paramsets->codec_id = AV_CODEC_ID_NONE;
+    if (codecpar->codec_id != AV_CODEC_ID_H264 && codecpar->codec_id != AV_CODEC_ID_HEVC) {
+        return;
+    }
+    /* avcC/hvcC extradata (starting with version 1) means length-prefixed packets, which we don't parse */
+    if (codecpar->extradata_size && codecpar->extradata[0] == 1) {
+        return;
+    }
+    paramsets->codec_id = codecpar->codec_id;
+    paramsets_scan(paramsets, codecpar->extradata, codecpar->extradata_size);
+}
+
+void paramsets_free(struct paramsets *const paramsets) {
+    for (unsigned kind = 0; kind < PARAMSETS_KINDS; ++kind) {
+        for (unsigned i = 0; i < paramsets->counts[kind]; ++i) {
+            av_freep(&paramsets->sets[kind][i].data);
+        }
+        av_freep(&paramsets->sets[kind]);
+        paramsets->counts[kind] = 0;
+    }
+}
+
+/* Caches the parameter sets found in data, returns how many of them replaced a different one of the same id */
+unsigned paramsets_scan(struct paramsets *const paramsets, uint8_t const *const data, int const size) {
+    struct paramsets_scan_arg scan = {
+        .paramsets = paramsets,
+        .changes = 0
+    };
+    if (paramsets->codec_id != AV_CODEC_ID_NONE && data) {
+        paramsets_foreach(paramsets->codec_id, data, size, paramsets_store, &scan);
+    }
+    return scan.changes;
+}
+
+static int paramsets_mark(void *const arg, int const kind, unsigned const id, uint8_t const *const nal, int const size) {
+    (void)nal;
+    (void)size;
+    uint8_t (*const present)[PARAMSETS_IDS_MAX / 8] = arg;
+    present[kind][id >> 3] |= 1U << (id & 7);
+    return 0;
+}
+
+/* Prepends all cached parameter sets to pkt, unless it already carries every one of them */
+int paramsets_inject(struct paramsets const *const paramsets, AVPacket *const pkt, bool *const injected) {
+    *injected = false;
+    if (paramsets->codec_id == AV_CODEC_ID_NONE) {
+        return 0;
+    }
+    uint8_t present[PARAMSETS_KINDS][PARAMSETS_IDS_MAX / 8] = {0};
+    paramsets_foreach(paramsets->codec_id, pkt->data, pkt->size, paramsets_mark, present);
+    bool missing = false;
+    int size = 0;
+    for (unsigned kind = 0; kind < PARAMSETS_KINDS; ++kind) {
+        for (unsigned i = 0; i < paramsets->counts[kind]; ++i) {
+            struct paramset const *const set = paramsets->sets[kind] + i;
+            missing |= !(present[kind][set->id >> 3] & 1U << (set->id & 7));
+            size += sizeof paramsets_start_code + set->size;
+        }
+    }
+    if (!missing) {
+        return 0;
+    }
+    AVBufferRef *const buf = av_buffer_alloc(size + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        pr_error("Failed to allocate packet buffer for parameter sets\n");
+        return AVERROR(ENOMEM);
+    }
+    uint8_t *data = buf->data;
+    for (unsigned kind = 0; kind < PARAMSETS_KINDS; ++kind) {
+        for (unsigned i = 0; i < paramsets->counts[kind]; ++i) {
+            struct paramset const *const set = paramsets->sets[kind] + i;
+            memcpy(data, paramsets_start_code, sizeof paramsets_start_code);
+            data += sizeof paramsets_start_code;
+            memcpy(data, set->data, set->size);
+            data += set->size;
+        }
+    }
+    memcpy(data, pkt->data, pkt->size);
+    memset(data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size += size;
+    *injected = true;
+    return 0;
+}
+
+/* Whether the first slice in data is one no other frame references, so it could be dropped alone */
+bool paramsets_disposable(struct paramsets const *const paramsets, uint8_t const *const data, int const size) {
+    if (paramsets->codec_id == AV_CODEC_ID_NONE) {
+        return false;
+    }
+    uint8_t const *const end = data + size;
+    for (uint8_t const *start = paramsets_find_start(data, end); start + 3 < end; start = paramsets_find_start(start + 3, end)) {
+        uint8_t const header = start[3];
+        if (paramsets->codec_id == AV_CODEC_ID_H264) {
+            unsigned const type = header & 0x1f;
+            if (type >= 1 && type <= 5) {
+                return !(header & 0x60); /* nal_ref_idc */
+            }
+        } else {
+            unsigned const type = (header >> 1) & 0x3f;
+            if (type < 32) {
+                return type <= 14 && !(type & 1); /* TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and reserved ones */
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,196 @@
+#include "pattern.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "print.h"
+
+static int pattern_push(struct pattern *const pattern, enum pattern_token_type const type, char const literal) {
+    if (pattern->count == PATTERN_TOKENS_MAX) {
+        return 1;
+    }
+    pattern->tokens[pattern->count].type = type;
+    pattern->tokens[pattern->count++].literal = literal;
+    return 0;
+}
+
+static int pattern_push_literals(struct pattern *const pattern, char const *literals) {
+    for (; *literals; ++literals) {
+        if (pattern_push(pattern, PATTERN_TOKEN_LITERAL, *literals)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the tokens pin down a start time at all, at least to the hour, otherwise files
+   of different days would be taken for the same time */
+static bool pattern_complete(struct pattern const *const pattern) {
+    unsigned seen = 0;
+    for (unsigned short i = 0; i < pattern->count; ++i) {
+        seen |= 1U << pattern->tokens[i].type;
+    }
+    if (seen & 1U << PATTERN_TOKEN_EPOCH) {
+        return true;
+    }
+    return seen & (1U << PATTERN_TOKEN_YEAR | 1U << PATTERN_TOKEN_YEAR_SHORT) &&
+        seen & 1U << PATTERN_TOKEN_MONTH && seen & 1U << PATTERN_TOKEN_DAY && seen & 1U << PATTERN_TOKEN_HOUR;
+}
+
+/* Only conversions with fixed-width numbers are understood, anything locale-dependent is not,
+   returns non-zero if the format can't be parsed back, or not into a full start time */
+int pattern_compile(struct pattern *const pattern, char const *const format, char const *const suffix) {
+    pattern->count = 0;
+    int r = 0;
+    for (char const *c = format; *c && !r; ++c) {
+        if (*c != '%') {
+            r = pattern_push(pattern, PATTERN_TOKEN_LITERAL, *c);
+            continue;
+        }
+        switch (*++c) {
+        case '%':
+            r = pattern_push(pattern, PATTERN_TOKEN_LITERAL, '%');
+            break;
+        case 'Y':
+            r = pattern_push(pattern, PATTERN_TOKEN_YEAR, 0);
+            break;
+        case 'y':
+            r = pattern_push(pattern, PATTERN_TOKEN_YEAR_SHORT, 0);
+            break;
+        case 'm':
+            r = pattern_push(pattern, PATTERN_TOKEN_MONTH, 0);
+            break;
+        case 'd':
+            r = pattern_push(pattern, PATTERN_TOKEN_DAY, 0);
+            break;
+        case 'H':
+            r = pattern_push(pattern, PATTERN_TOKEN_HOUR, 0);
+            break;
+        case 'M':
+            r = pattern_push(pattern, PATTERN_TOKEN_MINUTE, 0);
+            break;
+        case 'S':
+            r = pattern_push(pattern, PATTERN_TOKEN_SECOND, 0);
+            break;
+        case 's':
+            r = pattern_push(pattern, PATTERN_TOKEN_EPOCH, 0);
+            break;
+        case 'F':
+            r = pattern_push(pattern, PATTERN_TOKEN_YEAR, 0) || pattern_push(pattern, PATTERN_TOKEN_LITERAL, '-') ||
+                pattern_push(pattern, PATTERN_TOKEN_MONTH, 0) || pattern_push(pattern, PATTERN_TOKEN_LITERAL, '-') ||
+                pattern_push(pattern, PATTERN_TOKEN_DAY, 0);
+            break;
+        case 'T':
+            r = pattern_push(pattern, PATTERN_TOKEN_HOUR, 0) || pattern_push(pattern, PATTERN_TOKEN_LITERAL, ':') ||
+                pattern_push(pattern, PATTERN_TOKEN_MINUTE, 0) || pattern_push(pattern, PATTERN_TOKEN_LITERAL, ':') ||
+                pattern_push(pattern, PATTERN_TOKEN_SECOND, 0);
+            break;
+        default:
+            pr_warn("Conversion '%%%c' in strftime '%s' can't be parsed back from names\n", *c ? *c : ' ', format);
+            return 1;
+        }
+    }
+    if (r || pattern_push_literals(pattern, suffix)) {
+        pr_warn("strftime '%s' has too many conversions to be parsed back from names\n", format);
+        return 2;
+    }
+    if (!pattern_complete(pattern)) {
+        pr_warn("strftime '%s' has neither '%%s' nor year, month, day and hour, names don't tell the start time\n", format);
+        return 3;
+    }
+    return 0;
+}
+
+static bool pattern_digits(char const **const name, unsigned const width, long *const value) {
+    *value = 0;
+    for (unsigned i = 0; i < width; ++i) {
+        char const c = (*name)[i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        *value = *value * 10 + c - '0';
+    }
+    *name += width;
+    return true;
+}
+
+/* name is the path relative to the storage, without the leading '/', returns 0 and the local time
+   it encodes if it's fully matched */
+int pattern_match(struct pattern const *const pattern, char const *name, time_t *const time) {
+    struct tm tms = {
+        .tm_mday = 1,
+        .tm_isdst = -1
+    };
+    long value;
+    bool epoch = false;
+    for (unsigned short i = 0; i < pattern->count; ++i) {
+        struct pattern_token const *const token = pattern->tokens + i;
+        switch (token->type) {
+        case PATTERN_TOKEN_LITERAL:
+            if (*name++ != token->literal) {
+                return 1;
+            }
+            break;
+        case PATTERN_TOKEN_YEAR:
+            if (!pattern_digits(&name, 4, &value)) {
+                return 1;
+            }
+            tms.tm_year = value - 1900;
+            break;
+        case PATTERN_TOKEN_YEAR_SHORT:
+            if (!pattern_digits(&name, 2, &value)) {
+                return 1;
+            }
+            /* Same pivot as strptime() */
+            tms.tm_year = value < 69 ? value + 100 : value;
+            break;
+        case PATTERN_TOKEN_MONTH:
+            if (!pattern_digits(&name, 2, &value) || value < 1 || value > 12) {
+                return 1;
+            }
+            tms.tm_mon = value - 1;
+            break;
+        case PATTERN_TOKEN_DAY:
+            if (!pattern_digits(&name, 2, &value) || value < 1 || value > 31) {
+                return 1;
+            }
+            tms.tm_mday = value;
+            break;
+        case PATTERN_TOKEN_HOUR:
+            if (!pattern_digits(&name, 2, &value) || value > 23) {
+                return 1;
+            }
+            tms.tm_hour = value;
+            break;
+        case PATTERN_TOKEN_MINUTE:
+            if (!pattern_digits(&name, 2, &value) || value > 59) {
+                return 1;
+            }
+            tms.tm_min = value;
+            break;
+        case PATTERN_TOKEN_SECOND:
+            if (!pattern_digits(&name, 2, &value) || value > 60) {
+                return 1;
+            }
+            tms.tm_sec = value;
+            break;
+        case PATTERN_TOKEN_EPOCH:
+            if (*name < '0' || *name > '9') {
+                return 1;
+            }
+            for (value = 0; *name >= '0' && *name <= '9'; ++name) {
+                value = value * 10 + *name - '0';
+            }
+            *time = value;
+            epoch = true;
+            break;
+        }
+    }
+    if (*name) {
+        return 1;
+    }
+    if (!epoch && (*time = mktime(&tms)) == (time_t)-1) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include "records.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "print.h"
+
+#define RECORDS_ALLOC_INITIAL 0x400
+#define RECORDS_SLOT_EMPTY SIZE_MAX
+
+int records_init(struct records *const records) {
+    records->heap = NULL;
+    records->count = 0;
+    records->alloc = 0;
+    records->slots = NULL;
+    records->slots_alloc = 0;
+    if (pthread_mutex_init(&records->mutex, NULL)) {
+        pr_error("Failed to init mutex for records\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* FNV-1a */
+static size_t records_hash(char const *subpath) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *subpath; ++subpath) {
+        hash ^= (unsigned char)*subpath;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* heap[i] is where it is now, keep its slot pointing at it */
+static inline void records_place(struct records *const records, size_t const i) {
+    records->slots[records->heap[i].slot] = i;
+}
+
+static void records_sift_up(struct records *const records, size_t i) {
+    struct record *const heap = records->heap;
+    struct record const record = heap[i];
+    while (i) {
+        size_t const parent = (i - 1) / 2;
+        if (heap[parent].mtime <= record.mtime) {
+            break;
+        }
+        heap[i] = heap[parent];
+        records_place(records, i);
+        i = parent;
+    }
+    heap[i] = record;
+    records_place(records, i);
+}
+
+static void records_sift_down(struct records *const records, size_t i) {
+    struct record *const heap = records->heap;
+    size_t const count = records->count;
+    struct record const record = heap[i];
+    while (true) {
+        size_t child = i * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && heap[child + 1].mtime < heap[child].mtime) {
+            ++child;
+        }
+        if (record.mtime <= heap[child].mtime) {
+            break;
+        }
+        heap[i] = heap[child];
+        records_place(records, i);
+        i = child;
+    }
+    heap[i] = record;
+    records_place(records, i);
+}
+
+/* Linear probing on the subpath, slots hold heap positions */
+static size_t records_slot_find(struct records const *const records, char const *const subpath) {
+    size_t const mask = records->slots_alloc - 1;
+    for (size_t slot = records_hash(subpath) & mask; records->slots[slot] != RECORDS_SLOT_EMPTY; slot = (slot + 1) & mask) {
+        if (!strcmp(records->heap[records->slots[slot]].subpath, subpath)) {
+            return slot;
+        }
+    }
+    return RECORDS_SLOT_EMPTY;
+}
+
+static void records_slot_insert(struct records *const records, size_t const i) {
+    size_t const mask = records->slots_alloc - 1;
+    size_t slot = records_hash(records->heap[i].subpath) & mask;
+    while (records->slots[slot] != RECORDS_SLOT_EMPTY) {
+        slot = (slot + 1) & mask;
+    }
+    records->slots[slot] = i;
+    records->heap[i].slot = slot;
+}
+
+/* Backward shift, so there're never tombstones */
+static void records_slot_erase(struct records *const records, size_t slot) {
+    size_t const mask = records->slots_alloc - 1;
+    size_t next = slot;
+    while (true) {
+        next = (next + 1) & mask;
+        size_t const i = records->slots[next];
+        if (i == RECORDS_SLOT_EMPTY) {
+            break;
+        }
+        size_t const home = records_hash(records->heap[i].subpath) & mask;
+        /* Only move it back if its home is not between the hole and itself */
+        if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+            records->slots[slot] = i;
+            records->heap[i].slot = slot;
+            slot = next;
+        }
+    }
+    records->slots[slot] = RECORDS_SLOT_EMPTY;
+}
+
+static int records_grow(struct records *const records) {
+    size_t const alloc = records->alloc ? records->alloc * 2 : RECORDS_ALLOC_INITIAL;
+    /* Twice as many slots as records at most, so probes stay short */
+    size_t *const slots = malloc(sizeof *slots * alloc * 2);
+    if (!slots) {
+        pr_error_with_errno("Failed to grow record slots to %zu", alloc * 2);
+        return 1;
+    }
+    struct record *const heap = realloc(records->heap, sizeof *heap * alloc);
+    if (!heap) {
+        pr_error_with_errno("Failed to grow records to %zu", alloc);
+        free(slots);
+        return 2;
+    }
+    records->heap = heap;
+    records->alloc = alloc;
+    memset(slots, 0xff, sizeof *slots * alloc * 2);
+    free(records->slots);
+    records->slots = slots;
+    records->slots_alloc = alloc * 2;
+    for (size_t i = 0; i < records->count; ++i) {
+        records_slot_insert(records, i);
+    }
+    return 0;
+}
+
+/* Takes the ownership of record->subpath on success */
+int records_push(struct records *const records, struct record const *const record) {
+    pthread_mutex_lock(&records->mutex);
+    if (records->count == records->alloc && records_grow(records)) {
+        pthread_mutex_unlock(&records->mutex);
+        return 1;
+    }
+    size_t const i = records->count++;
+    records->heap[i] = *record;
+    records_slot_insert(records, i);
+    records_sift_up(records, i);
+    pthread_mutex_unlock(&records->mutex);
+    return 0;
+}
+
+int records_add(struct records *const records, time_t const mtime, char const *const subpath, uint32_t const catalog_index) {
+    struct record record = {
+        .mtime = mtime,
+        .subpath = strdup(subpath),
+        .catalog_index = catalog_index
+    };
+    if (!record.subpath) {
+        pr_error_with_errno("Failed to duplicate record path '%s'", subpath);
+        return 1;
+    }
+    if (records_push(records, &record)) {
+        free(record.subpath);
+        return 2;
+    }
+    return 0;
+}
+
+/* Takes heap[i] out into record, needs mutex held */
+static void records_take(struct records *const records, size_t const i, struct record *const record) {
+    *record = records->heap[i];
+    records_slot_erase(records, record->slot);
+    if (--records->count == i) {
+        return;
+    }
+    records->heap[i] = records->heap[records->count];
+    records_place(records, i);
+    if (i && records->heap[(i - 1) / 2].mtime > records->heap[i].mtime) {
+        records_sift_up(records, i);
+    } else {
+        records_sift_down(records, i);
+    }
+}
+
+/* Moves the oldest record out, the caller owns record->subpath then, returns 1 if there's none */
+int records_pop(struct records *const records, struct record *const record) {
+    pthread_mutex_lock(&records->mutex);
+    if (!records->count) {
+        pthread_mutex_unlock(&records->mutex);
+        return 1;
+    }
+    records_take(records, 0, record);
+    pthread_mutex_unlock(&records->mutex);
+    return 0;
+}
+
+/* Moves the record of subpath out wherever it is, returns 1 if there's none */
+int records_remove(struct records *const records, char const *const subpath, struct record *const record) {
+    pthread_mutex_lock(&records->mutex);
+    size_t const slot = records->count ? records_slot_find(records, subpath) : RECORDS_SLOT_EMPTY;
+    if (slot == RECORDS_SLOT_EMPTY) {
+        pthread_mutex_unlock(&records->mutex);
+        return 1;
+    }
+    records_take(records, records->slots[slot], record);
+    pthread_mutex_unlock(&records->mutex);
+    return 0;
+}
+
+bool records_contains(struct records *const records, char const *const subpath) {
+    pthread_mutex_lock(&records->mutex);
+    bool const contains = records->count && records_slot_find(records, subpath) != RECORDS_SLOT_EMPTY;
+    pthread_mutex_unlock(&records->mutex);
+    return contains;
+}
+
+size_t records_count(struct records *const records) {
+    pthread_mutex_lock(&records->mutex);
+    size_t const count = records->count;
+    pthread_mutex_unlock(&records->mutex);
+    return count;
+}
+
+/* Follows a catalog compaction, map[old index] is the new index */
+void records_remap(struct records *const records, uint32_t const *const map, uint64_t const map_size) {
+    pthread_mutex_lock(&records->mutex);
+    for (size_t i = 0; i < records->count; ++i) {
+        uint32_t *const index = &records->heap[i].catalog_index;
+        if (*index != RECORDS_CATALOG_NONE) {
+            *index = *index < map_size ? map[*index] : RECORDS_CATALOG_NONE;
+        }
+    }
+    pthread_mutex_unlock(&records->mutex);
+}
@@ -0,0 +1,124 @@
+#include "ring.h"
+
+#include "print.h"
+
+/* Across all rings, so many stalled recorders can't take all memory together */
+static atomic_size_t bytes_all = 0;
+static size_t bytes_all_max = 0; /* 0 for no global limit */
+
+void ring_set_bytes_all_max(size_t const bytes_max) {
+    bytes_all_max = bytes_max;
+}
+
+int ring_init(struct ring *const ring, size_t const bytes_max) {
+    for (unsigned i = 0; i < RING_SLOTS; ++i) {
+        if (!(ring->packets[i] = av_packet_alloc())) {
+            pr_error("Failed to allocate packet %u for ring\n", i);
+            while (i) {
+                av_packet_free(&ring->packets[--i]);
+            }
+            return 1;
+        }
+    }
+    if (sem_init(&ring->items, 0, 0)) {
+        pr_error_with_errno("Failed to init semaphore for ring");
+        for (unsigned i = 0; i < RING_SLOTS; ++i) {
+            av_packet_free(&ring->packets[i]);
+        }
+        return 2;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->bytes, 0);
+    ring->bytes_max = bytes_max;
+    return 0;
+}
+
+void ring_free(struct ring *const ring) {
+    atomic_fetch_sub_explicit(&bytes_all, atomic_load_explicit(&ring->bytes, memory_order_relaxed), memory_order_relaxed);
+    for (unsigned i = 0; i < RING_SLOTS; ++i) {
+        av_packet_free(&ring->packets[i]);
+    }
+    sem_destroy(&ring->items);
+}
+
+/* What pkt really holds on to, the demuxer's buffer could be much larger than its payload */
+static size_t ring_packet_bytes(AVPacket const *const pkt) {
+    return pkt->buf ? pkt->buf->size : (size_t)pkt->size;
+}
+
+/* An empty ring, or one holding less than its floor, is exempt from the global budget, so rings
+   stalled on one slow disk can't starve the others for good; the budget is overshot by the floors at most */
+static bool ring_under_floor(struct ring const *const ring, size_t const bytes) {
+    return !bytes || bytes < ring->bytes_max / RING_FLOOR;
+}
+
+/* Takes the ownership of pkt on success, returns 1 without touching it if the ring is full,
+   overshoot lets pkt past the ring's own budget (but never the global one), for packets too precious to shed */
+int ring_push(struct ring *const ring, AVPacket *const pkt, bool const overshoot) {
+    unsigned const head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned const tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == RING_SLOTS) {
+        return 1;
+    }
+    size_t const bytes = atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+    size_t const size = ring_packet_bytes(pkt);
+    /* A single packet larger than the ring's own budget is still allowed into an empty ring */
+    if (bytes && bytes + size > (overshoot ? ring->bytes_max * RING_OVERSHOOT : ring->bytes_max)) {
+        return 1;
+    }
+    if (!ring_under_floor(ring, bytes) && bytes_all_max && atomic_load_explicit(&bytes_all, memory_order_relaxed) + size > bytes_all_max) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&ring->bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bytes_all, size, memory_order_relaxed);
+    av_packet_move_ref(ring->packets[head & (RING_SLOTS - 1)], pkt);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    sem_post(&ring->items);
+    return 0;
+}
+
+/* Moves the oldest packet into pkt, returns 1 if the ring is empty */
+int ring_pop(struct ring *const ring, AVPacket *const pkt) {
+    unsigned const tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned const head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return 1;
+    }
+    av_packet_move_ref(pkt, ring->packets[tail & (RING_SLOTS - 1)]);
+    size_t const size = ring_packet_bytes(pkt);
+    atomic_fetch_sub_explicit(&ring->bytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&bytes_all, size, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/* Consumer: blocks until something was pushed or ring_wake() was called */
+void ring_wait(struct ring *const ring) {
+    while (sem_wait(&ring->items) && errno == EINTR);
+}
+
+/* Consumer: as ring_wait() but never blocks, returns 1 if nothing was pushed nor ring_wake() called */
+int ring_try_wait(struct ring *const ring) {
+    int r;
+    while ((r = sem_trywait(&ring->items)) && errno == EINTR);
+    return r ? 1 : 0;
+}
+
+void ring_wake(struct ring *const ring) {
+    sem_post(&ring->items);
+}
+
+/* How full the budgets are in percent, the ring's own or the global one whichever is worse,
+   a ring under its floor only goes by its own */
+unsigned ring_pressure(struct ring *const ring) {
+    size_t const bytes = ring_bytes(ring);
+    unsigned pressure = ring->bytes_max ? bytes * 100 / ring->bytes_max : 0;
+    if (bytes_all_max && !ring_under_floor(ring, bytes)) {
+        unsigned const pressure_all = atomic_load_explicit(&bytes_all, memory_order_relaxed) * 100 / bytes_all_max;
+        if (pressure_all > pressure) {
+            pressure = pressure_all;
+        }
+    }
+    return pressure;
+}
@@ -0,0 +1,392 @@
+#include "scanner.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "print.h"
+
+static unsigned threads_wanted = 0;
+
+/* What getdents64 fills, glibc doesn't expose it before 2.30 */
+struct scanner_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* A folder queued or being scanned, freed once it and all folders under it are done */
+struct scanner_dir {
+    struct scanner_dir *parent;
+    atomic_uint pending; /* 1 for its own scan and 1 for each folder under it not yet done */
+    atomic_uint entries; /* Minus the folders under it removed as empty */
+    unsigned short len_subpath;
+    char subpath[]; /* Relative to the root, empty for the root itself */
+};
+
+struct scanner_worker {
+    struct scanner *scanner;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    struct scanner_dir **deque; /* Ring, the owner takes from the tail, thieves from the head */
+    size_t head;
+    size_t count;
+    size_t alloc;
+    char *buffer;
+    unsigned long steals;
+};
+
+struct scanner {
+    int root_fd;
+    scanner_file_cb cb;
+    void *arg;
+    struct scanner_worker *workers;
+    unsigned count;
+    atomic_ulong queued; /* In deques */
+    atomic_ulong outstanding; /* Queued or being scanned */
+    atomic_bool failed;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    atomic_ulong dirs;
+    atomic_ulong files;
+    atomic_ulong dirs_removed;
+};
+
+void scanner_parse_threads(char const *const arg) {
+    long threads = strtol(arg, NULL, 10);
+    if (threads < 0) {
+        threads = 0;
+    } else if (threads > SCANNER_THREADS_MAX) {
+        threads = SCANNER_THREADS_MAX;
+    }
+    threads_wanted = threads;
+    if (threads_wanted) {
+        pr_warn("Scanning storages with %u threads\n", threads_wanted);
+    } else {
+        pr_warn("Scanning storages with %u threads per CPU\n", SCANNER_THREADS_PER_CPU);
+    }
+}
+
+static unsigned scanner_threads() {
+    if (threads_wanted) {
+        return threads_wanted;
+    }
+    long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned const threads = cpus > 0 ? cpus * SCANNER_THREADS_PER_CPU : SCANNER_THREADS_PER_CPU;
+    return threads > SCANNER_THREADS_MAX ? SCANNER_THREADS_MAX : threads;
+}
+
+static int scanner_push(struct scanner_worker *const worker, struct scanner_dir *const dir) {
+    struct scanner *const scanner = worker->scanner;
+    /* Counted before anyone could take it, so outstanding never hits 0 early */
+    atomic_fetch_add(&scanner->outstanding, 1);
+    atomic_fetch_add(&scanner->queued, 1);
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->count == worker->alloc) {
+        size_t const alloc = worker->alloc ? worker->alloc * 2 : SCANNER_DEQUE_ALLOC_INITIAL;
+        struct scanner_dir **const deque = malloc(sizeof *deque * alloc);
+        if (!deque) {
+            pr_error_with_errno("Failed to grow scanner deque to %zu", alloc);
+            pthread_mutex_unlock(&worker->mutex);
+            atomic_fetch_sub(&scanner->queued, 1);
+            atomic_fetch_sub(&scanner->outstanding, 1);
+            return 1;
+        }
+        for (size_t i = 0; i < worker->count; ++i) {
+            deque[i] = worker->deque[(worker->head + i) % worker->alloc];
+        }
+        free(worker->deque);
+        worker->deque = deque;
+        worker->head = 0;
+        worker->alloc = alloc;
+    }
+    worker->deque[(worker->head + worker->count++) % worker->alloc] = dir;
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_mutex_lock(&scanner->idle_mutex);
+    pthread_cond_signal(&scanner->idle_cond);
+    pthread_mutex_unlock(&scanner->idle_mutex);
+    return 0;
+}
+
+/* Own work is taken depth-first, stolen work breadth-first, so thieves get big subtrees */
+static struct scanner_dir *scanner_take(struct scanner_worker *const worker, bool const steal) {
+    struct scanner_dir *dir = NULL;
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->count) {
+        if (steal) {
+            dir = worker->deque[worker->head];
+            worker->head = (worker->head + 1) % worker->alloc;
+        } else {
+            dir = worker->deque[(worker->head + worker->count - 1) % worker->alloc];
+        }
+        --worker->count;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    if (dir) {
+        atomic_fetch_sub(&worker->scanner->queued, 1);
+    }
+    return dir;
+}
+
+static struct scanner_dir *scanner_next(struct scanner_worker *const worker) {
+    struct scanner *const scanner = worker->scanner;
+    unsigned const id = worker - scanner->workers;
+    while (true) {
+        struct scanner_dir *dir = scanner_take(worker, false);
+        if (dir) {
+            return dir;
+        }
+        for (unsigned i = 1; i < scanner->count; ++i) {
+            if ((dir = scanner_take(scanner->workers + (id + i) % scanner->count, true))) {
+                ++worker->steals;
+                return dir;
+            }
+        }
+        pthread_mutex_lock(&scanner->idle_mutex);
+        while (!atomic_load(&scanner->queued) && atomic_load(&scanner->outstanding)) {
+            pthread_cond_wait(&scanner->idle_cond, &scanner->idle_mutex);
+        }
+        bool const done = !atomic_load(&scanner->outstanding);
+        pthread_mutex_unlock(&scanner->idle_mutex);
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+/* Its own scan or one under it is done, removes it if it's empty once all are */
+static void scanner_release(struct scanner *const scanner, struct scanner_dir *dir) {
+    while (dir && atomic_fetch_sub(&dir->pending, 1) == 1) {
+        struct scanner_dir *const parent = dir->parent;
+        if (parent && !atomic_load(&dir->entries) && !atomic_load(&scanner->failed)) {
+            if (unlinkat(scanner->root_fd, dir->subpath + 1, AT_REMOVEDIR) < 0) {
+                pr_error_with_errno("Failed to remove empty subfolder '%s'", dir->subpath);
+            } else {
+                atomic_fetch_sub(&parent->entries, 1);
+                atomic_fetch_add(&scanner->dirs_removed, 1);
+            }
+        }
+        free(dir);
+        dir = parent;
+    }
+}
+
+static struct scanner_dir *scanner_dir_new(struct scanner_dir *const parent, char const *const name, size_t const len_name) {
+    size_t const len_subpath = parent->len_subpath + 1 + len_name;
+    if (len_subpath >= PATH_MAX) {
+        pr_error("Path of '%s' under '%s' too long, ignored\n", name, parent->subpath);
+        return NULL;
+    }
+    struct scanner_dir *const dir = malloc(sizeof *dir + len_subpath + 1);
+    if (!dir) {
+        pr_error_with_errno("Failed to allocate scanner dir");
+        return NULL;
+    }
+    dir->parent = parent;
+    atomic_init(&dir->pending, 1);
+    atomic_init(&dir->entries, 0);
+    dir->len_subpath = len_subpath;
+    memcpy(dir->subpath, parent->subpath, parent->len_subpath);
+    dir->subpath[parent->len_subpath] = '/';
+    memcpy(dir->subpath + parent->len_subpath + 1, name, len_name + 1);
+    return dir;
+}
+
+static int scanner_scan_dir(struct scanner_worker *const worker, struct scanner_dir *const dir) {
+    struct scanner *const scanner = worker->scanner;
+    int const dir_fd = dir->len_subpath ?
+        openat(scanner->root_fd, dir->subpath + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+        dup(scanner->root_fd);
+    if (dir_fd < 0) {
+        pr_error_with_errno("Failed to open folder '%s'", dir->subpath);
+        return 1;
+    }
+    char subpath[PATH_MAX];
+    memcpy(subpath, dir->subpath, dir->len_subpath);
+    subpath[dir->len_subpath] = '/';
+    int r = 0;
+    unsigned entries = 0;
+    while (!r) {
+        long const len = syscall(SYS_getdents64, dir_fd, worker->buffer, SCANNER_BUFFER_SIZE);
+        if (len < 0) {
+            pr_error_with_errno("Failed to read entries of folder '%s'", dir->subpath);
+            r = 2;
+            break;
+        }
+        if (!len) {
+            break;
+        }
+        for (long offset = 0; offset < len && !r; ) {
+            struct scanner_dirent const *const entry = (struct scanner_dirent const *)(worker->buffer + offset);
+            offset += entry->d_reclen;
+            char const *const name = entry->d_name;
+            if (name[0] == '\0' || (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))) {
+                continue;
+            }
+            if (!strcmp(name, "lost+found")) {
+                continue;
+            }
+            ++entries;
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && !fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            size_t const len_name = strlen(name);
+            if (type == DT_DIR) {
+                struct scanner_dir *const dir_sub = scanner_dir_new(dir, name, len_name);
+                if (!dir_sub) {
+                    continue;
+                }
+                atomic_fetch_add(&dir->pending, 1);
+                if (scanner_push(worker, dir_sub)) {
+                    free(dir_sub);
+                    atomic_fetch_sub(&dir->pending, 1);
+                    r = 3;
+                }
+                continue;
+            }
+            if (type != DT_REG) {
+                continue;
+            }
+            if (dir->len_subpath + 1 + len_name >= PATH_MAX) {
+                pr_error("Path of '%s' under '%s' too long, ignored\n", name, dir->subpath);
+                continue;
+            }
+            memcpy(subpath + dir->len_subpath + 1, name, len_name + 1);
+            atomic_fetch_add(&scanner->files, 1);
+            if (scanner->cb(scanner->arg, dir_fd, name, subpath)) {
+                r = 4;
+            }
+        }
+    }
+    close(dir_fd);
+    atomic_fetch_add(&dir->entries, entries);
+    atomic_fetch_add(&scanner->dirs, 1);
+    return r;
+}
+
+static void *scanner_thread(void *const arg) {
+    struct scanner_worker *const worker = arg;
+    struct scanner *const scanner = worker->scanner;
+    struct scanner_dir *dir;
+    while ((dir = scanner_next(worker))) {
+        /* Keep draining after a failure so every dir is freed */
+        if (!atomic_load(&scanner->failed) && scanner_scan_dir(worker, dir)) {
+            atomic_store(&scanner->failed, true);
+        }
+        scanner_release(scanner, dir);
+        if (atomic_fetch_sub(&scanner->outstanding, 1) == 1) {
+            pthread_mutex_lock(&scanner->idle_mutex);
+            pthread_cond_broadcast(&scanner->idle_cond);
+            pthread_mutex_unlock(&scanner->idle_mutex);
+        }
+    }
+    return NULL;
+}
+
+static long scanner_time_ms() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000 + time_now.tv_nsec / 1000000;
+}
+
+/* Walks everything under root with a pool of threads stealing folders from each other,
+   removing empty folders under root along the way, returns non-zero if anything failed */
+int scanner_scan(char const *const root, scanner_file_cb const cb, void *const arg, struct scanner_stats *const stats) {
+    long const time_start = scanner_time_ms();
+    struct scanner scanner = {
+        .cb = cb,
+        .arg = arg,
+        .count = scanner_threads()
+    };
+    atomic_init(&scanner.queued, 0);
+    atomic_init(&scanner.outstanding, 0);
+    atomic_init(&scanner.failed, false);
+    atomic_init(&scanner.dirs, 0);
+    atomic_init(&scanner.files, 0);
+    atomic_init(&scanner.dirs_removed, 0);
+    if ((scanner.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        pr_error_with_errno("Failed to open scan root '%s'", root);
+        return 1;
+    }
+    int r = 0;
+    if (pthread_mutex_init(&scanner.idle_mutex, NULL) || pthread_cond_init(&scanner.idle_cond, NULL)) {
+        pr_error("Failed to init idle lock for scanner\n");
+        close(scanner.root_fd);
+        return 2;
+    }
+    if (!(scanner.workers = calloc(scanner.count, sizeof *scanner.workers))) {
+        pr_error_with_errno("Failed to allocate %u scanner workers", scanner.count);
+        r = 3;
+        goto scan_free;
+    }
+    struct scanner_dir *const dir_root = calloc(1, sizeof *dir_root + 1);
+    if (!dir_root) {
+        pr_error_with_errno("Failed to allocate scanner root");
+        r = 4;
+        goto scan_free;
+    }
+    atomic_init(&dir_root->pending, 1);
+    unsigned started = 0;
+    for (unsigned i = 0; i < scanner.count; ++i) {
+        struct scanner_worker *const worker = scanner.workers + i;
+        worker->scanner = &scanner;
+        if (pthread_mutex_init(&worker->mutex, NULL) || !(worker->buffer = malloc(SCANNER_BUFFER_SIZE))) {
+            pr_error("Failed to prepare scanner worker %u\n", i);
+            r = 5;
+            break;
+        }
+    }
+    if (r || scanner_push(scanner.workers, dir_root)) {
+        free(dir_root);
+        r = 6;
+        goto scan_free;
+    }
+    for (; started < scanner.count; ++started) {
+        if (pthread_create(&scanner.workers[started].thread, NULL, scanner_thread, scanner.workers + started)) {
+            pr_error("Failed to create scanner thread %u\n", started);
+            break;
+        }
+    }
+    if (!started) {
+        /* Nothing would take the root */
+        atomic_store(&scanner.failed, true);
+        scanner_thread(scanner.workers);
+    }
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(scanner.workers[i].thread, NULL);
+    }
+    if (atomic_load(&scanner.failed)) {
+        r = 7;
+    }
+    stats->dirs = atomic_load(&scanner.dirs);
+    stats->files = atomic_load(&scanner.files);
+    stats->dirs_removed = atomic_load(&scanner.dirs_removed);
+    stats->steals = 0;
+    for (unsigned i = 0; i < scanner.count; ++i) {
+        stats->steals += scanner.workers[i].steals;
+    }
+    stats->time = scanner_time_ms() - time_start;
+scan_free:
+    if (scanner.workers) {
+        for (unsigned i = 0; i < scanner.count; ++i) {
+            free(scanner.workers[i].deque);
+            free(scanner.workers[i].buffer);
+        }
+        free(scanner.workers);
+    }
+    pthread_cond_destroy(&scanner.idle_cond);
+    pthread_mutex_destroy(&scanner.idle_mutex);
+    close(scanner.root_fd);
+    return r;
+}
@@ -0,0 +1,247 @@
+#include "segment.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+
+#include "print.h"
+
+static segment_nospace_cb nospace_cb = NULL;
+static void *nospace_arg = NULL;
+
+void segment_set_nospace_handler(segment_nospace_cb const cb, void *const arg) {
+    nospace_cb = cb;
+    nospace_arg = arg;
+}
+
+static segment_created_cb created_cb = NULL;
+static void *created_arg = NULL;
+
+void segment_set_created_handler(segment_created_cb const cb, void *const arg) {
+    created_cb = cb;
+    created_arg = arg;
+}
+
+static segment_closed_cb closed_cb = NULL;
+static void *closed_arg = NULL;
+
+void segment_set_closed_handler(segment_closed_cb const cb, void *const arg) {
+    closed_cb = cb;
+    closed_arg = arg;
+}
+
+/* Write latency of all recorders together, in us, for cleaners sharing the device to back off,
+   updates racing between recorders lose a sample at worst */
+static atomic_ulong latency_recent = 0;
+static atomic_ulong latency_baseline = 0;
+
+void segment_get_latency(unsigned long *const recent, unsigned long *const baseline) {
+    *recent = atomic_load_explicit(&latency_recent, memory_order_relaxed);
+    *baseline = atomic_load_explicit(&latency_baseline, memory_order_relaxed);
+}
+
+static void segment_account_latency(unsigned long const latency) {
+    unsigned long const recent = atomic_load_explicit(&latency_recent, memory_order_relaxed);
+    unsigned long const baseline = atomic_load_explicit(&latency_baseline, memory_order_relaxed);
+    atomic_store_explicit(&latency_recent, recent - (recent >> SEGMENT_LATENCY_RECENT_SHIFT) + (latency >> SEGMENT_LATENCY_RECENT_SHIFT), memory_order_relaxed);
+    /* Follows drops quickly and rises slowly, so it stays what an uncontended write costs */
+    if (!baseline) {
+        atomic_store_explicit(&latency_baseline, latency, memory_order_relaxed);
+    } else if (latency < baseline) {
+        atomic_store_explicit(&latency_baseline, baseline - ((baseline - latency) >> SEGMENT_LATENCY_RECENT_SHIFT), memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&latency_baseline, baseline + ((latency - baseline) >> SEGMENT_LATENCY_BASELINE_SHIFT), memory_order_relaxed);
+    }
+}
+
+static void segment_raise_max(atomic_ulong *const max, unsigned long const value) {
+    unsigned long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void segment_raise_max_ms(atomic_long *const max, long const value) {
+    long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static unsigned long segment_time_us() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000000 + time_now.tv_nsec / 1000;
+}
+
+static long segment_time_ms() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000 + time_now.tv_nsec / 1000000;
+}
+
+/* On ENOSPC the storage is asked to evict right away and the rest of the buffer is retried,
+   the packet ring keeps absorbing the input in the meantime, a cancelled recorder gives up instead */
+static int segment_write(void *const opaque, uint8_t const *buf, int const buf_size) {
+    struct segment *const segment = opaque;
+    struct segment_stats *const stats = segment->stats;
+    int remain = buf_size;
+    unsigned evictions = 0;
+    long time_stall = 0;
+    while (remain) {
+        if (segment->cancel && atomic_load(segment->cancel)) {
+            pr_warn("Segment with fd %d cancelled with %d bytes not written\n", segment->fd, remain);
+            return AVERROR_EXIT;
+        }
+        unsigned long const time_write = segment_time_us();
+        ssize_t const r = write(segment->fd, buf, remain);
+        segment_account_latency(segment_time_us() - time_write);
+        if (r < 0) {
+            int const err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            if (err == ENOSPC && nospace_cb && evictions < SEGMENT_NOSPACE_EVICTIONS_MAX) {
+                if (!evictions++) {
+                    pr_warn("Segment with fd %d hit ENOSPC, evicting for room\n", segment->fd);
+                    time_stall = segment_time_ms();
+                    atomic_fetch_add_explicit(&stats->nospace_stalls, 1, memory_order_relaxed);
+                }
+                if (!nospace_cb(nospace_arg)) {
+                    atomic_fetch_add_explicit(&stats->nospace_evictions, 1, memory_order_relaxed);
+                    continue;
+                }
+            }
+            if (evictions) {
+                pr_error("Segment with fd %d still can't be written after %u evictions\n", segment->fd, evictions);
+                atomic_fetch_add_explicit(&stats->nospace_failures, 1, memory_order_relaxed);
+            }
+            return AVERROR(err);
+        }
+        buf += r;
+        remain -= r;
+    }
+    if (evictions) {
+        long const stall = segment_time_ms() - time_stall;
+        atomic_store_explicit(&stats->nospace_stall_last, stall, memory_order_relaxed);
+        segment_raise_max_ms(&stats->nospace_stall_max, stall);
+        pr_warn("Segment with fd %d resumed writing after %ldms and %u evictions\n", segment->fd, stall, evictions);
+    }
+    segment->offset += buf_size;
+    if (segment->offset > segment->size) {
+        segment->size = segment->offset;
+        /* Finished segments are not read back by us, keep them out of the page cache */
+        writeback_written(&segment->writeback, segment->fd, segment->size);
+    }
+    return buf_size;
+}
+
+static int64_t segment_seek(void *const opaque, int64_t const offset, int const whence) {
+    struct segment *const segment = opaque;
+    if (whence & AVSEEK_SIZE) {
+        return segment->size;
+    }
+    off_t const r = lseek(segment->fd, offset, whence & ~AVSEEK_FORCE);
+    if (r < 0) {
+        return AVERROR(errno);
+    }
+    segment->offset = r;
+    return r;
+}
+
+/* How fragmented the finished segment is, FIEMAP with no room for extents only counts them */
+static void segment_count_extents(struct segment *const segment) {
+    struct fiemap fiemap = {
+        .fm_start = 0,
+        .fm_length = FIEMAP_MAX_OFFSET,
+        .fm_flags = 0,
+        .fm_extent_count = 0
+    };
+    if (ioctl(segment->fd, FS_IOC_FIEMAP, &fiemap) < 0) {
+        pr_debug("Failed to count extents of segment with fd %d, errno: %d, error: %s\n", segment->fd, errno, strerror(errno));
+        return;
+    }
+    struct segment_stats *const stats = segment->stats;
+    atomic_fetch_add_explicit(&stats->extents_segments, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->extents_total, fiemap.fm_mapped_extents, memory_order_relaxed);
+    atomic_store_explicit(&stats->extents_last, fiemap.fm_mapped_extents, memory_order_relaxed);
+    segment_raise_max(&stats->extents_max, fiemap.fm_mapped_extents);
+}
+
+int segment_open(struct segment *const segment, char const *const path, off_t const preallocate, char const *const name, struct segment_stats *const stats, atomic_bool const *const cancel) {
+    if ((segment->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        pr_error_with_errno("Failed to open segment '%s'", path);
+        return 1;
+    }
+    segment->handle = -1;
+    segment->offset = 0;
+    segment->size = 0;
+    segment->preallocated = 0;
+    segment->stats = stats;
+    segment->cancel = cancel;
+    writeback_init(&segment->writeback, &stats->writeback);
+    /* Keep the size so players and the cleaner never see the reserved tail */
+    if (preallocate > 0) {
+        if (fallocate(segment->fd, FALLOC_FL_KEEP_SIZE, 0, preallocate)) {
+            pr_warn("Failed to preallocate %ld bytes for segment '%s', errno: %d, error: %s\n", preallocate, path, errno, strerror(errno));
+        } else {
+            segment->preallocated = preallocate;
+            atomic_fetch_add_explicit(&stats->preallocated, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats->preallocated_bytes, preallocate, memory_order_relaxed);
+        }
+    }
+    unsigned char *const buffer = av_malloc(SEGMENT_BUFFER_SIZE);
+    if (!buffer) {
+        pr_error("Failed to allocate I/O buffer for segment '%s'\n", path);
+        close(segment->fd);
+        unlink(path);
+        return 2;
+    }
+    if (!(segment->pb = avio_alloc_context(buffer, SEGMENT_BUFFER_SIZE, 1, segment, NULL, segment_write, segment_seek))) {
+        pr_error("Failed to allocate I/O context for segment '%s'\n", path);
+        av_free(buffer);
+        close(segment->fd);
+        unlink(path);
+        return 3;
+    }
+    /* Only a segment that's really there gets indexed */
+    if (created_cb) {
+        segment->handle = created_cb(created_arg, path, name);
+    }
+    return 0;
+}
+
+int segment_close(struct segment *const segment) {
+    int r = 0;
+    if (!segment->pb) {
+        return 0;
+    }
+    avio_flush(segment->pb);
+    if (segment->pb->error < 0) {
+        pr_error("Segment with fd %d has pending write error: %s\n", segment->fd, av_err2str(segment->pb->error));
+        r = 1;
+    }
+    av_freep(&segment->pb->buffer);
+    avio_context_free(&segment->pb);
+    /* Give back what we reserved but didn't use, punching past EOF is a no-op on ext4 while
+       truncating to the size we already have frees blocks kept past it */
+    if (segment->preallocated > segment->size && ftruncate(segment->fd, segment->size)) {
+        pr_warn("Failed to trim preallocated tail of segment with fd %d, errno: %d, error: %s\n", segment->fd, errno, strerror(errno));
+    } else if (segment->preallocated > segment->size) {
+        atomic_fetch_add_explicit(&segment->stats->trimmed_bytes, segment->preallocated - segment->size, memory_order_relaxed);
+    }
+    writeback_finish(&segment->writeback, segment->fd);
+    /* Only now is everything allocated for real */
+    segment_count_extents(segment);
+    if (closed_cb) {
+        closed_cb(closed_arg, segment->handle, segment->size);
+    }
+    if (close(segment->fd)) {
+        pr_error_with_errno("Failed to close segment with fd %d", segment->fd);
+        r = 2;
+    }
+    segment->fd = -1;
+    return r;
+}
\ No newline at end of file
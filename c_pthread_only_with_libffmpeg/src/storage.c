@@ -3,18 +3,36 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/stat.h>
-#include <sys/sendfile.h>
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "print.h"
 #include "argsep.h"
 #include "mkdir.h"
+#include "supervisor.h"
+#include "records.h"
+#include "catalog.h"
+#include "pattern.h"
+#include "scanner.h"
+#include "migrate.h"
+#include "copy.h"
+#include "throttle.h"
+#include "segment.h"
+#include "writeback.h"
 
 static unsigned max_cleaners = 0;
 static unsigned running_cleaners = 0;
 bool storage_oneshot_cleaner = false;
+static enum storage_order order = STORAGE_ORDER_MTIME;
+static struct pattern *patterns = NULL;
+static unsigned patterns_count = 0;
+
+char const storage_order_strings[][6] = {
+    "mtime",
+    "name"
+};
 
 char const storage_threshold_type_strings[][8] = {
     "percent",
@@ -34,6 +52,47 @@ void storage_parse_max_cleaners(char const *const arg) {
     pr_warn("Limited max concurrent cleaners to %u, do note these cleaners will be one-shot only and the cleaner end trigger might not work as intended\n", max_cleaners);
 }
 
+void storage_parse_order(char const *const arg) {
+    if (!strcmp(arg, "name")) {
+        order = STORAGE_ORDER_NAME;
+    } else {
+        if (strcmp(arg, "mtime")) {
+            pr_warn("Unknown storage order '%s', falling back to mtime\n", arg);
+        }
+        order = STORAGE_ORDER_MTIME;
+    }
+    pr_warn("Ordering files in storages by %s\n", storage_order_strings[order]);
+}
+
+/* format is the strftime of a camera, files of cameras whose ones can't be parsed back are ordered by mtime */
+int storage_add_name_pattern(char const *const format) {
+    if (order != STORAGE_ORDER_NAME) {
+        return 0;
+    }
+    struct pattern *const patterns_new = realloc(patterns, sizeof *patterns_new * (patterns_count + 1));
+    if (!patterns_new) {
+        pr_error_with_errno("Failed to allocate memory for name pattern");
+        return 1;
+    }
+    patterns = patterns_new;
+    if (pattern_compile(patterns + patterns_count, format, ".mkv")) {
+        pr_warn("Files recorded with strftime '%s' would be ordered by mtime\n", format);
+        return 0;
+    }
+    ++patterns_count;
+    return 0;
+}
+
+/* The start time encoded in the name of a record file, so it needs no stat, returns 0 if there's one */
+int storage_time_from_name(char const *const subpath, time_t *const time) {
+    for (unsigned i = 0; i < patterns_count; ++i) {
+        if (!pattern_match(patterns + i, subpath + 1, time)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static enum storage_threshold_type parse_storage_thresholds(char const *const arg, size_t *const value) {
     char *suffix;
     *value = strtoul(arg, &suffix, 10);
@@ -88,10 +147,28 @@ struct storage *parse_argument_storage(char const *const arg) {
     size_t threshold_to_value;
     enum storage_threshold_type threshold_to_type = parse_storage_thresholds(seps[1] + 1, &threshold_to_value);
     bool half_duplex = false;
+    size_t rate = 0;
     if (sep_id > 2) {
-        if (!strncmp(seps[2] + 1, "half_duplex", 12)) {
-            pr_warn("Storage is half-duplex: '%s', only one of read and write will be performed on it at the same time\n", arg);
-            half_duplex = true;
+        for (char const *flag = seps[2] + 1; *flag;) {
+            char const *flag_end = strchr(flag, ',');
+            if (!flag_end) {
+                flag_end = end;
+            }
+            size_t const len_flag = flag_end - flag;
+            char flag_value[32];
+            if (len_flag == 11 && !strncmp(flag, "half_duplex", 11)) {
+                pr_warn("Storage is half-duplex: '%s', only one of read and write will be performed on it at the same time\n", arg);
+                half_duplex = true;
+            } else if (len_flag > 5 && len_flag - 5 < sizeof flag_value && !strncmp(flag, "rate=", 5)) {
+                memcpy(flag_value, flag + 5, len_flag - 5);
+                flag_value[len_flag - 5] = '\0';
+                if (!(rate = parse_argument_size(flag_value))) {
+                    pr_warn("Illegal rate in storage definition: '%s', not limited\n", arg);
+                }
+            } else {
+                pr_warn("Unknown flag in storage definition: '%s', ignored\n", arg);
+            }
+            flag = *flag_end ? flag_end + 1 : flag_end;
         }
     }
     struct storage *storage = malloc(sizeof *storage);
@@ -111,6 +188,7 @@ struct storage *parse_argument_storage(char const *const arg) {
     storage->io_mutex_need_lock_this = half_duplex;
     storage->io_mutex_need_lock_next = false;
     storage->next_storage = NULL;
+    throttle_init(&storage->throttle, rate, NULL);
     pr_warn("Storage defitnition: path: '%s' (length %hu), clean from %lu (%s), to %lu (%s)\n", storage->path, storage->len_path, storage->thresholds.from.value, storage_threshold_type_strings[storage->thresholds.from.type], storage->thresholds.to.value, storage_threshold_type_strings[storage->thresholds.to.type]);
     return storage;
 }
@@ -132,6 +210,52 @@ static void storage_init_thresholds(struct storage_threshold *const threshold, s
     }
 }
 
+/* Indexes and catalogs a file found by the scanner, from any of its threads */
+static int storage_scan_entry(void *const arg, int const dir_fd, char const *const name, char const *const subpath) {
+    struct storage *const storage = arg;
+    if (!strncmp(name, CATALOG_NAME, sizeof CATALOG_NAME - 1)) {
+        return 0;
+    }
+    if (storage->len_path + strlen(subpath) >= PATH_MAX) {
+        pr_error("Path of '%s' under '%s' too long, ignored\n", subpath, storage->path);
+        return 0;
+    }
+    /* Size is only known after the first eviction visit for those with times in names */
+    time_t mtime;
+    off_t size = 0;
+    if (storage_time_from_name(subpath, &mtime)) {
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, 0) < 0) {
+            pr_error_with_errno("Failed to get stat of '%s'", subpath);
+            return 1;
+        }
+        mtime = st.st_mtim.tv_sec;
+        size = st.st_size;
+    }
+    int r = 0;
+    uint32_t catalog_index;
+    pthread_mutex_lock(&storage->catalog.mutex);
+    if (catalog_append(&storage->catalog, subpath, NULL, mtime, mtime, size, &catalog_index)) {
+        pr_error("Failed to catalog '%s' in storage '%s'\n", subpath, storage->path);
+        r = 2;
+    } else if (records_add(&storage->records, mtime, subpath, catalog_index)) {
+        pr_error("Failed to index '%s' in storage '%s'\n", subpath, storage->path);
+        r = 3;
+    }
+    pthread_mutex_unlock(&storage->catalog.mutex);
+    return r;
+}
+
+static int storage_load_entry(void *const arg, uint32_t const index, struct catalog_entry const *const entry, char const *const subpath) {
+    struct storage *const storage = arg;
+    /* Unfinished ones were being written when we stopped, eviction rekeys them by their real mtime anyway */
+    if (records_add(&storage->records, entry->time_end ? entry->time_end : entry->time_start, subpath, index)) {
+        pr_error("Failed to index '%s' from catalog of storage '%s'\n", subpath, storage->path);
+        return 1;
+    }
+    return 0;
+}
+
 static int storage_init(struct storage *const storage) {
     if (mkdir_recursive(storage->path, 0755)) {
         pr_error("Failed to make sure storage structure for '%s' exsits", storage->path);
@@ -158,6 +282,34 @@ static int storage_init(struct storage *const storage) {
         pr_error("Path of storage '%s' not properly ended or length %hu is not right\n", storage->path, storage->len_path);
         return 5;
     }
+    if (records_init(&storage->records)) {
+        pr_error("Failed to init index for storage '%s'\n", storage->path);
+        return 8;
+    }
+    bool fresh;
+    if (catalog_open(&storage->catalog, storage->path, &fresh)) {
+        pr_error("Failed to open catalog for storage '%s'\n", storage->path);
+        return 10;
+    }
+    if (fresh) {
+        /* The only full scan ever, from now on the catalog is kept up by recorders and cleaners */
+        struct scanner_stats stats;
+        if (scanner_scan(storage->path, storage_scan_entry, storage, &stats)) {
+            pr_error("Failed to scan storage '%s'\n", storage->path);
+            return 9;
+        }
+        pr_warn("Indexed %zu files in storage '%s' by scanning %lu folders in %ldms (%lu steals), removed %lu empty folders\n", records_count(&storage->records), storage->path, stats.dirs, stats.time, stats.steals, stats.dirs_removed);
+    } else {
+        if (catalog_foreach(&storage->catalog, storage_load_entry, storage)) {
+            pr_error("Failed to load catalog for storage '%s'\n", storage->path);
+            return 11;
+        }
+        pr_warn("Indexed %zu files in storage '%s' from catalog\n", records_count(&storage->records), storage->path);
+    }
+    if (pthread_mutex_init(&storage->evict_mutex, NULL)) {
+        pr_error("Failed to init evict mutex for storage '%s'\n", storage->path);
+        return 7;
+    }
     if (storage->half_duplex) {
         // storage->io_mutex_need_lock_this = true;
         // storage->io_mutex_need_lock = true;
@@ -176,9 +328,21 @@ static int storage_init(struct storage *const storage) {
             storage->next_io_mutex = &storage->next_storage->io_mutex;
         }
     }
+    if (migrate_init(&storage->migrate, storage->move_to_next, &storage->throttle, &storage->writeback)) {
+        pr_warn("Storage '%s' would evict files without the migrate engine\n", storage->path);
+    }
     return 0;
 }
 
+/* Either what's read or what's written by its cleaner is on the device */
+static bool storage_shares_device(struct storage const *const storage, dev_t const dev) {
+    struct stat st;
+    if (!stat(storage->path, &st) && st.st_dev == dev) {
+        return true;
+    }
+    return storage->next_storage && !stat(storage->next_storage->path, &st) && st.st_dev == dev;
+}
+
 int storages_init(struct storage *const storage_head) {
     for (struct storage *storage_current = storage_head; storage_current; storage_current = storage_current->next_storage) {
         if (storage_init(storage_current)) {
@@ -186,91 +350,61 @@ int storages_init(struct storage *const storage_head) {
             return 1;
         }
     }
-    return 0;
-}
-
-static int get_oldest(DIR *const dir, char *subpath_oldest, time_t *mtime_oldest, unsigned long *entries_count) {
-    int const dir_fd = dirfd(dir);
-    if (dir_fd < 0) {
-        pr_error_with_errno("Failed to get fd of dir");
-        return 1;
+    struct stat st_head;
+    if (stat(storage_head->path, &st_head) < 0) {
+        pr_error_with_errno("Failed to get stat of storage '%s'", storage_head->path);
+        return 2;
     }
-    struct dirent *entry;
-    *entries_count = 0;
-    while ((entry = readdir(dir))) {
-        if (entry->d_name[0] == '\0') {
-            continue;
-        }
-        if (entry->d_name[0] == '.') {
-            if (entry->d_name[1] == '\0') {
-                continue;
-            }
-            if (entry->d_name[1] == '.' && entry->d_name[2] == '\0') {
-                continue;
-            }
-        }
-        if (!strcmp(entry->d_name, "lost+found")) {
-            continue;
+    /* Only now are all folders there */
+    for (struct storage *storage_current = storage_head; storage_current; storage_current = storage_current->next_storage) {
+        if (storage_shares_device(storage_current, st_head.st_dev)) {
+            pr_warn("Storage '%s' shares its device with recorders, its cleaner would back off when their writes slow down\n", storage_current->path);
+            storage_current->throttle.latency = segment_get_latency;
         }
-        ++*entries_count;
-        switch (entry->d_type) {
-        case DT_REG: {
-            struct stat st;
-            if (fstatat(dir_fd, entry->d_name, &st, 0) < 0) {
-                pr_error_with_errno("Failed to get stat of '%s'", entry->d_name);
-                return 2;
-            }
-            if (st.st_mtim.tv_sec < *mtime_oldest) {
-                *mtime_oldest = st.st_mtim.tv_sec;
-                subpath_oldest[0] = '/';
-                size_t const len_name = strlen(entry->d_name);
-                strncpy(subpath_oldest + 1, entry->d_name, len_name);
-                *(subpath_oldest + len_name + 1) = '\0';
-            }
-            break;
+        if (storage_current->move_to_next && copy_probe(&storage_current->copy, storage_current->path, storage_current->next_storage->path)) {
+            pr_warn("Failed to probe copying from storage '%s' to '%s', would use sendfile\n", storage_current->path, storage_current->next_storage->path);
         }
-        case DT_DIR: {
-            int dir_sub_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
-            if (dir_sub_fd < 0) {
-                pr_error_with_errno("Failed to open sub folder '%s'", entry->d_name);
-                return 3;
-            }
-            DIR *const dir_sub = fdopendir(dir_sub_fd);
-            if (!dir_sub) {
-                pr_error_with_errno("Failed to open subdir '%s' from fd", entry->d_name);
-                close(dir_sub_fd);
-                return 4;
-            }
-            size_t const len_name = strlen(entry->d_name);
-            char *const subpath_oldest_recursive = subpath_oldest + len_name + 1;
-            time_t const mtime_oldest_before = *mtime_oldest;
-            unsigned long entries_count_recursive;
-            if (get_oldest(dir_sub, subpath_oldest_recursive, mtime_oldest, &entries_count_recursive)) {
-                pr_error("Failed to get oldest from subfolder '%s'\n", entry->d_name);
-                closedir(dir_sub);
-                return 5;
-            }
-            if (*mtime_oldest < mtime_oldest_before) {
-                subpath_oldest[0] = '/';
-                strncpy(subpath_oldest + 1, entry->d_name, len_name);
-            }
-            closedir(dir_sub);
-            if (entries_count_recursive) {
-                *entries_count += entries_count_recursive;
-            } else {
-                if (unlinkat(dir_fd, entry->d_name, AT_REMOVEDIR) < 0) {
-                    pr_error_with_errno("Failed to remove empty subfolder '%s'", entry->d_name);
-                }
-                --*entries_count;
+    }
+    return 0;
+}
+
+/* Removes folders left empty after path_oldest is gone, up to the storage itself */
+static void storage_remove_empty_parents(struct storage *const storage) {
+    char *const subpath = storage->subpath_oldest;
+    for (char *sep = strrchr(subpath, '/'); sep && sep > subpath; sep = strrchr(subpath, '/')) {
+        *sep = '\0';
+        if (rmdir(storage->path_oldest) < 0) {
+            if (errno != ENOTEMPTY && errno != EEXIST) {
+                pr_error_with_errno("Failed to remove empty subfolder '%s'", storage->path_oldest);
             }
             break;
         }
-        }
     }
-    return 0;
 }
 
-static int move_between_fs(char const *const path_old, char const *const path_new, struct storage *const storage) {
+static long storage_time_ms() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000 + time_now.tv_nsec / 1000000;
+}
+
+static long long storage_time_ns() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000000000LL + time_now.tv_nsec;
+}
+
+/* A chunk ending at offset was copied, bytes long */
+static void storage_copied(int const fin, int const fout, struct writeback *const writeback, off_t const offset, size_t const bytes, struct throttle *const throttle) {
+    writeback_drop(fin, offset - bytes, bytes);
+    writeback_written(writeback, fout, offset);
+    if (throttle) {
+        throttle_take(throttle, bytes);
+    }
+}
+
+/* throttle is NULL when recorders are waiting for the room */
+static int move_between_fs(char const *const path_old, char const *const path_new, struct storage *const storage, struct throttle *const throttle) {
     struct stat st;
     if (stat(path_old, &st)) {
         pr_error_with_errno("Failed to get stat of old file '%s'", path_old);
@@ -281,7 +415,7 @@ static int move_between_fs(char const *const path_old, char const *const path_ne
         pr_error_with_errno("Failed to open old file '%s'", path_old);
         return 2;
     }
-    int fout = open(path_new, O_WRONLY | O_CREAT, 0644);
+    int fout = open(path_new, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fout < 0) {
         pr_error_with_errno("Failed to open new file '%s'", path_new);
         close(fin);
@@ -289,6 +423,10 @@ static int move_between_fs(char const *const path_old, char const *const path_ne
     }
     size_t remain = st.st_size;
     ssize_t r;
+    struct writeback writeback;
+    writeback_init(&writeback, &storage->writeback);
+    size_t const chunk = throttle ? THROTTLE_CHUNK_SIZE : WRITEBACK_WINDOW;
+    long long const time_start = storage_time_ns();
     if (storage->io_mutex_need_lock) { /* Use two different branches to save time wasted on condition */
         while (remain) {
             if (storage->io_mutex_need_lock_this) {
@@ -297,7 +435,7 @@ static int move_between_fs(char const *const path_old, char const *const path_ne
             if (storage->io_mutex_need_lock_next) {
                 pthread_mutex_lock(storage->next_io_mutex);
             }
-            r = sendfile(fout, fin, NULL, remain);
+            r = copy_chunk(&storage->copy, fin, fout, remain > chunk ? chunk : remain);
             if (storage->io_mutex_need_lock_this) {
                 pthread_mutex_unlock(&storage->io_mutex);
             }
@@ -305,34 +443,59 @@ static int move_between_fs(char const *const path_old, char const *const path_ne
                 pthread_mutex_unlock(storage->next_io_mutex);
             }
             if (r < 0) {
+                pr_error_with_errno("Failed to copy file '%s' -> '%s'", path_old, path_new);
+                writeback_abandon(&writeback);
                 close(fin);
                 close(fout);
-                pr_error_with_errno("Failed to send file '%s' -> '%s'", path_old, path_new);
+                unlink(path_new);
                 return 4;
             }
             remain -= r;
+            if (storage->copy.strategy != COPY_STRATEGY_CLONE) {
+                storage_copied(fin, fout, &writeback, st.st_size - remain, r, throttle);
+            }
         }
     } else {
         while (remain) {
-            r = sendfile(fout, fin, NULL, remain);
+            r = copy_chunk(&storage->copy, fin, fout, remain > chunk ? chunk : remain);
             if (r < 0) {
+                pr_error_with_errno("Failed to copy file '%s' -> '%s'", path_old, path_new);
+                writeback_abandon(&writeback);
                 close(fin);
                 close(fout);
-                pr_error_with_errno("Failed to send file '%s' -> '%s'", path_old, path_new);
+                unlink(path_new);
                 return 4;
             }
             remain -= r;
+            if (storage->copy.strategy != COPY_STRATEGY_CLONE) {
+                storage_copied(fin, fout, &writeback, st.st_size - remain, r, throttle);
+            }
         }
     }
+    /* On disk before the old one goes, and out of the page cache as no one reads it soon */
+    if (storage->copy.strategy != COPY_STRATEGY_CLONE) {
+        writeback_finish(&writeback, fout);
+    }
+    writeback_drop(fin, 0, 0);
+    /* Whatever the pair stepped down to did most of it */
+    copy_account(&storage->copy, storage->copy.strategy, st.st_size, storage_time_ns() - time_start);
+    /* Keep the mtime, it's what files are ordered by on the next storage */
+    struct timespec const times[2] = {st.st_atim, st.st_mtim};
+    if (futimens(fout, times) < 0) {
+        pr_warn("Failed to keep times of '%s' on '%s', errno: %d, error: %s\n", path_old, path_new, errno, strerror(errno));
+    }
     close(fin);
     close(fout);
+    if (throttle) {
+        throttle_take(throttle, THROTTLE_UNLINK_COST);
+    }
     if (unlink(path_old) < 0) {
         pr_error_with_errno("Failed to unlink old file '%s'", path_old);
     }
     return 0;
 }
 
-static int move_file(char const *const path_old, char const *const path_new, struct storage *const storage) {
+static int move_file(char const *const path_old, char const *const path_new, struct storage *const storage, struct throttle *const throttle) {
     if (mkdir_recursive_only_parent(path_new, 0755)) {
         pr_error("Failed to create parent folders for '%s'", path_new);
         return 1;
@@ -343,7 +506,7 @@ static int move_file(char const *const path_old, char const *const path_new, str
             pr_error("Old file '%s' does not exist now, did you remove it by yourself? Or is the disk broken? Ignore that for now", path_old);
             return 0;
         case EXDEV:
-            if (move_between_fs(path_old, path_new, storage)) {
+            if (move_between_fs(path_old, path_new, storage, throttle)) {
                 pr_error("Failed to move '%s' to '%s' across fs\n", path_old, path_new);
                 return 2;
             }
@@ -357,56 +520,543 @@ static int move_file(char const *const path_old, char const *const path_new, str
 }
 
 
+static void storage_catalog_remove(struct storage *const storage, uint32_t const index) {
+    pthread_mutex_lock(&storage->catalog.mutex);
+    catalog_remove(&storage->catalog, index);
+    pthread_mutex_unlock(&storage->catalog.mutex);
+}
+
+/* Takes the oldest file out of the index into record, with its stat, needs evict_mutex held,
+   files modified after mtime_max are left alone, returns 1 if there's none */
+static int storage_pick_oldest(struct storage *const storage, time_t const mtime_max, struct record *const record, struct stat *const st) {
+    size_t const len_subpath_max = PATH_MAX - storage->len_path - 1;
+    while (!records_pop(&storage->records, record)) {
+        size_t const len_subpath = strlen(record->subpath);
+        if (len_subpath > len_subpath_max) {
+            pr_error("Indexed path '%s' too long for storage '%s', dropped\n", record->subpath, storage->path);
+            storage_catalog_remove(storage, record->catalog_index);
+            free(record->subpath);
+            continue;
+        }
+        memcpy(storage->subpath_oldest, record->subpath, len_subpath + 1);
+        if (stat(storage->path_oldest, st) < 0) {
+            if (errno != ENOENT) {
+                pr_error_with_errno("Failed to get stat of '%s', dropped from index", storage->path_oldest);
+            }
+            storage_catalog_remove(storage, record->catalog_index);
+            free(record->subpath);
+            continue;
+        }
+        /* Still written after it was indexed, put it back where it belongs now, so the top of
+           the heap is only trusted once its key is its real mtime, when ordering by names that's
+           only for files that could still be written, the rest keep the start times in their names */
+        bool const rekey = st->st_mtim.tv_sec > record->mtime &&
+            (order == STORAGE_ORDER_MTIME || st->st_mtim.tv_sec > time(NULL) - STORAGE_EMERGENCY_MIN_AGE);
+        if (rekey) {
+            record->mtime = st->st_mtim.tv_sec;
+        }
+        if (rekey || record->mtime > mtime_max) {
+            if (records_push(&storage->records, record)) {
+                free(record->subpath);
+                return -1;
+            }
+            if (rekey) {
+                continue;
+            }
+            return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* A picked file is on the next storage now, hands its record and catalog entry over there */
+static void storage_record_moved(struct storage *const storage, struct record *const record, struct stat const *const st) {
+    struct catalog_entry entry;
+    struct storage *const next = storage->next_storage;
+    pthread_mutex_lock(&storage->catalog.mutex);
+    bool const cataloged = !catalog_get(&storage->catalog, record->catalog_index, &entry);
+    catalog_remove(&storage->catalog, record->catalog_index);
+    pthread_mutex_unlock(&storage->catalog.mutex);
+    if (!cataloged) {
+        memset(&entry, 0, sizeof entry);
+        entry.time_start = entry.time_end = st->st_mtim.tv_sec;
+        entry.size = st->st_size;
+    }
+    /* The new index must be in the heap before the next storage could compact its catalog,
+       and the watcher might have seen it arrive there already */
+    pthread_mutex_lock(&next->catalog.mutex);
+    if (records_contains(&next->records, record->subpath)) {
+        free(record->subpath);
+    } else {
+        if (catalog_append(&next->catalog, record->subpath, entry.camera, entry.time_start, entry.time_end, entry.size, &record->catalog_index)) {
+            pr_error("Failed to catalog '%s' in storage '%s', it would be forgotten after restart\n", record->subpath, next->path);
+            record->catalog_index = RECORDS_CATALOG_NONE;
+        }
+        if (records_push(&next->records, record)) {
+            pr_error("Failed to index '%s' in storage '%s', it would only be cleaned after restart\n", record->subpath, next->path);
+            free(record->subpath);
+        }
+    }
+    pthread_mutex_unlock(&next->catalog.mutex);
+}
+
+/* Moves a picked file to the next storage by renaming or removes it, needs evict_mutex held, as a
+   recorder waits for it it's never copied, 2 is returned if it would have to be, on failure or then
+   it's put back into the index */
+static int storage_evict_record(struct storage *const storage, struct record *const record, struct stat const *const st) {
+    memcpy(storage->subpath_oldest, record->subpath, strlen(record->subpath) + 1);
+    pr_warn("Cleaning oldest file '%s' from storage '%s' (currently %zu indexed)\n", storage->path_oldest, storage->path, records_count(&storage->records) + 1);
+    if (storage->move_to_next) {
+        strncpy(storage->subpath_new, storage->subpath_oldest, storage->len_path_new_allow);
+        if (mkdir_recursive_only_parent(storage->path_new, 0755)) {
+            pr_error("Failed to create parent folders for '%s'\n", storage->path_new);
+            records_push(&storage->records, record);
+            return 3;
+        }
+        if (rename(storage->path_oldest, storage->path_new) < 0) {
+            switch (errno) {
+            case ENOENT:
+                pr_error("Old file '%s' does not exist now, dropped from index\n", storage->path_oldest);
+                storage_catalog_remove(storage, record->catalog_index);
+                free(record->subpath);
+                return 0;
+            case EXDEV:
+                records_push(&storage->records, record);
+                return 2;
+            default:
+                pr_error_with_errno("Failed to rename '%s' to '%s'", storage->path_oldest, storage->path_new);
+                records_push(&storage->records, record);
+                return 3;
+            }
+        }
+        pr_warn("Moved file '%s' to '%s'\n", storage->path_oldest, storage->path_new);
+        storage_record_moved(storage, record, st);
+    } else {
+        if (unlink(storage->path_oldest) < 0) {
+            pr_error_with_errno("Failed to unlink file '%s'\n", storage->path_oldest);
+            records_push(&storage->records, record);
+            return 3;
+        }
+        pr_warn("Removed file '%s'\n", storage->path_oldest);
+        storage_catalog_remove(storage, record->catalog_index);
+        free(record->subpath);
+    }
+    storage_remove_empty_parents(storage);
+    return 0;
+}
+
+/* Like storage_evict_record() for a planned file, already out of the index so no one else evicts it,
+   evict_mutex is only taken to hand its record over, never across a throttled copy that emergency
+   evictions would otherwise wait behind */
+static int storage_evict_planned(struct storage *const storage, struct storage_plan_item *const item, struct throttle *const throttle) {
+    struct record *const record = &item->record;
+    char *path_old;
+    char *path_new = NULL;
+    if (asprintf(&path_old, "%s%s", storage->path, record->subpath) < 0) {
+        pr_error_with_errno("Failed to allocate paths to evict '%s'", record->subpath);
+        pthread_mutex_lock(&storage->evict_mutex);
+        records_push(&storage->records, record);
+        pthread_mutex_unlock(&storage->evict_mutex);
+        return 1;
+    }
+    if (storage->move_to_next && asprintf(&path_new, "%s%s", storage->next_storage->path, record->subpath) < 0) {
+        pr_error_with_errno("Failed to allocate paths to evict '%s'", record->subpath);
+        free(path_old);
+        pthread_mutex_lock(&storage->evict_mutex);
+        records_push(&storage->records, record);
+        pthread_mutex_unlock(&storage->evict_mutex);
+        return 1;
+    }
+    int r = 0;
+    pr_warn("Cleaning oldest file '%s' from storage '%s' (currently %zu indexed)\n", path_old, storage->path, records_count(&storage->records) + 1);
+    if (path_new) {
+        if (move_file(path_old, path_new, storage, throttle)) {
+            pr_error("Failed to move file '%s' to '%s'\n", path_old, path_new);
+            r = 3;
+        } else {
+            pr_warn("Moved file '%s' to '%s'\n", path_old, path_new);
+        }
+    } else {
+        if (throttle) {
+            throttle_take(throttle, THROTTLE_UNLINK_COST);
+        }
+        if (unlink(path_old) < 0) {
+            pr_error_with_errno("Failed to unlink file '%s'\n", path_old);
+            r = 3;
+        } else {
+            pr_warn("Removed file '%s'\n", path_old);
+        }
+    }
+    pthread_mutex_lock(&storage->evict_mutex);
+    if (r) {
+        records_push(&storage->records, record);
+    } else {
+        memcpy(storage->subpath_oldest, record->subpath, strlen(record->subpath) + 1);
+        if (path_new) {
+            storage_record_moved(storage, record, &item->st);
+        } else {
+            storage_catalog_remove(storage, record->catalog_index);
+            free(record->subpath);
+        }
+        storage_remove_empty_parents(storage);
+    }
+    pthread_mutex_unlock(&storage->evict_mutex);
+    free(path_old);
+    free(path_new);
+    return r;
+}
+
+/* Picks the oldest files covering bytes_needed, in what they really take on disk, and takes
+   them out of the index so no one else evicts them, returns how many went into plan */
+static size_t storage_plan(struct storage *const storage, unsigned long long const bytes_needed, struct storage_plan_item **const plan, size_t *const alloc, unsigned long long *const bytes_planned) {
+    size_t count = 0;
+    *bytes_planned = 0;
+    pthread_mutex_lock(&storage->evict_mutex);
+    while (*bytes_planned < bytes_needed) {
+        if (count == *alloc) {
+            size_t const alloc_new = *alloc ? *alloc * 2 : STORAGE_PLAN_ALLOC_INITIAL;
+            struct storage_plan_item *const plan_new = realloc(*plan, sizeof *plan_new * alloc_new);
+            if (!plan_new) {
+                pr_error_with_errno("Failed to grow eviction plan to %zu", alloc_new);
+                break;
+            }
+            *plan = plan_new;
+            *alloc = alloc_new;
+        }
+        struct storage_plan_item *const item = *plan + count;
+        if (storage_pick_oldest(storage, LONG_MAX, &item->record, &item->st)) {
+            break;
+        }
+        /* At least one, so a filesystem not counting blocks still makes progress */
+        *bytes_planned += item->st.st_blocks ? (unsigned long long)item->st.st_blocks * 512 : 1;
+        ++count;
+    }
+    pthread_mutex_unlock(&storage->evict_mutex);
+    return count;
+}
+
+/* Like storage_evict_record() for a whole plan, but with every rename done first and the files that
+   still need copying across filesystems, or removing, all handed to the migrate engine at once,
+   evicted counts those done, the rest are put back into the index */
+static int storage_evict_batch(struct storage *const storage, struct storage_plan_item *const plan, size_t const count, size_t *const evicted) {
+    struct migrate_item *const items = calloc(count, sizeof *items);
+    if (!items) {
+        pr_error_with_errno("Failed to allocate migrate items");
+        return 1;
+    }
+    int r = 0;
+    size_t migrating = 0;
+    struct storage *const next = storage->next_storage;
+    struct throttle *const throttle = throttle_active(&storage->throttle) ? &storage->throttle : NULL;
+    /* Anything not reached is put back */
+    for (size_t i = 0; i < count; ++i) {
+        items[i].result = -1;
+    }
+    for (size_t i = 0; i < count && !r; ++i) {
+        char const *const subpath = plan[i].record.subpath;
+        char *path_old;
+        char *path_new = NULL;
+        if (asprintf(&path_old, "%s%s", storage->path, subpath) < 0) {
+            pr_error_with_errno("Failed to allocate paths to migrate '%s'", subpath);
+            r = 2;
+            break;
+        }
+        if (storage->move_to_next && asprintf(&path_new, "%s%s", next->path, subpath) < 0) {
+            pr_error_with_errno("Failed to allocate paths to migrate '%s'", subpath);
+            free(path_old);
+            r = 2;
+            break;
+        }
+        items[i].path_old = path_old;
+        items[i].path_new = path_new;
+        if (!path_new) {
+            ++migrating;
+            continue;
+        }
+        if (mkdir_recursive_only_parent(path_new, 0755)) {
+            pr_error("Failed to create parent folders for '%s'\n", path_new);
+            items[i].result = EIO;
+        } else if (rename(path_old, path_new) < 0) {
+            if (errno != EXDEV) {
+                items[i].result = errno;
+            } else if (storage->copy.strategy == COPY_STRATEGY_SENDFILE) {
+                /* Only worth the ring when bytes really have to go through memory */
+                ++migrating;
+                continue;
+            } else {
+                items[i].result = move_between_fs(path_old, path_new, storage, throttle) ? EIO : 0;
+            }
+        } else {
+            items[i].result = 0;
+        }
+    }
+    if (!r && migrating) {
+        /* Keeps the order, so the oldest go first */
+        struct migrate_item *const queue = malloc(sizeof *queue * migrating);
+        if (!queue) {
+            pr_error_with_errno("Failed to allocate migrate queue");
+            r = 3;
+        } else {
+            size_t queued = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (items[i].result == -1) {
+                    queue[queued++] = items[i];
+                }
+            }
+            struct migrate_stats const stats_before = storage->migrate.stats;
+            long const time_start = storage_time_ms();
+            if (migrate_batch(&storage->migrate, queue, queued)) {
+                pr_error("Migrate engine of storage '%s' broke, falling back to sendfile\n", storage->path);
+                storage->migrate.available = false;
+                r = 4;
+            }
+            long const time_spent = storage_time_ms() - time_start;
+            unsigned long const bytes = storage->migrate.stats.bytes - stats_before.bytes;
+            pr_warn("Migrated %lu files (%lu bytes, %lu MiB/s) and unlinked %lu from storage '%s' in %ldms\n", storage->migrate.stats.files - stats_before.files, bytes, time_spent ? bytes * 1000 / time_spent / 0x100000 : 0, storage->migrate.stats.unlinks - stats_before.unlinks, storage->path, time_spent);
+            for (size_t i = 0, j = 0; i < count && j < queued; ++i) {
+                if (items[i].result == -1) {
+                    items[i].result = queue[j++].result;
+                }
+            }
+            free(queue);
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        struct record *const record = &plan[i].record;
+        pthread_mutex_lock(&storage->evict_mutex);
+        if (items[i].result == ENOENT) {
+            pr_error("Old file '%s' does not exist now, dropped from index\n", items[i].path_old);
+            storage_catalog_remove(storage, record->catalog_index);
+            free(record->subpath);
+        } else if (items[i].result) {
+            if (items[i].result > 0) {
+                pr_error("Failed to evict file '%s', error: %s\n", items[i].path_old, strerror(items[i].result));
+                r = r ? r : 5;
+            }
+            records_push(&storage->records, record);
+        } else {
+            memcpy(storage->subpath_oldest, record->subpath, strlen(record->subpath) + 1);
+            if (items[i].path_new) {
+                pr_warn("Moved file '%s' to '%s'\n", items[i].path_old, items[i].path_new);
+                storage_record_moved(storage, record, &plan[i].st);
+            } else {
+                pr_warn("Removed file '%s'\n", items[i].path_old);
+                storage_catalog_remove(storage, record->catalog_index);
+                free(record->subpath);
+            }
+            storage_remove_empty_parents(storage);
+            ++*evicted;
+        }
+        pthread_mutex_unlock(&storage->evict_mutex);
+        free((char *)items[i].path_old);
+        free((char *)items[i].path_new);
+    }
+    free(items);
+    return r;
+}
+
+
+/* Plans what to evict to get to the to threshold from one statvfs, then evicts all of it,
+   only replanning if that was not enough, e.g. files still held open by readers */
 static int storage_clean(struct storage *const storage) {
     bool oneshot_clean = storage_oneshot_cleaner && storage->move_to_next;
-    for (unsigned short i = 0; i < 0xffff; ++i) {
-        while (storage->next_storage->cleaning) {
+    struct storage_plan_item *plan = NULL;
+    size_t alloc = 0;
+    int r = 0;
+    struct throttle *const throttle = throttle_active(&storage->throttle) ? &storage->throttle : NULL;
+    for (unsigned short round = 0; round < STORAGE_PLAN_ROUNDS_MAX && !r; ++round) {
+        while (storage->next_storage && storage->next_storage->cleaning) {
             pr_debug("Cleaner for '%s' waiting for cleaner for next storage '%s' to complete\n", storage->path, storage->next_storage->path);
             sleep(1);
         }
-        *storage->subpath_oldest = '\0';
-        rewinddir(storage->dir);
-        time_t mtime_oldest = LONG_MAX;
-        unsigned long entries_count;
-        if (get_oldest(storage->dir, storage->subpath_oldest, &mtime_oldest, &entries_count)) {
-            pr_error("Failed to get oldest in '%s'", storage->path);
-            return 2;
-        }
-        if (*storage->subpath_oldest == '/') {
-            pr_warn("Cleaning oldest file '%s' from storage '%s' (currently %lu entries)\n", storage->path_oldest, storage->path, entries_count);
-            if (storage->move_to_next) {
-                strncpy(storage->subpath_new, storage->subpath_oldest, storage->len_path_new_allow);
-                if (move_file(storage->path_oldest, storage->path_new, storage)) {
-                    pr_error("Failed to move file '%s' to '%s'\n", storage->path_oldest, storage->path_new);
-                    return 3;
-                }
-                pr_warn("Moved file '%s' to '%s'\n", storage->path_oldest, storage->path_new);
-            } else {
-                if (unlink(storage->path_oldest) < 0) {
-                    pr_error_with_errno("Failed to unlink file '%s'\n", storage->path_oldest);
-                    return 3;
+        struct statvfs st;
+        if (statvfs(storage->path, &st) < 0) {
+            pr_error_with_errno("Failed to get vfs stat for '%s'", storage->path);
+            r = 1;
+            break;
+        }
+        if (round && st.f_bfree >= storage->thresholds.to.free_blocks) {
+            break;
+        }
+        unsigned long long const bytes_needed = oneshot_clean ? 1 :
+            st.f_bfree < storage->thresholds.to.free_blocks ? (unsigned long long)(storage->thresholds.to.free_blocks - st.f_bfree) * st.f_frsize : 1;
+        long const time_plan = storage_time_ms();
+        unsigned long long bytes_planned;
+        size_t const count = storage_plan(storage, bytes_needed, &plan, &alloc, &bytes_planned);
+        long const time_run = storage_time_ms();
+        if (!count) {
+            pr_warn("Nothing left to clean in storage '%s'\n", storage->path);
+            break;
+        }
+        size_t evicted = 0;
+        if (storage->migrate.available && !storage->io_mutex_need_lock) {
+            r = storage_evict_batch(storage, plan, count, &evicted);
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                if (r) {
+                    pthread_mutex_lock(&storage->evict_mutex);
+                    records_push(&storage->records, &plan[i].record);
+                    pthread_mutex_unlock(&storage->evict_mutex);
+                } else if (!(r = storage_evict_planned(storage, plan + i, throttle))) {
+                    ++evicted;
                 }
-                pr_warn("Removed file '%s'\n", storage->path_oldest);
             }
         }
+        long const time_end = storage_time_ms();
+        pr_warn("Eviction plan for storage '%s': %zu files, %llu bytes for %llu needed, planned in %ldms, %zu evicted in %ldms\n", storage->path, count, bytes_planned, bytes_needed, time_run - time_plan, evicted, time_end - time_run);
+        if (storage->move_to_next) {
+            copy_report(&storage->copy, storage->path, storage->next_storage->path);
+        }
+        pr_warn("Cleaner of storage '%s' waited for writeback %lu times, stalled %llums (max %llums), %llu bytes dirty at most\n", storage->path, storage->writeback.waits, storage->writeback.stall_us / 1000, storage->writeback.stall_max_us / 1000, storage->writeback.dirty_max);
+        if (throttle) {
+            pr_warn("Cleaner of storage '%s' waited %llums for its rate so far, backed off %lu times for recorders, now at %u/%u of the rate\n", storage->path, throttle->stats.waited_ms, throttle->stats.backoffs, throttle->shares, THROTTLE_SHARES);
+        }
         if (oneshot_clean) {
-            return 0;
+            break;
         }
-        struct statvfs st;
-        if (statvfs(storage->path, &st) < 0) {
-            pr_error_with_errno("Failed to get vfs stat for '%s'", storage->path);
-            return 1;
+    }
+    free(plan);
+    return r;
+}
+
+/* Called when a recorder starts a file, path is full path including the storage,
+   returns the handle of its catalog entry to finish it with, or CATALOG_HANDLE_NONE */
+int64_t storage_index_add(struct storage *const storage, char const *const path, char const *const name, time_t const mtime) {
+    if (strncmp(path, storage->path, storage->len_path) || path[storage->len_path] != '/') {
+        pr_error("File '%s' is not in storage '%s', not indexed\n", path, storage->path);
+        return CATALOG_HANDLE_NONE;
+    }
+    char const *const subpath = path + storage->len_path;
+    int64_t handle = CATALOG_HANDLE_NONE;
+    uint32_t catalog_index;
+    struct record record;
+    pthread_mutex_lock(&storage->catalog.mutex);
+    /* The watcher could have seen it in a new folder first, ours comes with the camera */
+    if (!records_remove(&storage->records, subpath, &record)) {
+        catalog_remove(&storage->catalog, record.catalog_index);
+        free(record.subpath);
+    }
+    if (catalog_append(&storage->catalog, subpath, name, mtime, 0, 0, &catalog_index)) {
+        pr_error("Failed to catalog '%s', it would be forgotten after restart\n", path);
+        catalog_index = RECORDS_CATALOG_NONE;
+    } else {
+        handle = catalog_handle(&storage->catalog, catalog_index);
+    }
+    if (records_add(&storage->records, mtime, subpath, catalog_index)) {
+        pr_error("Failed to index '%s'\n", path);
+    }
+    pthread_mutex_unlock(&storage->catalog.mutex);
+    return handle;
+}
+
+/* Called when a recorder closes a file, a handle made stale by compaction is ignored */
+void storage_index_finish(struct storage *const storage, int64_t const handle, time_t const time_end, off_t const size) {
+    pthread_mutex_lock(&storage->catalog.mutex);
+    catalog_finish(&storage->catalog, handle, time_end, size);
+    pthread_mutex_unlock(&storage->catalog.mutex);
+}
+
+/* Called by the watcher for a file that showed up not from our recorders, or might have,
+   subpath is relative to the storage, returns 0 if it's indexed now or already was */
+int storage_index_track(struct storage *const storage, char const *const subpath, time_t const mtime, off_t const size) {
+    int r = 0;
+    uint32_t catalog_index;
+    pthread_mutex_lock(&storage->catalog.mutex);
+    if (!records_contains(&storage->records, subpath)) {
+        if (catalog_append(&storage->catalog, subpath, NULL, mtime, mtime, size, &catalog_index)) {
+            pr_error("Failed to catalog '%s' in storage '%s'\n", subpath, storage->path);
+            catalog_index = RECORDS_CATALOG_NONE;
         }
-        if (st.f_bfree >= storage->thresholds.to.free_blocks) {
-            pr_warn("Cleaned %hu record files in storage '%s'\n", i + 1, storage->path);
-            return 0;
+        if (records_add(&storage->records, mtime, subpath, catalog_index)) {
+            pr_error("Failed to index '%s' in storage '%s'\n", subpath, storage->path);
+            catalog_remove(&storage->catalog, catalog_index);
+            r = 1;
+        }
+    }
+    pthread_mutex_unlock(&storage->catalog.mutex);
+    return r;
+}
+
+/* Called by the watcher for a file gone not by our cleaners, those are out of the index already */
+void storage_index_forget(struct storage *const storage, char const *const subpath) {
+    struct record record;
+    pthread_mutex_lock(&storage->catalog.mutex);
+    if (!records_remove(&storage->records, subpath, &record)) {
+        catalog_remove(&storage->catalog, record.catalog_index);
+        free(record.subpath);
+    }
+    pthread_mutex_unlock(&storage->catalog.mutex);
+}
+
+/* Drops dead entries once they're the majority, evict_mutex keeps popped records from holding old indices */
+static void storage_compact_catalog(struct storage *const storage) {
+    pthread_mutex_lock(&storage->evict_mutex);
+    pthread_mutex_lock(&storage->catalog.mutex);
+    if (catalog_needs_compact(&storage->catalog)) {
+        uint32_t *map;
+        uint64_t map_size;
+        if (catalog_compact(&storage->catalog, &map, &map_size)) {
+            pr_error("Failed to compact catalog of storage '%s'\n", storage->path);
+        } else {
+            records_remap(&storage->records, map, map_size);
+            free(map);
+        }
+    }
+    pthread_mutex_unlock(&storage->catalog.mutex);
+    pthread_mutex_unlock(&storage->evict_mutex);
+}
+
+/* Called from a recorder whose write just failed with ENOSPC, so evict one file synchronously
+   instead of waiting for the supervisor to notice, but only if that's bounded, a file that has to be
+   copied to the next storage is left to the cleaner while we back off, returns 0 if worth retrying */
+int storage_evict_emergency(struct storage *const storage) {
+    struct timespec time_start, time_end;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    pthread_mutex_lock(&storage->evict_mutex);
+    /* Another recorder might have just made room while we waited for the lock */
+    struct statvfs st;
+    if (statvfs(storage->path, &st) < 0) {
+        pr_error_with_errno("Failed to get vfs stat for '%s'", storage->path);
+        pthread_mutex_unlock(&storage->evict_mutex);
+        return 1;
+    }
+    bool const room = st.f_bavail * st.f_frsize >= STORAGE_EMERGENCY_MIN_FREE;
+    int r = 0;
+    if (!room) {
+        struct record record;
+        struct stat st_record;
+        /* Never take files that might still be written */
+        if (!(r = storage_pick_oldest(storage, time(NULL) - STORAGE_EMERGENCY_MIN_AGE, &record, &st_record))) {
+            r = storage_evict_record(storage, &record, &st_record);
         }
     }
+    pthread_mutex_unlock(&storage->evict_mutex);
+    supervisor_notify(); /* Let the regular cleaner take over from here */
+    if (r == 2) {
+        pr_warn("Emergency eviction on storage '%s' needs a copy across filesystems, left to its cleaner, backing off %dms\n", storage->path, STORAGE_EMERGENCY_BACKOFF_MS);
+        struct timespec duration = {
+            .tv_sec = STORAGE_EMERGENCY_BACKOFF_MS / 1000,
+            .tv_nsec = STORAGE_EMERGENCY_BACKOFF_MS % 1000 * 1000000
+        };
+        while (nanosleep(&duration, &duration) && errno == EINTR);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    if (r) {
+        pr_error("Emergency eviction on storage '%s' freed nothing\n", storage->path);
+        return 1;
+    }
+    pr_warn("Emergency eviction on storage '%s' took %ldms\n", storage->path, (time_end.tv_sec - time_start.tv_sec) * 1000 + (time_end.tv_nsec - time_start.tv_nsec) / 1000000);
     return 0;
 }
 
 static void *storage_clean_thread(void *arg) {
+    /* Anything recorders need to write goes first */
+    throttle_set_idle_priority();
     long r = storage_clean((struct storage *)arg);
+    storage_compact_catalog((struct storage *)arg);
+    supervisor_notify();
     return (void *)r;
 }
 
@@ -0,0 +1,178 @@
+#include "supervisor.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "print.h"
+#include "watcher.h"
+
+#define SUPERVISOR_STORAGE_INTERVAL 10 /* Free space is also checked everytime a recorder or cleaner notifies */
+
+enum supervisor_source {
+    SUPERVISOR_SOURCE_EVENT,
+    SUPERVISOR_SOURCE_CAMERA_TIMER,
+    SUPERVISOR_SOURCE_STORAGE_TIMER,
+    SUPERVISOR_SOURCE_WATCHER
+};
+
+static int event_fd = -1;
+static int camera_timer_fd = -1;
+static int storage_timer_fd = -1;
+
+int supervisor_init() {
+    if ((event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        pr_error_with_errno("Failed to create eventfd for supervisor");
+        return 1;
+    }
+    return 0;
+}
+
+/* Called by recorders and cleaners when they end or reach a segment boundary, safe from any thread */
+void supervisor_notify() {
+    uint64_t const one = 1;
+    if (write(event_fd, &one, sizeof one) < 0) {
+        pr_error_with_errno("Failed to notify supervisor");
+    }
+}
+
+static int supervisor_arm_camera_timer(time_t const time_wake) {
+    struct itimerspec spec = {
+        .it_interval = {0},
+        .it_value = {
+            .tv_sec = time_wake,
+            .tv_nsec = 0
+        }
+    };
+    /* A wall clock jump cancels the timer so we would recalculate the boundary */
+    if (timerfd_settime(camera_timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) < 0) {
+        pr_error_with_errno("Failed to arm camera timer for %ld", time_wake);
+        return 1;
+    }
+    return 0;
+}
+
+static int supervisor_add(int const epoll_fd, int const fd, enum supervisor_source const source) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u32 = source
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        pr_error_with_errno("Failed to add fd %d to supervisor epoll", fd);
+        return 1;
+    }
+    return 0;
+}
+
+static int supervisor_prepare(int *const epoll_fd) {
+    if ((*epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        pr_error_with_errno("Failed to create epoll for supervisor");
+        return 1;
+    }
+    if ((camera_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+        pr_error_with_errno("Failed to create camera timer for supervisor");
+        return 2;
+    }
+    if ((storage_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+        pr_error_with_errno("Failed to create storage timer for supervisor");
+        return 3;
+    }
+    struct itimerspec spec = {
+        .it_interval = {
+            .tv_sec = SUPERVISOR_STORAGE_INTERVAL,
+            .tv_nsec = 0
+        },
+        .it_value = {
+            .tv_sec = SUPERVISOR_STORAGE_INTERVAL,
+            .tv_nsec = 0
+        }
+    };
+    if (timerfd_settime(storage_timer_fd, 0, &spec, NULL) < 0) {
+        pr_error_with_errno("Failed to arm storage timer");
+        return 4;
+    }
+    if (supervisor_add(*epoll_fd, event_fd, SUPERVISOR_SOURCE_EVENT) ||
+        supervisor_add(*epoll_fd, camera_timer_fd, SUPERVISOR_SOURCE_CAMERA_TIMER) ||
+        supervisor_add(*epoll_fd, storage_timer_fd, SUPERVISOR_SOURCE_STORAGE_TIMER)) {
+        return 5;
+    }
+    if (watcher_get_fd() >= 0 && supervisor_add(*epoll_fd, watcher_get_fd(), SUPERVISOR_SOURCE_WATCHER)) {
+        return 6;
+    }
+    return 0;
+}
+
+/* Sleeps until a recorder/cleaner notifies, a segment boundary or break wait is due, free space needs a check, or files in storages changed */
+int supervisor_run(struct storage *const storage_head, struct camera *const camera_head) {
+    int epoll_fd;
+    if (supervisor_prepare(&epoll_fd)) {
+        pr_error("Failed to prepare supervisor\n");
+        return 1;
+    }
+    bool check_storages = true;
+    bool check_cameras = true;
+    while (true) {
+        if (check_storages && storages_clean(storage_head)) {
+            pr_error("Storages cleaner breaks\n");
+            return 2;
+        }
+        if (check_cameras) {
+            time_t time_wake = 0;
+            if (cameras_work(camera_head, &time_wake)) {
+                pr_error("Cameras worker breaks\n");
+                return 3;
+            }
+            if (supervisor_arm_camera_timer(time_wake)) {
+                return 4;
+            }
+        }
+        check_storages = false;
+        check_cameras = false;
+        struct epoll_event events[4];
+        int const count = epoll_wait(epoll_fd, events, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pr_error_with_errno("Failed to wait for supervisor events");
+            return 5;
+        }
+        for (int i = 0; i < count; ++i) {
+            uint64_t value;
+            switch (events[i].data.u32) {
+            case SUPERVISOR_SOURCE_EVENT:
+                if (read(event_fd, &value, sizeof value) < 0 && errno != EAGAIN) {
+                    pr_error_with_errno("Failed to read supervisor eventfd");
+                    return 6;
+                }
+                check_storages = true;
+                check_cameras = true;
+                break;
+            case SUPERVISOR_SOURCE_CAMERA_TIMER:
+                /* ECANCELED means the wall clock jumped, re-arming would fix it */
+                if (read(camera_timer_fd, &value, sizeof value) < 0 && errno != EAGAIN && errno != ECANCELED) {
+                    pr_error_with_errno("Failed to read camera timer");
+                    return 7;
+                }
+                check_cameras = true;
+                break;
+            case SUPERVISOR_SOURCE_STORAGE_TIMER:
+                if (read(storage_timer_fd, &value, sizeof value) < 0 && errno != EAGAIN) {
+                    pr_error_with_errno("Failed to read storage timer");
+                    return 8;
+                }
+                check_storages = true;
+                break;
+            case SUPERVISOR_SOURCE_WATCHER:
+                if (watcher_handle()) {
+                    pr_error("Watcher breaks\n");
+                    return 9;
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "throttle.h"
+
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "print.h"
+
+static long long throttle_time_ms() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000LL + time_now.tv_nsec / 1000000;
+}
+
+void throttle_init(struct throttle *const throttle, size_t const rate, throttle_latency_cb const latency) {
+    throttle->rate = rate;
+    throttle->latency = latency;
+    throttle->shares = THROTTLE_SHARES;
+    throttle->tokens = 0;
+    throttle->time_refill = throttle_time_ms();
+    throttle->time_adapt = throttle->time_refill;
+    throttle->stats.waited_ms = 0;
+    throttle->stats.backoffs = 0;
+}
+
+/* Whether it would ever wait, so copies needn't be cut into chunks otherwise */
+bool throttle_active(struct throttle const *const throttle) {
+    return throttle->rate || throttle->latency;
+}
+
+/* AIMD on the recorders' write latency: halve on slow writes, slowly give back otherwise */
+static void throttle_adapt(struct throttle *const throttle, long long const time_now) {
+    if (time_now - throttle->time_adapt < THROTTLE_ADAPT_INTERVAL_MS) {
+        return;
+    }
+    throttle->time_adapt = time_now;
+    unsigned long recent, baseline;
+    throttle->latency(&recent, &baseline);
+    if (recent > THROTTLE_LATENCY_FLOOR_US && recent > baseline * THROTTLE_LATENCY_RATIO) {
+        if (throttle->shares > 1) {
+            throttle->shares /= 2;
+            ++throttle->stats.backoffs;
+            pr_debug("Recorder writes took %luus against %luus baseline, migration backs off to %u/%u\n", recent, baseline, throttle->shares, THROTTLE_SHARES);
+        }
+    } else if (throttle->shares < THROTTLE_SHARES) {
+        throttle->shares += THROTTLE_SHARES_REGAIN;
+        if (throttle->shares > THROTTLE_SHARES) {
+            throttle->shares = THROTTLE_SHARES;
+        }
+    }
+}
+
+/* Charges bytes of I/O already done or about to be done, waiting as long as the rate needs */
+void throttle_take(struct throttle *const throttle, size_t const bytes) {
+    if (!throttle_active(throttle)) {
+        return;
+    }
+    long long time_now = throttle_time_ms();
+    if (throttle->latency) {
+        throttle_adapt(throttle, time_now);
+    }
+    if (!throttle->rate && throttle->shares == THROTTLE_SHARES) {
+        throttle->time_refill = time_now;
+        return;
+    }
+    long long const rate = (long long)(throttle->rate ? throttle->rate : THROTTLE_RATE_UNLIMITED) * throttle->shares / THROTTLE_SHARES;
+    long long const burst = rate * THROTTLE_BURST_MS / 1000;
+    throttle->tokens += rate * (time_now - throttle->time_refill) / 1000;
+    if (throttle->tokens > burst) {
+        throttle->tokens = burst;
+    }
+    throttle->time_refill = time_now;
+    throttle->tokens -= bytes;
+    if (throttle->tokens >= 0) {
+        return;
+    }
+    long long const wait = -throttle->tokens * 1000 / rate + 1;
+    struct timespec duration = {
+        .tv_sec = wait / 1000,
+        .tv_nsec = wait % 1000 * 1000000
+    };
+    while (nanosleep(&duration, &duration) && errno == EINTR);
+    throttle->stats.waited_ms += wait;
+}
+
+/* For the calling thread only, so recorders keep their class */
+int throttle_set_idle_priority() {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) < 0) {
+        pr_error_with_errno("Failed to set idle I/O priority for cleaner");
+        return 1;
+    }
+    return 0;
+}
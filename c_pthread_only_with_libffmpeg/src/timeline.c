@@ -0,0 +1,120 @@
+#include "timeline.h"
+
+#include <string.h>
+#include <libavutil/mem.h>
+
+#include "print.h"
+
+static int64_t timeline_time_us() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_REALTIME, &time_now);
+    return (int64_t)time_now.tv_sec * 1000000 + time_now.tv_nsec / 1000;
+}
+
+int timeline_init(struct timeline *const timeline, AVFormatContext const *const ifmt_ctx, int const anchor_stream) {
+    timeline->nb_streams = 0;
+    timeline->anchor_stream = anchor_stream;
+    timeline->anchored = false;
+    atomic_init(&timeline->wallclock_offset, 0);
+    if (!(timeline->streams = av_calloc(ifmt_ctx->nb_streams, sizeof *timeline->streams))) {
+        pr_error("Failed to allocate memory for timeline streams\n");
+        return 1;
+    }
+    timeline->nb_streams = ifmt_ctx->nb_streams;
+    for (unsigned i = 0; i < timeline->nb_streams; ++i) {
+        struct timeline_stream *const stream = timeline->streams + i;
+        stream->time_base = ifmt_ctx->streams[i]->time_base;
+        stream->offset = 0;
+        stream->dts_last = AV_NOPTS_VALUE;
+        stream->duration_last = 0;
+    }
+    return 0;
+}
+
+void timeline_free(struct timeline *const timeline) {
+    av_freep(&timeline->streams);
+    timeline->nb_streams = 0;
+}
+
+static void timeline_anchor(struct timeline *const timeline, int64_t const dts, AVRational const time_base) {
+    atomic_store(&timeline->wallclock_offset, timeline_time_us() - av_rescale_q(dts, time_base, AV_TIME_BASE_Q));
+    timeline->anchored = true;
+}
+
+/* Rewrites pkt's timestamps in place, check_drift compares against the wall clock, so only pass it
+   for a few packets (e.g. keyframes) */
+enum timeline_result timeline_normalize(struct timeline *const timeline, AVPacket *const pkt, bool const check_drift) {
+    if ((unsigned)pkt->stream_index >= timeline->nb_streams) {
+        return TIMELINE_OK;
+    }
+    struct timeline_stream *const stream = timeline->streams + pkt->stream_index;
+    enum timeline_result result = TIMELINE_OK;
+    /* Plenty of demuxers only set PTS when there's no reordering, that's not worth counting */
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (dts == AV_NOPTS_VALUE) {
+        if (stream->dts_last == AV_NOPTS_VALUE) {
+            return TIMELINE_DROPPED;
+        }
+        dts = stream->dts_last + stream->duration_last;
+        pkt->pts = dts;
+        result = TIMELINE_REPAIRED;
+    } else {
+        int64_t const delta_pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts - dts : 0;
+        dts += stream->offset;
+        if (stream->dts_last != AV_NOPTS_VALUE) {
+            int64_t const jump = av_rescale_q(TIMELINE_JUMP_SECONDS, (AVRational){1, 1}, stream->time_base);
+            int64_t const diff = dts - stream->dts_last;
+            if (diff > jump || diff < -jump) {
+                /* Camera rebooted, wrapped around or skipped, continue right after the last packet */
+                int64_t const expected = stream->dts_last + stream->duration_last;
+                stream->offset += expected - dts;
+                dts = expected;
+                result = TIMELINE_JUMPED;
+            } else if (diff <= 0) {
+                dts = stream->dts_last + 1;
+                result = TIMELINE_REPAIRED;
+            }
+        }
+        if (delta_pts < 0) {
+            pkt->pts = dts;
+            if (result == TIMELINE_OK) {
+                result = TIMELINE_REPAIRED;
+            }
+        } else {
+            pkt->pts = dts + delta_pts;
+        }
+    }
+    pkt->dts = dts;
+    if (pkt->duration > 0) {
+        stream->duration_last = pkt->duration;
+    } else if (stream->dts_last != AV_NOPTS_VALUE && dts > stream->dts_last) {
+        stream->duration_last = dts - stream->dts_last;
+    } else if (!stream->duration_last) {
+        stream->duration_last = 1;
+    }
+    stream->dts_last = dts;
+
+    if (timeline->anchor_stream >= 0 && pkt->stream_index != timeline->anchor_stream) {
+        return result;
+    }
+    if (!timeline->anchored) {
+        timeline_anchor(timeline, dts, stream->time_base);
+    } else if (check_drift) {
+        int64_t const drift = timeline_time_us() - av_rescale_q(dts, stream->time_base, AV_TIME_BASE_Q) - atomic_load(&timeline->wallclock_offset);
+        if (drift > (int64_t)TIMELINE_DRIFT_SECONDS * 1000000 || drift < -(int64_t)TIMELINE_DRIFT_SECONDS * 1000000) {
+            pr_warn("Packet time drifted %lldms from wall clock, re-anchoring\n", (long long)drift / 1000);
+            timeline_anchor(timeline, dts, stream->time_base);
+            result = TIMELINE_JUMPED;
+        }
+    }
+    return result;
+}
+
+/* Wall clock time of a normalized packet, only meaningful for packets of the anchor stream */
+time_t timeline_wallclock(struct timeline *const timeline, AVPacket const *const pkt) {
+    if ((unsigned)pkt->stream_index >= timeline->nb_streams || pkt->dts == AV_NOPTS_VALUE || !timeline->anchored) {
+        return time(NULL);
+    }
+    AVRational const time_base = timeline->streams[pkt->stream_index].time_base;
+    return (av_rescale_q(pkt->dts, time_base, AV_TIME_BASE_Q) + atomic_load(&timeline->wallclock_offset)) / 1000000;
+}
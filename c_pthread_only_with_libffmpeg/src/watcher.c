@@ -0,0 +1,244 @@
+#include "watcher.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "print.h"
+#include "catalog.h"
+
+#define WATCHER_MASK_DIR (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+/* What a watch descriptor is for, subpath relative to the storage, NULL for unused */
+struct watcher_dir {
+    struct storage *storage;
+    char *subpath;
+};
+
+static int inotify_fd = -1;
+static struct storage *storages = NULL;
+static struct watcher_dir *dirs = NULL;
+static int dirs_alloc = 0;
+static unsigned long rescans = 0;
+
+static int watcher_set_dir(int const wd, struct storage *const storage, char const *const subpath) {
+    if (wd >= dirs_alloc) {
+        int alloc = dirs_alloc ? dirs_alloc : WATCHER_DIRS_ALLOC_INITIAL;
+        while (wd >= alloc) {
+            alloc *= 2;
+        }
+        struct watcher_dir *const dirs_new = realloc(dirs, sizeof *dirs_new * alloc);
+        if (!dirs_new) {
+            pr_error_with_errno("Failed to grow watched dirs to %d", alloc);
+            return 1;
+        }
+        memset(dirs_new + dirs_alloc, 0, sizeof *dirs_new * (alloc - dirs_alloc));
+        dirs = dirs_new;
+        dirs_alloc = alloc;
+    }
+    char *const subpath_dup = strdup(subpath);
+    if (!subpath_dup) {
+        pr_error_with_errno("Failed to duplicate watched path '%s'", subpath);
+        return 2;
+    }
+    free(dirs[wd].subpath);
+    dirs[wd].storage = storage;
+    dirs[wd].subpath = subpath_dup;
+    return 0;
+}
+
+static void watcher_unset_dir(int const wd) {
+    if (wd < dirs_alloc) {
+        free(dirs[wd].subpath);
+        dirs[wd].subpath = NULL;
+    }
+}
+
+static bool watcher_ignored(char const *const name) {
+    return !strcmp(name, "lost+found") || !strncmp(name, CATALOG_NAME, sizeof CATALOG_NAME - 1);
+}
+
+/* Watches path, the storage path followed by subpath, and every folder under it, and tracks
+   the files in them if index, as they could have been there before the watch was */
+static int watcher_add_tree(struct storage *const storage, char *const path, char *const subpath, bool const index) {
+    int const wd = inotify_add_watch(inotify_fd, path, WATCHER_MASK_DIR);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            pr_error("Out of inotify watches when watching '%s', raise fs.inotify.max_user_watches\n", path);
+        } else {
+            pr_error_with_errno("Failed to watch '%s'", path);
+        }
+        return 1;
+    }
+    if (watcher_set_dir(wd, storage, subpath)) {
+        return 2;
+    }
+    DIR *const dir = opendir(path);
+    if (!dir) {
+        /* Could be gone already, the event of that would clean up */
+        return 0;
+    }
+    size_t const len_subpath = strlen(subpath);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (watcher_ignored(entry->d_name)) {
+            continue;
+        }
+        size_t const len_name = strlen(entry->d_name);
+        if (subpath + len_subpath + len_name + 2 > path + PATH_MAX) {
+            pr_error("Path of '%s' under '%s' too long, not watched\n", entry->d_name, path);
+            continue;
+        }
+        subpath[len_subpath] = '/';
+        memcpy(subpath + len_subpath + 1, entry->d_name, len_name + 1);
+        struct stat st;
+        time_t mtime;
+        unsigned char type = entry->d_type;
+        /* Not every filesystem fills d_type, like the scanner */
+        bool const stated = type == DT_UNKNOWN && !fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        if (stated) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        switch (type) {
+        case DT_DIR:
+            watcher_add_tree(storage, path, subpath, index);
+            break;
+        case DT_REG:
+            if (!index) {
+                break;
+            }
+            if (!storage_time_from_name(subpath, &mtime)) {
+                storage_index_track(storage, subpath, mtime, 0);
+            } else if (stated || !stat(path, &st)) {
+                storage_index_track(storage, subpath, st.st_mtim.tv_sec, st.st_size);
+            }
+            break;
+        }
+        subpath[len_subpath] = '\0';
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int watcher_add_storage(struct storage *const storage, bool const index) {
+    char path[PATH_MAX];
+    memcpy(path, storage->path, storage->len_path + 1);
+    return watcher_add_tree(storage, path, path + storage->len_path, index);
+}
+
+/* Storages were indexed by their catalogs or scans already, only watch them */
+int watcher_init(struct storage *const storage_head) {
+    if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        pr_error_with_errno("Failed to init inotify for watcher");
+        return 1;
+    }
+    storages = storage_head;
+    for (struct storage *storage = storage_head; storage; storage = storage->next_storage) {
+        if (watcher_add_storage(storage, false)) {
+            pr_warn("Storage '%s' not fully watched, files put there by others might only be noticed after restart\n", storage->path);
+        }
+    }
+    return 0;
+}
+
+int watcher_get_fd() {
+    return inotify_fd;
+}
+
+/* Events got lost, re-watch everything and pick up whatever we missed, missed removals are
+   dropped by the cleaners when they get to them */
+static void watcher_rescan() {
+    pr_warn("Inotify queue overflowed, rescanning all storages (%lu times so far)\n", ++rescans);
+    for (struct storage *storage = storages; storage; storage = storage->next_storage) {
+        if (watcher_add_storage(storage, true)) {
+            pr_error("Failed to rescan storage '%s'\n", storage->path);
+        }
+    }
+}
+
+/* A folder moved away keeps its watches, and those under it, with the path it no longer has */
+static void watcher_forget_tree(struct storage *const storage, char const *const subpath) {
+    size_t const len_subpath = strlen(subpath);
+    for (int wd = 0; wd < dirs_alloc; ++wd) {
+        char const *const subpath_dir = dirs[wd].subpath;
+        if (subpath_dir && dirs[wd].storage == storage && !strncmp(subpath_dir, subpath, len_subpath) &&
+            (subpath_dir[len_subpath] == '\0' || subpath_dir[len_subpath] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            watcher_unset_dir(wd);
+        }
+    }
+}
+
+static void watcher_handle_event(struct inotify_event const *const event) {
+    if (event->mask & IN_IGNORED) {
+        watcher_unset_dir(event->wd);
+        return;
+    }
+    if (!event->len || event->wd >= dirs_alloc || !dirs[event->wd].subpath || watcher_ignored(event->name)) {
+        return;
+    }
+    struct storage *const storage = dirs[event->wd].storage;
+    char path[PATH_MAX];
+    int const len_path = snprintf(path, PATH_MAX, "%s%s/%s", storage->path, dirs[event->wd].subpath, event->name);
+    if (len_path >= PATH_MAX) {
+        pr_error("Path of '%s' under '%s%s' too long, ignored\n", event->name, storage->path, dirs[event->wd].subpath);
+        return;
+    }
+    char *const subpath = path + storage->len_path;
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watcher_add_tree(storage, path, subpath, true);
+        } else if (event->mask & IN_MOVED_FROM) {
+            watcher_forget_tree(storage, subpath);
+        }
+        return;
+    }
+    /* Recorders index their files on creation, so only completed files are of interest */
+    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        struct stat st;
+        time_t mtime;
+        if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+            storage_index_track(storage, subpath, storage_time_from_name(subpath, &mtime) ? st.st_mtim.tv_sec : mtime, st.st_size);
+        }
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        storage_index_forget(storage, subpath);
+    }
+}
+
+/* Called by the supervisor when the inotify fd is readable, drains it */
+int watcher_handle() {
+    char buffer[WATCHER_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t const len = read(inotify_fd, buffer, sizeof buffer);
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            pr_error_with_errno("Failed to read inotify events");
+            return 1;
+        }
+        bool overflowed = false;
+        for (char const *ptr = buffer; ptr < buffer + len; ) {
+            struct inotify_event const *const event = (struct inotify_event const *)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+            } else {
+                watcher_handle_event(event);
+            }
+            ptr += sizeof *event + event->len;
+        }
+        if (overflowed) {
+            watcher_rescan();
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#include "writeback.h"
+
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "print.h"
+
+static unsigned long long writeback_time_us() {
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    return time_now.tv_sec * 1000000ULL + time_now.tv_nsec / 1000;
+}
+
+void writeback_init(struct writeback *const writeback, struct writeback_stats *const stats) {
+    writeback->started = 0;
+    writeback->dropped = 0;
+    writeback->written = 0;
+    writeback->stats = stats;
+}
+
+static void writeback_raise_max(atomic_ullong *const max, unsigned long long const value) {
+    unsigned long long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+void writeback_account_dirty(struct writeback_stats *const stats, unsigned long long const bytes) {
+    writeback_raise_max(&stats->dirty_max, atomic_fetch_add_explicit(&stats->dirty, bytes, memory_order_relaxed) + bytes);
+}
+
+/* Only queues the range for writeback, never waits */
+void writeback_start(int const fd, off_t const offset, off_t const len) {
+    if (sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE) < 0) {
+        pr_debug("Failed to start writeback of fd %d, errno: %d, error: %s\n", fd, errno, strerror(errno));
+    }
+}
+
+/* Clean pages only, dirty ones are left to writeback */
+void writeback_drop(int const fd, off_t const offset, off_t const len) {
+    int const r = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+    if (r) {
+        pr_debug("Failed to drop cache of fd %d, error: %s\n", fd, strerror(r));
+    }
+}
+
+/* Waits until the range is on disk, then drops it, len 0 for up to the end */
+void writeback_wait(int const fd, off_t const offset, off_t const len, struct writeback_stats *const stats) {
+    unsigned long long const time_start = writeback_time_us();
+    if (sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+        pr_debug("Failed to wait for writeback of fd %d, errno: %d, error: %s\n", fd, errno, strerror(errno));
+    }
+    if (stats) {
+        unsigned long long const stall = writeback_time_us() - time_start;
+        atomic_fetch_add_explicit(&stats->waits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->stall_us, stall, memory_order_relaxed);
+        writeback_raise_max(&stats->stall_max_us, stall);
+    }
+    writeback_drop(fd, offset, len);
+}
+
+/* Told the file is written up to offset, every window starts its writeback and waits for the one
+   before, which is mostly done by then, so a file never has more than two windows dirty */
+void writeback_written(struct writeback *const writeback, int const fd, off_t const offset) {
+    if (offset <= writeback->written) {
+        return;
+    }
+    if (writeback->stats) {
+        writeback_account_dirty(writeback->stats, offset - writeback->written);
+    }
+    writeback->written = offset;
+    if (offset - writeback->started < WRITEBACK_WINDOW) {
+        return;
+    }
+    writeback_start(fd, writeback->started, offset - writeback->started);
+    if (writeback->started > writeback->dropped) {
+        writeback_wait(fd, writeback->dropped, writeback->started - writeback->dropped, writeback->stats);
+        if (writeback->stats) {
+            atomic_fetch_sub_explicit(&writeback->stats->dirty, writeback->started - writeback->dropped, memory_order_relaxed);
+        }
+        writeback->dropped = writeback->started;
+    }
+    writeback->started = offset;
+}
+
+/* A file given up on halfway, what's still dirty is left to the kernel and no longer counted */
+void writeback_abandon(struct writeback *const writeback) {
+    if (writeback->stats) {
+        atomic_fetch_sub_explicit(&writeback->stats->dirty, writeback->written - writeback->dropped, memory_order_relaxed);
+    }
+    writeback->started = writeback->dropped = writeback->written;
+}
+
+/* The whole file, as earlier ranges could have been rewritten after seeking back */
+void writeback_finish(struct writeback *const writeback, int const fd) {
+    writeback_wait(fd, 0, 0, writeback->stats);
+    writeback_abandon(writeback);
+}
@@ -9,6 +9,8 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <dirent.h>
 
 class Camera {
@@ -223,6 +225,7 @@ class Directory {
                 return;
         }
         update();
+        startWatching();
         fsblkcnt_t minFree = _fsTotal  / 100 * _minFree;
         fsblkcnt_t maxFree = _fsTotal / 100 * _maxFree;
         while (true) {
@@ -232,9 +235,13 @@ class Directory {
                     updateSpace();
                 }
             }
-            sleep(10);
-            if (_entries.size() == 0) {
-                updateEntries();
+            if (_inotify < 0) {
+                sleep(10);
+                if (_entries.size() == 0) {
+                    updateEntries();
+                }
+            } else {
+                waitEvents(10);
             }
             updateSpace();
         }
@@ -248,6 +255,7 @@ class Directory {
   protected:
     std::vector <Entry> _entries;
     static const uint _pathMaxLen = 128;
+    static const uint _eventsBufferLen = 0x10000;
 
   private:
     void updateEntries() {
@@ -292,6 +300,82 @@ class Directory {
         closedir(d);
         std::printf("Directory '%s' has %lu entries\n", _path, _entries.size());
     }
+    void startWatching() {
+        _inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_inotify < 0) {
+            std::printf("Failed to init inotify for directory '%s', falling back to rescanning, error: %d, %s\n", _path, errno, strerror(errno));
+            return;
+        }
+        if (inotify_add_watch(_inotify, _path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR) < 0) {
+            std::printf("Failed to watch directory '%s', falling back to rescanning, error: %d, %s\n", _path, errno, strerror(errno));
+            close(_inotify);
+            _inotify = -1;
+            return;
+        }
+        // Anything landed between the scan and the watch
+        updateEntries();
+    }
+    // Keeps _entries current from inotify events for up to timeout seconds, only rescans when events were lost
+    void waitEvents(int const timeout) {
+        pollfd pfd = {_inotify, POLLIN, 0};
+        int r = poll(&pfd, 1, timeout * 1000);
+        if (r < 0) {
+            if (errno == EINTR) {
+                return;
+            }
+            std::printf("Failed to poll inotify of directory '%s', error: %d, %s\n", _path, errno, strerror(errno));
+            throw std::runtime_error("Failed to poll inotify");
+        }
+        if (r == 0) {
+            return;
+        }
+        alignas(inotify_event) char buffer[_eventsBufferLen];
+        bool overflowed = false;
+        ssize_t len;
+        while ((len = read(_inotify, buffer, _eventsBufferLen)) > 0) {
+            for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + ((inotify_event *)ptr)->len) {
+                inotify_event const *event = (inotify_event *)ptr;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflowed = true;
+                } else if (event->len && !(event->mask & IN_ISDIR)) {
+                    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                        addEntry(event->name);
+                    } else {
+                        removeEntry(event->name);
+                    }
+                }
+            }
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+            std::printf("Failed to read inotify of directory '%s', error: %d, %s\n", _path, errno, strerror(errno));
+            throw std::runtime_error("Failed to read inotify");
+        }
+        if (overflowed) {
+            std::printf("Inotify queue of directory '%s' overflowed, rescanning\n", _path);
+            updateEntries();
+        }
+    }
+    void addEntry(const char *const name) {
+        removeEntry(name);
+        Entry entry;
+        memset(&entry, 0, sizeof entry);
+        strncpy(entry.name, name, 255);
+        snprintf(entry.path, 512, "%s/%s", _path, name);
+        struct stat st;
+        if (stat(entry.path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            return;
+        }
+        entry.ctime = st.st_ctim.tv_sec;
+        _entries.insert(std::upper_bound(_entries.begin(), _entries.end(), entry, compareEntry), entry);
+    }
+    void removeEntry(const char *const name) {
+        std::vector<Entry>::iterator iter = std::find_if(_entries.begin(), _entries.end(), [name](const Entry &entry) {
+            return !std::strcmp(entry.name, name);
+        });
+        if (iter != _entries.end()) {
+            _entries.erase(iter);
+        }
+    }
     void updateSpace() {
         // std::printf("Updating space of directory '%s'...\n", _path);
         struct statvfs stVFS;
@@ -316,11 +400,12 @@ class Directory {
     }
     virtual void clean() = 0;
     char _path[_pathMaxLen];
-    static bool compareEntry(Entry &a, Entry &b) {
+    static bool compareEntry(const Entry &a, const Entry &b) {
         // Newest first
         return a.ctime > b.ctime;
     }
     __pid_t _pid;
+    int _inotify = -1;
     fsblkcnt_t _fsFree;
     fsblkcnt_t _fsTotal;
     uint _minFree;